@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "genetic_asm.h"
+
+#define ARENA_CHUNK (1 << 20)
+
+/* Genomes are carved out of large chunks in size classes of ARENA_GRAIN
+ * instructions, so a program only takes the room its length needs and
+ * blocks freed by shrinking programs are reused by the next one of that
+ * size. A block holds the genome, the effective program and the live
+ * masks. */
+
+static inline int size_class( int length )
+{
+    return length <= ARENA_GRAIN ? 0 : (length - 1) / ARENA_GRAIN;
+}
+
+static inline size_t block_size( int class )
+{
+    return (size_t)(class + 1) * ARENA_GRAIN * (2 * sizeof(instruction_t) + sizeof(uint16_t));
+}
+
+void arena_init( genome_arena_t *arena )
+{
+    memset( arena, 0, sizeof(*arena) );
+}
+
+void arena_free( genome_arena_t *arena )
+{
+    for (int i = 0; i < arena->num_chunks; i++)
+        free( arena->chunks[i] );
+    free( arena->chunks );
+    memset( arena, 0, sizeof(*arena) );
+}
+
+static instruction_t *arena_alloc( genome_arena_t *arena, int class )
+{
+    size_t size = block_size( class );
+    instruction_t *block = arena->free[class];
+
+    if (block) {
+        memcpy( &arena->free[class], block, sizeof(block) );
+    } else {
+        if (!arena->chunk || arena->chunk_used + size > arena->chunk_size) {
+            void **chunks = realloc( arena->chunks, (arena->num_chunks + 1) * sizeof(*chunks) );
+            if (!chunks)
+                return NULL;
+            arena->chunks = chunks;
+            arena->chunk = malloc( ARENA_CHUNK );
+            if (!arena->chunk)
+                return NULL;
+            arena->chunks[arena->num_chunks++] = arena->chunk;
+            arena->chunk_used = 0;
+            arena->chunk_size = ARENA_CHUNK;
+        }
+        block = (instruction_t*)(arena->chunk + arena->chunk_used);
+        arena->chunk_used += size;
+    }
+    arena->bytes_used += size;
+    return block;
+}
+
+void program_release( genome_arena_t *arena, program_t *prog )
+{
+    if (prog->capacity) {
+        int class = size_class( prog->capacity );
+        memcpy( prog->instructions, &arena->free[class], sizeof(arena->free[class]) );
+        arena->free[class] = prog->instructions;
+        arena->bytes_used -= block_size( class );
+    }
+    prog->instructions = prog->effective = NULL;
+    prog->live = NULL;
+    prog->capacity = 0;
+}
+
+/* storage must hold PROGRAM_STORAGE(capacity) bytes. */
+void program_attach( program_t *prog, void *storage, int capacity )
+{
+    prog->instructions = storage;
+    prog->effective = prog->instructions + capacity;
+    prog->live = (uint16_t*)(prog->effective + capacity);
+    prog->capacity = 0;
+    prog->dirty = 0;
+    prog->credited = 0;
+}
+
+/* Make room for length instructions. The previous contents are lost if the
+ * program has to move to a bigger block. Programs attached to their own
+ * storage always have room for MAX_INSTR. */
+int program_reserve( genome_arena_t *arena, program_t *prog, int length )
+{
+    int class = size_class( length );
+    instruction_t *block;
+
+    assert(length <= MAX_INSTR);
+    if (!arena || (prog->capacity && size_class( prog->capacity ) == class))
+        return 0;
+
+    block = arena_alloc( arena, class );
+    if (!block)
+        return -1;
+    program_release( arena, prog );
+    prog->capacity = (class + 1) * ARENA_GRAIN;
+    prog->instructions = block;
+    prog->effective = block + prog->capacity;
+    prog->live = (uint16_t*)(prog->effective + prog->capacity);
+    prog->dirty = 0;
+    return 0;
+}
+
+/* Copy only what the source actually uses. dst is resized within arena, or
+ * must be attached to MAX_INSTR storage when arena is NULL. */
+int program_copy( genome_arena_t *arena, program_t *dst, const program_t *src )
+{
+    if (program_reserve( arena, dst, src->length[LEN_ABSOLUTE] ) < 0)
+        return -1;
+    dst->length[LEN_ABSOLUTE] = src->length[LEN_ABSOLUTE];
+    dst->length[LEN_EFFECTIVE] = src->length[LEN_EFFECTIVE];
+    dst->fitness = src->fitness;
+    dst->cost = src->cost;
+    dst->dirty = src->dirty;
+    dst->credited = src->credited;
+    memcpy( dst->instructions, src->instructions, src->length[LEN_ABSOLUTE] * sizeof(instruction_t) );
+    memcpy( dst->effective, src->effective, src->length[LEN_EFFECTIVE] * sizeof(instruction_t) );
+    memcpy( dst->live, src->live, src->length[LEN_ABSOLUTE] * sizeof(uint16_t) );
+    return 0;
+}
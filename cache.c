@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "genetic_asm.h"
+
+/* Fitness cache shared by all islands without locking. Each slot stores the
+ * result, the registers the fitness credited and the key xored with both,
+ * each written with a single atomic store.
+ * A reader racing with a writer can see halves of two different entries,
+ * but then the key check fails and it is simply treated as a miss. */
+
+/* Clear the fields an instruction ignores and clamp the counts whose
+ * effect saturates, so programs that only differ there hash the same. */
+static inline uint32_t canonical_instruction( const instruction_t *instr )
+{
+    unsigned op = instr->opcode, dst = instr->operands[0], src = instr->operands[1], imm = instr->operands[2];
+
+    switch (op) {
+        case PSLLDQ: case PSRLDQ:
+            src = 0;
+            if (imm > 16) imm = 16;
+            break;
+        case PSLLQ: case PSRLQ:
+            src = 0;
+            if (imm > 64) imm = 64;
+            break;
+        case PSLLD: case PSRLD:
+            src = 0;
+            if (imm > 32) imm = 32;
+            break;
+        case PSHUFLW: case PSHUFHW: case PSHUFD: case PBLENDW:
+            break;
+        case PALIGNR:
+            if (imm > 32) imm = 32;
+            break;
+        case PSHUFB:
+            src = 0;
+            break;
+        default:
+            imm = 0;
+            break;
+    }
+    return op | dst << 8 | src << 16 | imm << 24;
+}
+
+uint64_t hash_program( const instruction_t *instr, int length )
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+
+    for (int i = 0; i < length; i++) {
+        hash ^= canonical_instruction( &instr[i] );
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 29);
+}
+
+int cache_init( fitness_cache_t *cache, int size )
+{
+    int bits = 0;
+
+    memset( cache, 0, sizeof(*cache) );
+    if (!size)
+        return 0;
+    while ((1 << bits) < size)
+        bits++;
+    cache->entries = calloc( (size_t)1 << bits, sizeof(*cache->entries) );
+    if (!cache->entries)
+        return -1;
+    cache->mask = (1u << bits) - 1;
+    return 0;
+}
+
+void cache_free( fitness_cache_t *cache )
+{
+    free( cache->entries );
+    cache->entries = NULL;
+}
+
+int cache_lookup( fitness_cache_t *cache, uint64_t hash, int *fitness, int *cost, unsigned *credited )
+{
+    uint64_t *entry = cache->entries[hash & cache->mask];
+    uint64_t check = __atomic_load_n( &entry[0], __ATOMIC_RELAXED );
+    uint64_t data  = __atomic_load_n( &entry[1], __ATOMIC_RELAXED );
+    uint64_t live  = __atomic_load_n( &entry[2], __ATOMIC_RELAXED );
+
+    if ((check ^ data ^ live) != hash || !data)
+        return 0;
+    *fitness = (int32_t)(data >> 32);
+    *cost = (int32_t)data;
+    *credited = live;
+    return 1;
+}
+
+void cache_store( fitness_cache_t *cache, uint64_t hash, int fitness, int cost, unsigned credited )
+{
+    uint64_t *entry = cache->entries[hash & cache->mask];
+    uint64_t data = (uint64_t)(uint32_t)fitness << 32 | (uint32_t)cost;
+
+    __atomic_store_n( &entry[0], hash ^ data ^ credited, __ATOMIC_RELAXED );
+    __atomic_store_n( &entry[1], data, __ATOMIC_RELAXED );
+    __atomic_store_n( &entry[2], (uint64_t)credited, __ATOMIC_RELAXED );
+}
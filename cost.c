@@ -0,0 +1,233 @@
+#include <assert.h>
+#include <string.h>
+
+#include "genetic_asm.h"
+
+/* Cost of an effective program as estimated cycles: the longer of the
+ * dependency chain through the registers and the time the execution ports
+ * and the front end need for all its uops. Register renaming is assumed to
+ * remove every false dependency.
+ *
+ * Figures are for the register forms of the instructions, mostly from
+ * Agner Fog's instruction tables; pshufb counts as if its mask were loaded
+ * once outside the function's loop. A latency of 0 with no ports is a move
+ * eliminated at rename. */
+
+#define P(x) (1 << (x))
+#define MAX_PORT_CLASSES 6
+
+typedef struct op_timing {
+    double latency;
+    int uops;
+    int ports;          /* execution ports any of the uops can issue to */
+    double rthroughput; /* cycles between independent instructions */
+} op_timing_t;
+
+typedef struct cost_profile {
+    const char *name;
+    int issue_width;    /* uops per cycle through rename */
+    op_timing_t op[NUM_INSTR];
+} cost_profile_t;
+
+static const cost_profile_t profiles[] =
+{
+    /* Every instruction takes a cycle on its own: cost is the length of
+     * the effective program. */
+    { "length", 1, {
+        [PUNPCKLWD]  = { 1, 1, 0, 1 }, [PUNPCKHWD]  = { 1, 1, 0, 1 },
+        [PUNPCKLDQ]  = { 1, 1, 0, 1 }, [PUNPCKHDQ]  = { 1, 1, 0, 1 },
+        [PUNPCKLQDQ] = { 1, 1, 0, 1 }, [PUNPCKHQDQ] = { 1, 1, 0, 1 },
+        [MOVDQA]     = { 1, 1, 0, 1 },
+        [PSLLDQ]     = { 1, 1, 0, 1 }, [PSRLDQ]     = { 1, 1, 0, 1 },
+        [PSLLQ]      = { 1, 1, 0, 1 }, [PSRLQ]      = { 1, 1, 0, 1 },
+        [PSLLD]      = { 1, 1, 0, 1 }, [PSRLD]      = { 1, 1, 0, 1 },
+        [PSHUFLW]    = { 1, 1, 0, 1 }, [PSHUFHW]    = { 1, 1, 0, 1 },
+        [PSHUFD]     = { 1, 1, 0, 1 }, [PALIGNR]    = { 1, 1, 0, 1 },
+        [PSHUFB]     = { 1, 1, 0, 1 }, [PBLENDW]    = { 1, 1, 0, 1 },
+    }},
+    /* Penryn: the 128-bit shuffle unit on port 5. */
+    { "core2", 4, {
+        [PUNPCKLWD]  = { 1, 1, P(5), 1 }, [PUNPCKHWD]  = { 1, 1, P(5), 1 },
+        [PUNPCKLDQ]  = { 1, 1, P(5), 1 }, [PUNPCKHDQ]  = { 1, 1, P(5), 1 },
+        [PUNPCKLQDQ] = { 1, 1, P(0)|P(5), 0.5 }, [PUNPCKHQDQ] = { 1, 1, P(0)|P(5), 0.5 },
+        [MOVDQA]     = { 1, 1, P(0)|P(1)|P(5), 0.33 },
+        [PSLLDQ]     = { 1, 1, P(5), 1 }, [PSRLDQ]     = { 1, 1, P(5), 1 },
+        [PSLLQ]      = { 1, 1, P(1), 1 }, [PSRLQ]      = { 1, 1, P(1), 1 },
+        [PSLLD]      = { 1, 1, P(1), 1 }, [PSRLD]      = { 1, 1, P(1), 1 },
+        [PSHUFLW]    = { 1, 1, P(5), 1 }, [PSHUFHW]    = { 1, 1, P(5), 1 },
+        [PSHUFD]     = { 1, 1, P(5), 1 }, [PALIGNR]    = { 1, 1, P(5), 1 },
+        [PSHUFB]     = { 1, 1, P(5), 1 }, [PBLENDW]    = { 1, 1, P(0)|P(1)|P(5), 0.33 },
+    }},
+    /* Sandy Bridge: shuffles on ports 1 and 5, no move elimination. */
+    { "sandybridge", 4, {
+        [PUNPCKLWD]  = { 1, 1, P(1)|P(5), 0.5 }, [PUNPCKHWD]  = { 1, 1, P(1)|P(5), 0.5 },
+        [PUNPCKLDQ]  = { 1, 1, P(1)|P(5), 0.5 }, [PUNPCKHDQ]  = { 1, 1, P(1)|P(5), 0.5 },
+        [PUNPCKLQDQ] = { 1, 1, P(1)|P(5), 0.5 }, [PUNPCKHQDQ] = { 1, 1, P(1)|P(5), 0.5 },
+        [MOVDQA]     = { 1, 1, P(0)|P(1)|P(5), 0.33 },
+        [PSLLDQ]     = { 1, 1, P(1)|P(5), 0.5 }, [PSRLDQ]     = { 1, 1, P(1)|P(5), 0.5 },
+        [PSLLQ]      = { 1, 1, P(0), 1 }, [PSRLQ]      = { 1, 1, P(0), 1 },
+        [PSLLD]      = { 1, 1, P(0), 1 }, [PSRLD]      = { 1, 1, P(0), 1 },
+        [PSHUFLW]    = { 1, 1, P(1)|P(5), 0.5 }, [PSHUFHW]    = { 1, 1, P(1)|P(5), 0.5 },
+        [PSHUFD]     = { 1, 1, P(1)|P(5), 0.5 }, [PALIGNR]    = { 1, 1, P(1)|P(5), 0.5 },
+        [PSHUFB]     = { 1, 1, P(1)|P(5), 0.5 }, [PBLENDW]    = { 1, 1, P(1)|P(5), 0.5 },
+    }},
+    /* Haswell: a single shuffle port. */
+    { "haswell", 4, {
+        [PUNPCKLWD]  = { 1, 1, P(5), 1 }, [PUNPCKHWD]  = { 1, 1, P(5), 1 },
+        [PUNPCKLDQ]  = { 1, 1, P(5), 1 }, [PUNPCKHDQ]  = { 1, 1, P(5), 1 },
+        [PUNPCKLQDQ] = { 1, 1, P(5), 1 }, [PUNPCKHQDQ] = { 1, 1, P(5), 1 },
+        [MOVDQA]     = { 0, 1, 0, 0.25 },
+        [PSLLDQ]     = { 1, 1, P(5), 1 }, [PSRLDQ]     = { 1, 1, P(5), 1 },
+        [PSLLQ]      = { 1, 1, P(0), 1 }, [PSRLQ]      = { 1, 1, P(0), 1 },
+        [PSLLD]      = { 1, 1, P(0), 1 }, [PSRLD]      = { 1, 1, P(0), 1 },
+        [PSHUFLW]    = { 1, 1, P(5), 1 }, [PSHUFHW]    = { 1, 1, P(5), 1 },
+        [PSHUFD]     = { 1, 1, P(5), 1 }, [PALIGNR]    = { 1, 1, P(5), 1 },
+        [PSHUFB]     = { 1, 1, P(5), 1 }, [PBLENDW]    = { 1, 1, P(5), 1 },
+    }},
+    /* Skylake: as Haswell, with shifts on ports 0 and 1. */
+    { "skylake", 4, {
+        [PUNPCKLWD]  = { 1, 1, P(5), 1 }, [PUNPCKHWD]  = { 1, 1, P(5), 1 },
+        [PUNPCKLDQ]  = { 1, 1, P(5), 1 }, [PUNPCKHDQ]  = { 1, 1, P(5), 1 },
+        [PUNPCKLQDQ] = { 1, 1, P(5), 1 }, [PUNPCKHQDQ] = { 1, 1, P(5), 1 },
+        [MOVDQA]     = { 0, 1, 0, 0.25 },
+        [PSLLDQ]     = { 1, 1, P(5), 1 }, [PSRLDQ]     = { 1, 1, P(5), 1 },
+        [PSLLQ]      = { 1, 1, P(0)|P(1), 0.5 }, [PSRLQ]      = { 1, 1, P(0)|P(1), 0.5 },
+        [PSLLD]      = { 1, 1, P(0)|P(1), 0.5 }, [PSRLD]      = { 1, 1, P(0)|P(1), 0.5 },
+        [PSHUFLW]    = { 1, 1, P(5), 1 }, [PSHUFHW]    = { 1, 1, P(5), 1 },
+        [PSHUFD]     = { 1, 1, P(5), 1 }, [PALIGNR]    = { 1, 1, P(5), 1 },
+        [PSHUFB]     = { 1, 1, P(5), 1 }, [PBLENDW]    = { 1, 1, P(5), 1 },
+    }},
+    /* Zen 2: shuffles on FP pipes 1 and 2, shifts on pipe 2. */
+    { "zen2", 5, {
+        [PUNPCKLWD]  = { 1, 1, P(1)|P(2), 0.5 }, [PUNPCKHWD]  = { 1, 1, P(1)|P(2), 0.5 },
+        [PUNPCKLDQ]  = { 1, 1, P(1)|P(2), 0.5 }, [PUNPCKHDQ]  = { 1, 1, P(1)|P(2), 0.5 },
+        [PUNPCKLQDQ] = { 1, 1, P(1)|P(2), 0.5 }, [PUNPCKHQDQ] = { 1, 1, P(1)|P(2), 0.5 },
+        [MOVDQA]     = { 0, 1, 0, 0.2 },
+        [PSLLDQ]     = { 1, 1, P(1)|P(2), 0.5 }, [PSRLDQ]     = { 1, 1, P(1)|P(2), 0.5 },
+        [PSLLQ]      = { 1, 1, P(2), 1 }, [PSRLQ]      = { 1, 1, P(2), 1 },
+        [PSLLD]      = { 1, 1, P(2), 1 }, [PSRLD]      = { 1, 1, P(2), 1 },
+        [PSHUFLW]    = { 1, 1, P(1)|P(2), 0.5 }, [PSHUFHW]    = { 1, 1, P(1)|P(2), 0.5 },
+        [PSHUFD]     = { 1, 1, P(1)|P(2), 0.5 }, [PALIGNR]    = { 1, 1, P(1)|P(2), 0.5 },
+        [PSHUFB]     = { 1, 1, P(1)|P(2), 0.5 }, [PBLENDW]    = { 1, 1, P(0)|P(1)|P(3), 0.33 },
+    }},
+};
+
+#define NUM_PROFILES ((int)(sizeof(profiles) / sizeof(profiles[0])))
+
+/* The selected profile in cost units. Instructions are grouped by the set of
+ * ports they can use; for every union of groups, the port time of the
+ * groups that fit in it spread over its ports bounds the cycle count. */
+static struct {
+    int issue;                          /* cost of a uop at the issue width */
+    struct {
+        int latency;
+        int uops;
+        int port_class;                 /* -1 if it needs no port */
+        int port_cost;                  /* port time, summed over its ports */
+    } op[NUM_INSTR];
+    int num_classes;
+    int class_ports[MAX_PORT_CLASSES];
+    int subset_classes[1 << MAX_PORT_CLASSES];  /* classes fitting in each union */
+    int subset_ports[1 << MAX_PORT_CLASSES];    /* number of ports of the union */
+} model;
+
+static int popcount( unsigned x )
+{
+    int n = 0;
+    for( ; x; x &= x - 1 )
+        n++;
+    return n;
+}
+
+int init_cost_model( const char *name )
+{
+    const cost_profile_t *profile = NULL;
+
+    for( int i = 0; i < NUM_PROFILES; i++ )
+        if( !strcmp( name, profiles[i].name ) )
+            profile = &profiles[i];
+    if( !profile )
+        return -1;
+
+    memset( &model, 0, sizeof(model) );
+    model.issue = COST_SCALE / profile->issue_width;
+    for( int i = 0; i < NUM_INSTR; i++ )
+    {
+        const op_timing_t *t = &profile->op[i];
+        int c;
+
+        model.op[i].latency = t->latency * COST_SCALE + 0.5;
+        model.op[i].uops = t->uops;
+        model.op[i].port_class = -1;
+        if( !t->ports )
+            continue;
+        for( c = 0; c < model.num_classes; c++ )
+            if( model.class_ports[c] == t->ports )
+                break;
+        if( c == model.num_classes )
+        {
+            assert( c < MAX_PORT_CLASSES );
+            model.class_ports[model.num_classes++] = t->ports;
+        }
+        model.op[i].port_class = c;
+        model.op[i].port_cost = t->rthroughput * popcount( t->ports ) * COST_SCALE + 0.5;
+    }
+
+    for( int s = 1; s < 1 << model.num_classes; s++ )
+    {
+        int ports = 0;
+        for( int c = 0; c < model.num_classes; c++ )
+            if( s & (1 << c) )
+                ports |= model.class_ports[c];
+        for( int c = 0; c < model.num_classes; c++ )
+            if( !(model.class_ports[c] & ~ports) )
+                model.subset_classes[s] |= 1 << c;
+        model.subset_ports[s] = popcount( ports );
+    }
+    return 0;
+}
+
+int instruction_latency( int opcode )
+{
+    return model.op[opcode].latency;
+}
+
+int program_cost( const instruction_t *instr, int length )
+{
+    int ready[NUM_REGS] = { 0 };
+    int port_time[MAX_PORT_CLASSES] = { 0 };
+    int uops = 0, cost = 0;
+
+    for( int i = 0; i < length; i++ )
+    {
+        const instruction_t *in = &instr[i];
+        int op = in->opcode, start = 0, p;
+
+        if( reads_dst( in ) )
+            start = ready[in->operands[0]];
+        if( reads_src( in ) && ready[in->operands[1]] > start )
+            start = ready[in->operands[1]];
+        ready[in->operands[0]] = start + model.op[op].latency;
+        if( ready[in->operands[0]] > cost )
+            cost = ready[in->operands[0]];
+
+        uops += model.op[op].uops;
+        p = model.op[op].port_class;
+        if( p >= 0 )
+            port_time[p] += model.op[op].port_cost;
+    }
+
+    if( uops * model.issue > cost )
+        cost = uops * model.issue;
+    for( int s = 1; s < 1 << model.num_classes; s++ )
+    {
+        int time = 0;
+        for( int c = 0; c < model.num_classes; c++ )
+            if( model.subset_classes[s] & (1 << c) )
+                time += port_time[c];
+        time /= model.subset_ports[s];
+        if( time > cost )
+            cost = time;
+    }
+    return cost;
+}
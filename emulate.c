@@ -0,0 +1,886 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#define HAVE_SSE2 1
+#include <immintrin.h>
+#else
+#define HAVE_SSE2 0
+#endif
+
+#include "genetic_asm.h"
+
+execute_instruction_t execute_instruction = execute_instruction_c;
+execute_batch_t execute_batch = execute_batch_c;
+xmm_register_t pshufb_masks[PSHUFB_MASKS][2];
+
+static void execute_op_c( const instruction_t *instr, xmm_register_t *output, const xmm_register_t *input1 )
+{
+    xmm_register_t temp;
+    uint8_t imm = instr->operands[2];
+    int i;
+
+    switch( instr->opcode )
+    {
+        case PUNPCKLWD:
+            temp.wd[0] = output->wd[0];
+            temp.wd[2] = output->wd[1];
+            temp.wd[4] = output->wd[2];
+            temp.wd[6] = output->wd[3];
+            temp.wd[1] = input1->wd[0];
+            temp.wd[3] = input1->wd[1];
+            temp.wd[5] = input1->wd[2];
+            temp.wd[7] = input1->wd[3];
+            break;
+        case PUNPCKHWD:
+            temp.wd[0] = output->wd[4];
+            temp.wd[2] = output->wd[5];
+            temp.wd[4] = output->wd[6];
+            temp.wd[6] = output->wd[7];
+            temp.wd[1] = input1->wd[4];
+            temp.wd[3] = input1->wd[5];
+            temp.wd[5] = input1->wd[6];
+            temp.wd[7] = input1->wd[7];
+            break;
+        case PUNPCKLDQ:
+            temp.d[0] = output->d[0];
+            temp.d[2] = output->d[1];
+            temp.d[1] = input1->d[0];
+            temp.d[3] = input1->d[1];
+            break;
+        case PUNPCKHDQ:
+            temp.d[0] = output->d[2];
+            temp.d[2] = output->d[3];
+            temp.d[1] = input1->d[2];
+            temp.d[3] = input1->d[3];
+            break;
+        case PUNPCKLQDQ:
+            temp.q[0] = output->q[0];
+            temp.q[1] = input1->q[0];
+            break;
+        case PUNPCKHQDQ:
+            temp.q[0] = output->q[1];
+            temp.q[1] = input1->q[1];
+            break;
+        case MOVDQA:
+            temp.q[0] = input1->q[0];
+            temp.q[1] = input1->q[1];
+            break;
+        /* Byte shifts move towards the higher (pslldq) or lower (psrldq)
+         * byte index, as the hardware does. */
+        case PSLLDQ:
+            if (imm > 16) imm = 16;
+            for( i = 0; i < imm; i++ )
+                temp.b[i] = 0;
+            for( ; i < 16; i++ )
+                temp.b[i] = output->b[i-imm];
+            break;
+        case PSRLDQ:
+            if (imm > 16) imm = 16;
+            for( i = 0; i < 16 - imm; i++ )
+                temp.b[i] = output->b[i+imm];
+            for( ; i < 16; i++ )
+                temp.b[i] = 0;
+            break;
+        /* Shifting by the element width or more is undefined in C, but
+         * zeroes the element in hardware. */
+        case PSLLQ:
+            if (imm > 63) {
+                temp.q[0] = 0;
+                temp.q[1] = 0;
+            } else {
+                for (i = 0; i < 2; i++)
+                    temp.q[i] = output->q[i] << imm;
+            }
+            break;
+        case PSRLQ:
+            if (imm > 63) {
+                temp.q[0] = 0;
+                temp.q[1] = 0;
+            } else {
+                for (i = 0; i < 2; i++)
+                    temp.q[i] = output->q[i] >> imm;
+            }
+            break;
+        case PSLLD:
+            if (imm > 31) {
+                temp.q[0] = 0;
+                temp.q[1] = 0;
+            } else {
+                for (i = 0; i < 4; i++)
+                    temp.d[i] = output->d[i] << imm;
+            }
+            break;
+        case PSRLD:
+            if (imm > 31) {
+                temp.q[0] = 0;
+                temp.q[1] = 0;
+            } else {
+                for (i = 0; i < 4; i++)
+                    temp.d[i] = output->d[i] >> imm;
+            }
+            break;
+        case PSHUFLW:
+            temp.wd[0] = input1->wd[imm&0x3]; imm >>= 2;
+            temp.wd[1] = input1->wd[imm&0x3]; imm >>= 2;
+            temp.wd[2] = input1->wd[imm&0x3]; imm >>= 2;
+            temp.wd[3] = input1->wd[imm&0x3];
+            temp.q[1] = input1->q[1];
+            break;
+        case PSHUFHW:
+            temp.q[0] = input1->q[0];
+            temp.wd[4] = input1->wd[4+(imm&0x3)]; imm >>= 2;
+            temp.wd[5] = input1->wd[4+(imm&0x3)]; imm >>= 2;
+            temp.wd[6] = input1->wd[4+(imm&0x3)]; imm >>= 2;
+            temp.wd[7] = input1->wd[4+(imm&0x3)];
+            break;
+        case PSHUFD:
+            for (i = 0; i < 4; i++, imm >>= 2)
+                temp.d[i] = input1->d[imm&0x3];
+            break;
+        /* The bytes of output:input1 shifted right by imm bytes. */
+        case PALIGNR:
+            for (i = 0; i < 16; i++)
+                temp.b[i] = i+imm < 16 ? input1->b[i+imm] : i+imm < 32 ? output->b[i+imm-16] : 0;
+            break;
+        case PSHUFB:
+            for (i = 0; i < 16; i++) {
+                uint8_t m = pshufb_masks[imm][0].b[i];
+                temp.b[i] = m & 0x80 ? 0 : output->b[m&0xf];
+            }
+            break;
+        case PBLENDW:
+            for (i = 0; i < 8; i++, imm >>= 1)
+                temp.wd[i] = imm & 1 ? input1->wd[i] : output->wd[i];
+            break;
+        default:
+            fprintf( stderr, "Error: unsupported instruction %d %d %d %d!\n", instr->opcode, instr->operands[0], instr->operands[1], instr->operands[2]);
+            abort();
+    }
+
+    memcpy( output, &temp, sizeof(*output) );
+}
+
+void execute_instruction_c( const instruction_t *instr, xmm_register_t *registers )
+{
+    execute_op_c( instr, &registers[instr->operands[0]], &registers[instr->operands[1]] );
+}
+
+void execute_batch_c( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    for( int i = 0; i < length; i++, instr++ )
+        for( int k = 0; k < BATCH_REF; k++ )
+            execute_op_c( instr, &registers[instr->operands[0]][k], &registers[instr->operands[1]][k] );
+}
+
+#if HAVE_SSE2
+/* The immediate forms of the byte shifts and word shuffles need a compile-time
+ * constant, so expand one case per possible immediate. */
+#define CASE1(op, r, s, i)  case (i): r = op(s, (i)); break;
+#define CASE4(op, r, s, i)  CASE1(op, r, s, (i))   CASE1(op, r, s, (i)+1)  CASE1(op, r, s, (i)+2)  CASE1(op, r, s, (i)+3)
+#define CASE16(op, r, s, i) CASE4(op, r, s, (i))   CASE4(op, r, s, (i)+4)  CASE4(op, r, s, (i)+8)  CASE4(op, r, s, (i)+12)
+#define CASE64(op, r, s, i) CASE16(op, r, s, (i))  CASE16(op, r, s, (i)+16) CASE16(op, r, s, (i)+32) CASE16(op, r, s, (i)+48)
+
+static inline __m128i byte_shift_left( __m128i s, int imm )
+{
+    __m128i r;
+    switch( imm ) {
+        CASE16(_mm_slli_si128, r, s, 0)
+        default: r = _mm_setzero_si128(); break;
+    }
+    return r;
+}
+
+static inline __m128i byte_shift_right( __m128i s, int imm )
+{
+    __m128i r;
+    switch( imm ) {
+        CASE16(_mm_srli_si128, r, s, 0)
+        default: r = _mm_setzero_si128(); break;
+    }
+    return r;
+}
+
+static inline __m128i shuffle_low( __m128i s, int imm )
+{
+    __m128i r;
+    switch( imm ) {
+        CASE64(_mm_shufflelo_epi16, r, s, 0)
+        CASE64(_mm_shufflelo_epi16, r, s, 64)
+        CASE64(_mm_shufflelo_epi16, r, s, 128)
+        CASE64(_mm_shufflelo_epi16, r, s, 192)
+        default: r = s; assert(0); break;
+    }
+    return r;
+}
+
+static inline __m128i shuffle_high( __m128i s, int imm )
+{
+    __m128i r;
+    switch( imm ) {
+        CASE64(_mm_shufflehi_epi16, r, s, 0)
+        CASE64(_mm_shufflehi_epi16, r, s, 64)
+        CASE64(_mm_shufflehi_epi16, r, s, 128)
+        CASE64(_mm_shufflehi_epi16, r, s, 192)
+        default: r = s; assert(0); break;
+    }
+    return r;
+}
+
+static inline __m128i shuffle_dword( __m128i s, int imm )
+{
+    __m128i r;
+    switch( imm ) {
+        CASE64(_mm_shuffle_epi32, r, s, 0)
+        CASE64(_mm_shuffle_epi32, r, s, 64)
+        CASE64(_mm_shuffle_epi32, r, s, 128)
+        CASE64(_mm_shuffle_epi32, r, s, 192)
+        default: r = s; assert(0); break;
+    }
+    return r;
+}
+
+#undef CASE64
+#undef CASE16
+#undef CASE4
+#undef CASE1
+
+static void execute_instruction_sse2( const instruction_t *instr, xmm_register_t *registers )
+{
+    __m128i *output = (__m128i*)&registers[instr->operands[0]];
+    __m128i dst = _mm_loadu_si128(output);
+    __m128i src = _mm_loadu_si128((__m128i*)&registers[instr->operands[1]]);
+    int imm = instr->operands[2];
+
+    switch( instr->opcode )
+    {
+        case PUNPCKLWD:  dst = _mm_unpacklo_epi16(dst, src); break;
+        case PUNPCKHWD:  dst = _mm_unpackhi_epi16(dst, src); break;
+        case PUNPCKLDQ:  dst = _mm_unpacklo_epi32(dst, src); break;
+        case PUNPCKHDQ:  dst = _mm_unpackhi_epi32(dst, src); break;
+        case PUNPCKLQDQ: dst = _mm_unpacklo_epi64(dst, src); break;
+        case PUNPCKHQDQ: dst = _mm_unpackhi_epi64(dst, src); break;
+        case MOVDQA:     dst = src; break;
+        case PSLLDQ:     dst = byte_shift_left(dst, imm); break;
+        case PSRLDQ:     dst = byte_shift_right(dst, imm); break;
+        /* The register-count forms take any count and zero on overflow. */
+        case PSLLQ:      dst = _mm_sll_epi64(dst, _mm_cvtsi32_si128(imm)); break;
+        case PSRLQ:      dst = _mm_srl_epi64(dst, _mm_cvtsi32_si128(imm)); break;
+        case PSLLD:      dst = _mm_sll_epi32(dst, _mm_cvtsi32_si128(imm)); break;
+        case PSRLD:      dst = _mm_srl_epi32(dst, _mm_cvtsi32_si128(imm)); break;
+        case PSHUFLW:    dst = shuffle_low(src, imm); break;
+        case PSHUFHW:    dst = shuffle_high(src, imm); break;
+        case PSHUFD:     dst = shuffle_dword(src, imm); break;
+        /* SSSE3 and SSE4.1 are not part of this baseline. */
+        case PALIGNR:
+        case PSHUFB:
+        case PBLENDW:
+            execute_instruction_c(instr, registers);
+            return;
+        default:
+            fprintf( stderr, "Error: unsupported instruction %d %d %d %d!\n", instr->opcode, instr->operands[0], instr->operands[1], instr->operands[2]);
+            assert(instr->opcode < NUM_INSTR);
+    }
+
+    _mm_storeu_si128(output, dst);
+}
+
+/* Batched versions: each register holds BATCH_REF reference vectors side by
+ * side, and every instruction is decoded once and applied to all of them.
+ * The 256 and 512-bit unpacks, byte shifts, shuffles, palignr and pblendw
+ * all work within 128-bit lanes, so one wide op emulates the instruction for
+ * 2 or 4 vectors. The SSE2 version leaves the SSSE3 and SSE4.1 instructions
+ * to the C one.
+ *
+ * LANES(expr) evaluates expr for every vector of the destination with d and s
+ * bound to the destination and source, OP(d, s, i) is the immediate form of
+ * the current instruction. */
+#define IMM1(i)  case (i): LANES(OP(d, s, (i))) break;
+#define IMM4(i)  IMM1(i)      IMM1((i)+1)   IMM1((i)+2)   IMM1((i)+3)
+#define IMM16(i) IMM4(i)      IMM4((i)+4)   IMM4((i)+8)   IMM4((i)+12)
+#define IMM64(i) IMM16(i)     IMM16((i)+16) IMM16((i)+32) IMM16((i)+48)
+#define IMM256   IMM64(0)     IMM64(64)     IMM64(128)    IMM64(192)
+
+static void execute_batch_sse2( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    for( int n = 0; n < length; n++, instr++ ) {
+        __m128i *dst = (__m128i*)registers[instr->operands[0]];
+        __m128i *src = (__m128i*)registers[instr->operands[1]];
+        __m128i count = _mm_cvtsi32_si128(instr->operands[2]);
+
+#define LANES(expr)\
+        for( int k = 0; k < BATCH_REF; k++ ) {\
+            __m128i d = _mm_loadu_si128(dst+k), s = _mm_loadu_si128(src+k);\
+            (void)d; (void)s;\
+            _mm_storeu_si128(dst+k, expr);\
+        }
+        switch( instr->opcode )
+        {
+            case PUNPCKLWD:  LANES(_mm_unpacklo_epi16(d, s)) break;
+            case PUNPCKHWD:  LANES(_mm_unpackhi_epi16(d, s)) break;
+            case PUNPCKLDQ:  LANES(_mm_unpacklo_epi32(d, s)) break;
+            case PUNPCKHDQ:  LANES(_mm_unpackhi_epi32(d, s)) break;
+            case PUNPCKLQDQ: LANES(_mm_unpacklo_epi64(d, s)) break;
+            case PUNPCKHQDQ: LANES(_mm_unpackhi_epi64(d, s)) break;
+            case MOVDQA:     LANES(s) break;
+            case PSLLQ:      LANES(_mm_sll_epi64(d, count)) break;
+            case PSRLQ:      LANES(_mm_srl_epi64(d, count)) break;
+            case PSLLD:      LANES(_mm_sll_epi32(d, count)) break;
+            case PSRLD:      LANES(_mm_srl_epi32(d, count)) break;
+#define OP(d, s, i) _mm_slli_si128(d, i)
+            case PSLLDQ:  switch( instr->operands[2] ) { IMM16(0) default: LANES(_mm_setzero_si128()) } break;
+#undef OP
+#define OP(d, s, i) _mm_srli_si128(d, i)
+            case PSRLDQ:  switch( instr->operands[2] ) { IMM16(0) default: LANES(_mm_setzero_si128()) } break;
+#undef OP
+#define OP(d, s, i) _mm_shufflelo_epi16(s, i)
+            case PSHUFLW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm_shufflehi_epi16(s, i)
+            case PSHUFHW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm_shuffle_epi32(s, i)
+            case PSHUFD:  switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+            case PALIGNR:
+            case PSHUFB:
+            case PBLENDW:
+                execute_batch_c( instr, 1, registers );
+                break;
+            default:
+                fprintf( stderr, "Error: unsupported instruction %d %d %d %d!\n", instr->opcode, instr->operands[0], instr->operands[1], instr->operands[2]);
+                assert(instr->opcode < NUM_INSTR);
+        }
+#undef LANES
+    }
+}
+
+#if defined(__GNUC__) && (__GNUC__ >= 5)
+#define HAVE_AVX 1
+
+__attribute__((target("avx2")))
+static void execute_batch_avx2( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    for( int n = 0; n < length; n++, instr++ ) {
+        __m256i *dst = (__m256i*)registers[instr->operands[0]];
+        __m256i *src = (__m256i*)registers[instr->operands[1]];
+        __m128i count = _mm_cvtsi32_si128(instr->operands[2]);
+
+#define LANES(expr)\
+        for( int k = 0; k < BATCH_REF/2; k++ ) {\
+            __m256i d = _mm256_loadu_si256(dst+k), s = _mm256_loadu_si256(src+k);\
+            (void)d; (void)s;\
+            _mm256_storeu_si256(dst+k, expr);\
+        }
+        switch( instr->opcode )
+        {
+            case PUNPCKLWD:  LANES(_mm256_unpacklo_epi16(d, s)) break;
+            case PUNPCKHWD:  LANES(_mm256_unpackhi_epi16(d, s)) break;
+            case PUNPCKLDQ:  LANES(_mm256_unpacklo_epi32(d, s)) break;
+            case PUNPCKHDQ:  LANES(_mm256_unpackhi_epi32(d, s)) break;
+            case PUNPCKLQDQ: LANES(_mm256_unpacklo_epi64(d, s)) break;
+            case PUNPCKHQDQ: LANES(_mm256_unpackhi_epi64(d, s)) break;
+            case MOVDQA:     LANES(s) break;
+            case PSLLQ:      LANES(_mm256_sll_epi64(d, count)) break;
+            case PSRLQ:      LANES(_mm256_srl_epi64(d, count)) break;
+            case PSLLD:      LANES(_mm256_sll_epi32(d, count)) break;
+            case PSRLD:      LANES(_mm256_srl_epi32(d, count)) break;
+#define OP(d, s, i) _mm256_slli_si256(d, i)
+            case PSLLDQ:  switch( instr->operands[2] ) { IMM16(0) default: LANES(_mm256_setzero_si256()) } break;
+#undef OP
+#define OP(d, s, i) _mm256_srli_si256(d, i)
+            case PSRLDQ:  switch( instr->operands[2] ) { IMM16(0) default: LANES(_mm256_setzero_si256()) } break;
+#undef OP
+#define OP(d, s, i) _mm256_shufflelo_epi16(s, i)
+            case PSHUFLW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm256_shufflehi_epi16(s, i)
+            case PSHUFHW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm256_shuffle_epi32(s, i)
+            case PSHUFD:  switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm256_alignr_epi8(d, s, i)
+            case PALIGNR: switch( instr->operands[2] ) { IMM16(0) IMM16(16) default: LANES(_mm256_setzero_si256()) } break;
+#undef OP
+            case PSHUFB: {
+                __m256i mask = _mm256_loadu_si256((__m256i*)pshufb_masks[instr->operands[2]]);
+                LANES(_mm256_shuffle_epi8(d, mask))
+                break;
+            }
+#define OP(d, s, i) _mm256_blend_epi16(d, s, i)
+            case PBLENDW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+            default:
+                fprintf( stderr, "Error: unsupported instruction %d %d %d %d!\n", instr->opcode, instr->operands[0], instr->operands[1], instr->operands[2]);
+                assert(instr->opcode < NUM_INSTR);
+        }
+#undef LANES
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void execute_batch_avx512( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    for( int n = 0; n < length; n++, instr++ ) {
+        __m512i *dst = (__m512i*)registers[instr->operands[0]];
+        __m512i *src = (__m512i*)registers[instr->operands[1]];
+        __m128i count = _mm_cvtsi32_si128(instr->operands[2]);
+
+#define LANES(expr)\
+        for( int k = 0; k < BATCH_REF/4; k++ ) {\
+            __m512i d = _mm512_loadu_si512(dst+k), s = _mm512_loadu_si512(src+k);\
+            (void)d; (void)s;\
+            _mm512_storeu_si512(dst+k, expr);\
+        }
+        switch( instr->opcode )
+        {
+            case PUNPCKLWD:  LANES(_mm512_unpacklo_epi16(d, s)) break;
+            case PUNPCKHWD:  LANES(_mm512_unpackhi_epi16(d, s)) break;
+            case PUNPCKLDQ:  LANES(_mm512_unpacklo_epi32(d, s)) break;
+            case PUNPCKHDQ:  LANES(_mm512_unpackhi_epi32(d, s)) break;
+            case PUNPCKLQDQ: LANES(_mm512_unpacklo_epi64(d, s)) break;
+            case PUNPCKHQDQ: LANES(_mm512_unpackhi_epi64(d, s)) break;
+            case MOVDQA:     LANES(s) break;
+            case PSLLQ:      LANES(_mm512_sll_epi64(d, count)) break;
+            case PSRLQ:      LANES(_mm512_srl_epi64(d, count)) break;
+            case PSLLD:      LANES(_mm512_sll_epi32(d, count)) break;
+            case PSRLD:      LANES(_mm512_srl_epi32(d, count)) break;
+#define OP(d, s, i) _mm512_bslli_epi128(d, i)
+            case PSLLDQ:  switch( instr->operands[2] ) { IMM16(0) default: LANES(_mm512_setzero_si512()) } break;
+#undef OP
+#define OP(d, s, i) _mm512_bsrli_epi128(d, i)
+            case PSRLDQ:  switch( instr->operands[2] ) { IMM16(0) default: LANES(_mm512_setzero_si512()) } break;
+#undef OP
+#define OP(d, s, i) _mm512_shufflelo_epi16(s, i)
+            case PSHUFLW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm512_shufflehi_epi16(s, i)
+            case PSHUFHW: switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm512_shuffle_epi32(s, (_MM_PERM_ENUM)(i))
+            case PSHUFD:  switch( instr->operands[2] ) { IMM256 } break;
+#undef OP
+#define OP(d, s, i) _mm512_alignr_epi8(d, s, i)
+            case PALIGNR: switch( instr->operands[2] ) { IMM16(0) IMM16(16) default: LANES(_mm512_setzero_si512()) } break;
+#undef OP
+            case PSHUFB: {
+                __m512i mask = _mm512_broadcast_i32x4(_mm_loadu_si128((__m128i*)pshufb_masks[instr->operands[2]]));
+                LANES(_mm512_shuffle_epi8(d, mask))
+                break;
+            }
+            /* The immediate applies to every 128-bit lane. */
+            case PBLENDW: {
+                __mmask32 blend = instr->operands[2] * 0x01010101u;
+                LANES(_mm512_mask_blend_epi16(blend, d, s))
+                break;
+            }
+            default:
+                fprintf( stderr, "Error: unsupported instruction %d %d %d %d!\n", instr->opcode, instr->operands[0], instr->operands[1], instr->operands[2]);
+                assert(instr->opcode < NUM_INSTR);
+        }
+#undef LANES
+    }
+}
+#else
+#define HAVE_AVX 0
+#endif
+
+#undef IMM256
+#undef IMM64
+#undef IMM16
+#undef IMM4
+#undef IMM1
+
+#if HAVE_AVX
+/* Direct-threaded version. A run of instructions is first decoded to an
+ * array of handler addresses with the register pointers resolved and the
+ * immediate turned into pshufb masks, then the handlers chain to each other
+ * by computed goto, each applying its instruction to every reference vector.
+ * Byte shifts, word and dword shuffles, palignr and pblendw all become one
+ * or two pshufb, so they cost no dispatch on the immediate. */
+#define THREADED_CHUNK 64
+
+typedef struct threaded_op {
+    const void *handler;
+    xmm_register_t *dst;
+    const xmm_register_t *src;
+    const xmm_register_t *mask;     /* bytes of dst, then of src */
+    int count;
+} threaded_op_t;
+
+static xmm_register_t permute_masks[NUM_INSTR][256][2];
+
+/* Take the permutation every immediate instruction does from the C emulator,
+ * by running it on registers holding the byte numbers 1-32. 0x80 zeroes. */
+static void init_permute_masks( void )
+{
+    static const uint8_t ops[] = { PSLLDQ, PSRLDQ, PSHUFLW, PSHUFHW, PSHUFD, PALIGNR, PBLENDW };
+    instruction_t instr = { 0, { 0, 1, 0 } };
+    xmm_register_t regs[2];
+
+    for( int i = 0; i < (int)sizeof(ops); i++ )
+        for( int imm = 0; imm < 256; imm++ ) {
+            xmm_register_t *mask = permute_masks[ops[i]][imm];
+
+            for( int b = 0; b < 16; b++ ) {
+                regs[0].b[b] = b + 1;
+                regs[1].b[b] = b + 17;
+            }
+            instr.opcode = ops[i];
+            instr.operands[2] = imm;
+            execute_instruction_c( &instr, regs );
+            for( int b = 0; b < 16; b++ ) {
+                int v = regs[0].b[b];
+                mask[0].b[b] = v && v <= 16 ? v - 1 : 0x80;
+                mask[1].b[b] = v > 16 ? v - 17 : 0x80;
+            }
+        }
+}
+
+/* Decode num instructions, with handlers[] the address of the code for each
+ * opcode. */
+static void threaded_decode( threaded_op_t *ops, const void * const *handlers, const instruction_t *instr,
+                             int num, batch_register_t *registers )
+{
+    for( int i = 0; i < num; i++ ) {
+        int opcode = instr[i].opcode, imm = instr[i].operands[2];
+
+        ops[i].handler = handlers[opcode];
+        ops[i].dst = registers[instr[i].operands[0]];
+        ops[i].src = registers[instr[i].operands[1] & (NUM_REGS-1)];
+        ops[i].mask = opcode == PSHUFB ? pshufb_masks[imm] : permute_masks[opcode][imm];
+        ops[i].count = imm;
+    }
+}
+
+#define HANDLERS {\
+        [PUNPCKLWD]  = &&punpcklwd,   [PUNPCKHWD]  = &&punpckhwd,\
+        [PUNPCKLDQ]  = &&punpckldq,   [PUNPCKHDQ]  = &&punpckhdq,\
+        [PUNPCKLQDQ] = &&punpcklqdq,  [PUNPCKHQDQ] = &&punpckhqdq,\
+        [MOVDQA]     = &&movdqa,\
+        [PSLLDQ]     = &&permute_dst, [PSRLDQ]     = &&permute_dst,\
+        [PSLLQ]      = &&psllq,       [PSRLQ]      = &&psrlq,\
+        [PSLLD]      = &&pslld,       [PSRLD]      = &&psrld,\
+        [PSHUFLW]    = &&permute_src, [PSHUFHW]    = &&permute_src,\
+        [PSHUFD]     = &&permute_src, [PALIGNR]    = &&permute_both,\
+        [PSHUFB]     = &&permute_dst, [PBLENDW]    = &&permute_both,\
+    }
+
+__attribute__((target("ssse3")))
+static void execute_batch_threaded( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    static const void * const handlers[NUM_INSTR] = HANDLERS;
+    threaded_op_t ops[THREADED_CHUNK + 1];
+    const threaded_op_t *op;
+
+    for( int n = 0; n < length; n += THREADED_CHUNK, instr += THREADED_CHUNK ) {
+        int num = length - n < THREADED_CHUNK ? length - n : THREADED_CHUNK;
+
+        threaded_decode( ops, handlers, instr, num, registers );
+        ops[num].handler = &&done;
+        op = ops;
+        goto *op->handler;
+
+#define LANES(expr)\
+        for( int k = 0; k < BATCH_REF; k++ ) {\
+            __m128i d = _mm_loadu_si128((__m128i*)op->dst+k), s = _mm_loadu_si128((__m128i*)op->src+k);\
+            (void)d; (void)s;\
+            _mm_storeu_si128((__m128i*)op->dst+k, expr);\
+        }\
+        goto *(++op)->handler;
+#define COUNT _mm_cvtsi32_si128(op->count)
+#define MASK(i) _mm_loadu_si128((const __m128i*)&op->mask[i])
+punpcklwd:    LANES(_mm_unpacklo_epi16(d, s))
+punpckhwd:    LANES(_mm_unpackhi_epi16(d, s))
+punpckldq:    LANES(_mm_unpacklo_epi32(d, s))
+punpckhdq:    LANES(_mm_unpackhi_epi32(d, s))
+punpcklqdq:   LANES(_mm_unpacklo_epi64(d, s))
+punpckhqdq:   LANES(_mm_unpackhi_epi64(d, s))
+movdqa:       LANES(s)
+psllq:        LANES(_mm_sll_epi64(d, COUNT))
+psrlq:        LANES(_mm_srl_epi64(d, COUNT))
+pslld:        LANES(_mm_sll_epi32(d, COUNT))
+psrld:        LANES(_mm_srl_epi32(d, COUNT))
+permute_dst:  LANES(_mm_shuffle_epi8(d, MASK(0)))
+permute_src:  LANES(_mm_shuffle_epi8(s, MASK(1)))
+permute_both: LANES(_mm_or_si128(_mm_shuffle_epi8(d, MASK(0)), _mm_shuffle_epi8(s, MASK(1))))
+#undef MASK
+#undef LANES
+done:
+        ;
+    }
+}
+
+/* The same with two reference vectors per op. */
+__attribute__((target("avx2")))
+static void execute_batch_threaded_avx2( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    static const void * const handlers[NUM_INSTR] = HANDLERS;
+    threaded_op_t ops[THREADED_CHUNK + 1];
+    const threaded_op_t *op;
+
+    for( int n = 0; n < length; n += THREADED_CHUNK, instr += THREADED_CHUNK ) {
+        int num = length - n < THREADED_CHUNK ? length - n : THREADED_CHUNK;
+
+        threaded_decode( ops, handlers, instr, num, registers );
+        ops[num].handler = &&done;
+        op = ops;
+        goto *op->handler;
+
+#define LANES(expr)\
+        for( int k = 0; k < BATCH_REF/2; k++ ) {\
+            __m256i d = _mm256_loadu_si256((__m256i*)op->dst+k), s = _mm256_loadu_si256((__m256i*)op->src+k);\
+            (void)d; (void)s;\
+            _mm256_storeu_si256((__m256i*)op->dst+k, expr);\
+        }\
+        goto *(++op)->handler;
+#define MASK(i) _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&op->mask[i]))
+punpcklwd:    LANES(_mm256_unpacklo_epi16(d, s))
+punpckhwd:    LANES(_mm256_unpackhi_epi16(d, s))
+punpckldq:    LANES(_mm256_unpacklo_epi32(d, s))
+punpckhdq:    LANES(_mm256_unpackhi_epi32(d, s))
+punpcklqdq:   LANES(_mm256_unpacklo_epi64(d, s))
+punpckhqdq:   LANES(_mm256_unpackhi_epi64(d, s))
+movdqa:       LANES(s)
+psllq:        LANES(_mm256_sll_epi64(d, COUNT))
+psrlq:        LANES(_mm256_srl_epi64(d, COUNT))
+pslld:        LANES(_mm256_sll_epi32(d, COUNT))
+psrld:        LANES(_mm256_srl_epi32(d, COUNT))
+permute_dst:  LANES(_mm256_shuffle_epi8(d, MASK(0)))
+permute_src:  LANES(_mm256_shuffle_epi8(s, MASK(1)))
+permute_both: LANES(_mm256_or_si256(_mm256_shuffle_epi8(d, MASK(0)), _mm256_shuffle_epi8(s, MASK(1))))
+#undef MASK
+#undef COUNT
+#undef LANES
+done:
+        ;
+    }
+}
+#undef HANDLERS
+#endif
+#endif
+
+static execute_instruction_t check_reference, check_candidate;
+static execute_batch_t check_batch_reference, check_batch_candidate;
+
+static void check_mismatch( const instruction_t *instr, const xmm_register_t *ref, const xmm_register_t *simd )
+{
+    fprintf( stderr, "Error: emulator mismatch on instruction %d %d %d %d\n",
+             instr->opcode, instr->operands[0], instr->operands[1], instr->operands[2] );
+    fprintf( stderr, "  c:    %016llx%016llx\n", (unsigned long long)ref->q[1], (unsigned long long)ref->q[0] );
+    fprintf( stderr, "  simd: %016llx%016llx\n", (unsigned long long)simd->q[1], (unsigned long long)simd->q[0] );
+    abort();
+}
+
+static void execute_instruction_check( const instruction_t *instr, xmm_register_t *registers )
+{
+    xmm_register_t copy[NUM_REGS];
+
+    memcpy( copy, registers, sizeof(copy) );
+    check_reference( instr, registers );
+    check_candidate( instr, copy );
+    if (memcmp( copy, registers, sizeof(copy) )) {
+        int r = instr->operands[0];
+        check_mismatch( instr, &registers[r], &copy[r] );
+    }
+}
+
+static void execute_batch_check( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    batch_register_t copy[NUM_REGS];
+
+    for( int i = 0; i < length; i++, instr++ ) {
+        memcpy( copy, registers, sizeof(copy) );
+        check_batch_reference( instr, 1, registers );
+        check_batch_candidate( instr, 1, copy );
+        if (memcmp( copy, registers, sizeof(copy) )) {
+            int r = instr->operands[0], k = 0;
+            while (!memcmp( &copy[r][k], &registers[r][k], sizeof(copy[r][k]) ))
+                k++;
+            check_mismatch( instr, &registers[r][k], &copy[r][k] );
+        }
+    }
+}
+
+static int cpu_supports( int type )
+{
+#if HAVE_SSE2 && defined(__GNUC__)
+    __builtin_cpu_init();
+    switch (type) {
+        case EMU_SSE2:   return __builtin_cpu_supports("sse2");
+#if HAVE_AVX
+        case EMU_THREADED: return __builtin_cpu_supports("ssse3");
+        case EMU_AVX2:   return __builtin_cpu_supports("avx2");
+        case EMU_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    }
+#endif
+    return type == EMU_C;
+}
+
+/* Byte provenance. When every byte of the first reference holds the number
+ * of the input byte it came from, or 0 for zero fill, whole-byte moves keep
+ * it exact and the ordinary emulators can run them. Only the bit shifts by a
+ * count that is not a multiple of 8 build bytes out of two others; those
+ * bytes become PROVENANCE_MIXED, or 0 if both were zero fill. The other
+ * references get the real result. */
+static int mixes_bytes( const instruction_t *instr )
+{
+    int count = instr->operands[2];
+    return instr->opcode >= PSLLQ && instr->opcode <= PSRLD && (count & 7) &&
+           count < (instr->opcode <= PSRLQ ? 64 : 32);
+}
+
+/* A byte is mixed if either byte shifted into it is not zero fill, which is
+ * the nonzero bytes shifted by the whole bytes of the count and by one more. */
+static void mix_bytes( const instruction_t *instr, batch_register_t *registers )
+{
+    int bits = instr->operands[2] & ~7;
+    xmm_register_t *out = &registers[instr->operands[0]][0], nz;
+
+    for( int j = 0; j < 16; j++ )
+        nz.b[j] = out->b[j] ? PROVENANCE_MIXED : 0;
+    execute_batch( instr, 1, registers );
+    switch( instr->opcode ) {
+        case PSLLQ:
+            for( int i = 0; i < 2; i++ )
+                out->q[i] = nz.q[i] << bits | (bits < 56 ? nz.q[i] << (bits + 8) : 0);
+            break;
+        case PSRLQ:
+            for( int i = 0; i < 2; i++ )
+                out->q[i] = nz.q[i] >> bits | (bits < 56 ? nz.q[i] >> (bits + 8) : 0);
+            break;
+        case PSLLD:
+            for( int i = 0; i < 4; i++ )
+                out->d[i] = nz.d[i] << bits | (bits < 24 ? nz.d[i] << (bits + 8) : 0);
+            break;
+        case PSRLD:
+            for( int i = 0; i < 4; i++ )
+                out->d[i] = nz.d[i] >> bits | (bits < 24 ? nz.d[i] >> (bits + 8) : 0);
+            break;
+    }
+}
+
+void execute_batch_provenance( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    int start = 0;
+
+    for( int i = 0; i < length; i++ )
+        if( mixes_bytes( &instr[i] ) ) {
+            if( i > start )
+                execute_batch( instr + start, i - start, registers );
+            mix_bytes( &instr[i], registers );
+            start = i + 1;
+        }
+    if( length > start )
+        execute_batch( instr + start, length - start, registers );
+}
+
+/* Mask r * inputs + s moves the words of input register s that belong in
+ * output register r to their place there and zeroes the others, as found by
+ * value in the first reference. The masks repeat to fill the table, so any
+ * immediate selects one. */
+void init_pshufb_masks( const reference_t *ref )
+{
+    int inputs = ref->num_regs_used[0], num_masks = inputs * ref->num_regs_used[1];
+
+    for( int m = 0; m < PSHUFB_MASKS; m++ ) {
+        int r = m % num_masks / inputs, s = m % num_masks % inputs;
+        xmm_register_t *mask = &pshufb_masks[m][0];
+
+        for( int j = 0; j < 8; j++ ) {
+            int i = 0;
+            while( i < 8 && ref->input[s].wd[i] != ref->output[r].wd[j] )
+                i++;
+            mask->b[2*j]   = i < 8 ? 2*i : 0x80;
+            mask->b[2*j+1] = i < 8 ? 2*i+1 : 0x80;
+        }
+        pshufb_masks[m][1] = *mask;
+    }
+}
+
+const char *emulator_name( int type )
+{
+    static const char * const names[] = { "auto", "c", "sse2", "avx2", "avx512", "check", "jit", "jit-check", "threaded" };
+    return names[type];
+}
+
+/* Select the instruction emulator. Returns the type actually in use, or -1 if
+ * the requested backend is unavailable on this build or cpu. The single
+ * instruction emulator is always the SSE2 one for the wider types, which only
+ * make a difference when evaluating a batch of reference vectors. The
+ * threaded one is preferred whenever the cpu has SSSE3, as dispatch rather
+ * than the width of the ops dominates. */
+int init_emulator( int type )
+{
+    int best = EMU_C;
+
+    for (int t = EMU_SSE2; t <= EMU_AVX512; t++)
+        if (cpu_supports(t))
+            best = t;
+    if (cpu_supports(EMU_THREADED))
+        best = EMU_THREADED;
+    if (type == EMU_AUTO)
+        type = best;
+    if (type < EMU_CHECK && !cpu_supports(type))
+        return -1;
+
+    switch (type) {
+        case EMU_C:
+            execute_instruction = execute_instruction_c;
+            execute_batch = execute_batch_c;
+            break;
+#if HAVE_SSE2
+        case EMU_SSE2:
+            execute_instruction = execute_instruction_sse2;
+            execute_batch = execute_batch_sse2;
+            break;
+#if HAVE_AVX
+        case EMU_AVX2:
+            execute_instruction = execute_instruction_sse2;
+            execute_batch = execute_batch_avx2;
+            break;
+        case EMU_AVX512:
+            execute_instruction = execute_instruction_sse2;
+            execute_batch = execute_batch_avx512;
+            break;
+        case EMU_THREADED:
+            if (!cpu_supports(type))
+                return -1;
+            init_permute_masks();
+            execute_instruction = execute_instruction_sse2;
+            execute_batch = cpu_supports(EMU_AVX2) ? execute_batch_threaded_avx2 : execute_batch_threaded;
+            break;
+#endif
+        case EMU_CHECK:
+            if (best == EMU_C)
+                return -1;
+            init_emulator( best );
+            check_reference = execute_instruction_c;
+            check_candidate = execute_instruction;
+            check_batch_reference = execute_batch_c;
+            check_batch_candidate = execute_batch;
+            execute_instruction = execute_instruction_check;
+            execute_batch = execute_batch_check;
+            break;
+#endif
+        case EMU_JIT:
+        case EMU_JIT_CHECK:
+            init_emulator( best > EMU_SSE2 ? EMU_SSE2 : best );
+            check_batch_candidate = init_jit();
+            if (!check_batch_candidate)
+                return -1;
+            execute_batch = check_batch_candidate;
+            if (type == EMU_JIT_CHECK) {
+                check_batch_reference = execute_batch_c;
+                execute_batch = execute_batch_check;
+            }
+            break;
+        default:
+            return -1;
+    }
+    return type;
+}
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "genetic_asm.h"
+
+/* Exhaustive search for the shortest program, by iterative deepening over
+ * instruction sequences.
+ *
+ * Only word granular immediates are tried: byte shifts and palignr by an
+ * even count, qword and dword shifts by multiples of 16 bits, the word and
+ * dword permutations for pshuflw/pshufhw/pshufd and every pshufb mask the
+ * target has. Within that domain, the instruction set level and the given
+ * number of registers a program found at depth n proves there is none
+ * shorter.
+ *
+ * Pruning:
+ * - Register files already reached at the same or a lower depth in this
+ *   iteration are skipped, using a table of state hashes. Registers past the
+ *   inputs and outputs are interchangeable, so they are hashed as a set, and
+ *   a new one is only ever taken in order.
+ * - Each instruction writes one register, so a state with k wrong output
+ *   registers needs at least k more instructions, and with exactly k left
+ *   each of them has to write one of the wrong outputs.
+ * - No instruction creates new words, so once a word of the output is lost
+ *   from every register of the first reference, the state is dead. */
+
+#define MAX_CANDIDATES (NUM_INSTR * ENUM_MAX_REGS * ENUM_MAX_REGS * 24)
+#define PROGRESS_NODES (1 << 20)  /* nodes between looks at the clock */
+#define PROGRESS_SECONDS 10
+
+typedef struct enum_ctx {
+    const reference_t *ref;
+    int num_regs;
+    int base;                   /* registers with a fixed role */
+    int num_outputs;
+    int limit;
+    int num_candidates;
+    instruction_t candidates[MAX_CANDIDATES];
+    int candidate_regs[MAX_CANDIDATES];    /* registers an instruction needs in use */
+    uint8_t *word_index;        /* output word of ref[0] + 1 for each value, or 0 */
+    uint64_t all_words;
+    uint64_t *table;
+    uint64_t table_mask;
+    uint64_t table_used;
+    uint64_t nodes;
+    struct timespec start;
+    double next_report;
+    instruction_t path[MAX_INSTR];
+    int found;
+} enum_ctx_t;
+
+static void add_candidate( enum_ctx_t *ctx, int op, int dst, int src, int imm )
+{
+    instruction_t *instr = &ctx->candidates[ctx->num_candidates];
+
+    instr->opcode = op;
+    instr->operands[0] = dst;
+    instr->operands[1] = src;
+    instr->operands[2] = imm;
+    ctx->candidate_regs[ctx->num_candidates++] = (dst > src ? dst : src) + 1;
+}
+
+static void init_candidates( enum_ctx_t *ctx, int num_opcodes )
+{
+    int n = ctx->num_regs;
+    int num_masks = ctx->ref[0].num_regs_used[0] * ctx->ref[0].num_regs_used[1];
+
+    for( int op = 0; op < num_opcodes; op++ )
+        for( int dst = 0; dst < n; dst++ )
+        {
+            if( op <= MOVDQA )
+            {
+                for( int src = 0; src < n; src++ )
+                    if( op != MOVDQA || src != dst )
+                        add_candidate( ctx, op, dst, src, 0 );
+            }
+            else if( op <= PSRLDQ )
+            {
+                for( int imm = 2; imm < 16; imm += 2 )
+                    add_candidate( ctx, op, dst, 0, imm );
+            }
+            else if( op <= PSRLQ )
+            {
+                for( int imm = 16; imm < 64; imm += 16 )
+                    add_candidate( ctx, op, dst, 0, imm );
+            }
+            else if( op <= PSRLD )
+                add_candidate( ctx, op, dst, 0, 16 );
+            else if( op == PALIGNR )
+            {
+                for( int src = 0; src < n; src++ )
+                    for( int imm = 2; imm < 16; imm += 2 )
+                        add_candidate( ctx, op, dst, src, imm );
+            }
+            else if( op == PSHUFB )
+            {
+                for( int imm = 0; imm < num_masks; imm++ )
+                    add_candidate( ctx, op, dst, 0, imm );
+            }
+            else if( op == PBLENDW )
+            {
+                for( int src = 0; src < n; src++ )
+                    for( int imm = 1; imm < 255 && src != dst; imm++ )
+                        add_candidate( ctx, op, dst, src, imm );
+            }
+            else
+            {
+                /* Only the immediates that permute the four words or
+                 * dwords. */
+                for( int src = 0; src < n; src++ )
+                    for( int imm = 0; imm < 256; imm++ )
+                    {
+                        int a = imm & 3, b = imm >> 2 & 3, c = imm >> 4 & 3, d = imm >> 6;
+                        if( a != b && a != c && a != d && b != c && b != d && c != d &&
+                            (imm != 0xe4 || src != dst) )
+                            add_candidate( ctx, op, dst, src, imm );
+                    }
+            }
+        }
+}
+
+static inline uint64_t hash_register( const batch_register_t reg )
+{
+    uint64_t hash = 0;
+
+    for( int k = 0; k < NUM_REF; k++ )
+        for( int i = 0; i < 2; i++ )
+        {
+            hash = (hash ^ reg[k].q[i]) * 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 32;
+        }
+    return hash;
+}
+
+/* Hash of the register file that is the same for any order of the
+ * interchangeable registers. */
+static uint64_t hash_state( const enum_ctx_t *ctx, batch_register_t *regs )
+{
+    uint64_t temps[ENUM_MAX_REGS];
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    int num_temps = 0;
+
+    for( int r = 0; r < ctx->base; r++ )
+        hash = (hash ^ hash_register( regs[r] )) * 0xc4ceb9fe1a85ec53ULL;
+    for( int r = ctx->base; r < ctx->num_regs; r++ )
+    {
+        uint64_t h = hash_register( regs[r] );
+        int i = num_temps++;
+        for( ; i > 0 && temps[i-1] > h; i-- )
+            temps[i] = temps[i-1];
+        temps[i] = h;
+    }
+    for( int i = 0; i < num_temps; i++ )
+        hash = (hash ^ temps[i]) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 31);
+}
+
+/* Returns 1 if the state was already expanded at depth or less, otherwise
+ * records it at depth. A full table only stops recording. */
+static int seen_state( enum_ctx_t *ctx, uint64_t hash, int depth )
+{
+    uint64_t key = (hash & ~0xffULL) | depth;
+    uint64_t i = hash >> 8;
+
+    if( !(key & ~0xffULL) )
+        key |= 0x100;
+    for( ;; i++ )
+    {
+        uint64_t *entry = &ctx->table[i & ctx->table_mask];
+        if( !*entry )
+        {
+            if( ctx->table_used < ctx->table_mask / 4 * 3 )
+            {
+                *entry = key;
+                ctx->table_used++;
+            }
+            return 0;
+        }
+        if( (*entry ^ key) < 0x100 )
+        {
+            if( (int)(*entry & 0xff) <= depth )
+                return 1;
+            *entry = key;
+            return 0;
+        }
+    }
+}
+
+/* Mask of the output registers that do not hold their result yet. */
+static unsigned wrong_outputs( const enum_ctx_t *ctx, batch_register_t *regs )
+{
+    unsigned wrong = 0;
+
+    for( int r = 0; r < ctx->num_outputs; r++ )
+        for( int k = 0; k < NUM_REF; k++ )
+            if( memcmp( &regs[r][k], &ctx->ref[k].output[r], sizeof(xmm_register_t) ) )
+            {
+                wrong |= 1 << r;
+                break;
+            }
+    return wrong;
+}
+
+static int popcount( unsigned x )
+{
+    int n = 0;
+    for( ; x; x &= x - 1 )
+        n++;
+    return n;
+}
+
+static int words_present( const enum_ctx_t *ctx, batch_register_t *regs )
+{
+    uint64_t present = 0;
+
+    for( int r = 0; r < ctx->num_regs; r++ )
+        for( int i = 0; i < 8; i++ )
+        {
+            int idx = ctx->word_index[regs[r][0].wd[i]];
+            if( idx )
+                present |= 1ULL << (idx - 1);
+        }
+    return present == ctx->all_words;
+}
+
+static double elapsed_time( const enum_ctx_t *ctx )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - ctx->start.tv_sec) + (now.tv_nsec - ctx->start.tv_nsec) * 1e-9;
+}
+
+static void report_progress( enum_ctx_t *ctx, double elapsed )
+{
+    ctx->next_report = elapsed + PROGRESS_SECONDS;
+    printf( "depth %d: %"PRIu64" nodes, %"PRIu64" states (%.0f%% of table) in %.1fs\n",
+            ctx->limit, ctx->nodes, ctx->table_used,
+            100.0 * ctx->table_used / (ctx->table_mask + 1), elapsed );
+    fflush( stdout );
+}
+
+static void search( enum_ctx_t *ctx, batch_register_t *regs, int depth, int used, unsigned wrong )
+{
+    xmm_register_t saved[BATCH_REF];
+    int tight = popcount( wrong ) == ctx->limit - depth;
+
+    for( int c = 0; c < ctx->num_candidates && !ctx->found; c++ )
+    {
+        const instruction_t *instr = &ctx->candidates[c];
+        int dst = instr->operands[0];
+        int next_used = used;
+        unsigned next_wrong;
+
+        if( ctx->candidate_regs[c] > used + 1 || ctx->candidate_regs[c] > ctx->num_regs )
+            continue;
+        if( tight && !(dst < ctx->num_outputs && (wrong & (1 << dst))) )
+            continue;
+        if( ctx->candidate_regs[c] == used + 1 )
+            next_used++;
+
+        memcpy( saved, regs[dst], sizeof(saved) );
+        execute_batch( instr, 1, regs );
+        ctx->path[depth] = *instr;
+        if( ++ctx->nodes % PROGRESS_NODES == 0 )
+        {
+            double elapsed = elapsed_time( ctx );
+            if( elapsed >= ctx->next_report )
+                report_progress( ctx, elapsed );
+        }
+
+        if( memcmp( saved, regs[dst], sizeof(saved) ) )
+        {
+            next_wrong = wrong_outputs( ctx, regs );
+            if( !next_wrong )
+                ctx->found = depth + 1;
+            else if( depth + 1 + popcount( next_wrong ) <= ctx->limit && words_present( ctx, regs ) &&
+                     !seen_state( ctx, hash_state( ctx, regs ), depth + 1 ) )
+                search( ctx, regs, depth + 1, next_used, next_wrong );
+        }
+        memcpy( regs[dst], saved, sizeof(saved) );
+    }
+}
+
+int enumerate_programs( const reference_t *ref, const batch_register_t *input, int max_depth,
+                        int num_regs, int num_opcodes, size_t memory, instruction_t *result )
+{
+    batch_register_t regs[NUM_REGS];
+    enum_ctx_t *ctx;
+    uint64_t entries = 1;
+    int ret = -1;
+
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
+        return -2;
+    ctx->ref = ref;
+    ctx->num_regs = num_regs;
+    ctx->num_outputs = ref[0].num_regs_used[1];
+    ctx->base = ref[0].num_regs_used[0] > ctx->num_outputs ? ref[0].num_regs_used[0] : ctx->num_outputs;
+    init_candidates( ctx, num_opcodes );
+
+    while( entries * 2 * sizeof(uint64_t) <= memory )
+        entries *= 2;
+    ctx->table_mask = entries - 1;
+    ctx->table = malloc( entries * sizeof(uint64_t) );
+    ctx->word_index = calloc( 1 << 16, 1 );
+    if( !ctx->table || !ctx->word_index )
+    {
+        ret = -2;
+        goto end;
+    }
+    for( int r = 0; r < ctx->num_outputs; r++ )
+        for( int i = 0; i < 8; i++ )
+        {
+            uint8_t *idx = &ctx->word_index[ref[0].output[r].wd[i]];
+            if( !*idx )
+            {
+                ctx->all_words |= 1ULL << (r * 8 + i);
+                *idx = r * 8 + i + 1;
+            }
+        }
+
+    memcpy( regs, input, sizeof(regs) );
+    clock_gettime( CLOCK_MONOTONIC, &ctx->start );
+    printf( "Enumerating programs over %d registers, %d candidate instructions, "
+            "%"PRIu64" table entries\n", num_regs, ctx->num_candidates, entries );
+    ctx->next_report = PROGRESS_SECONDS;
+    if( !wrong_outputs( ctx, regs ) )
+    {
+        ret = 0;
+        goto end;
+    }
+    for( ctx->limit = 1; ctx->limit <= max_depth && ret < 0; ctx->limit++ )
+    {
+        memset( ctx->table, 0, entries * sizeof(uint64_t) );
+        ctx->table_used = 0;
+        seen_state( ctx, hash_state( ctx, regs ), 0 );
+        search( ctx, regs, 0, ctx->base, wrong_outputs( ctx, regs ) );
+        report_progress( ctx, elapsed_time( ctx ) );
+        if( ctx->found )
+        {
+            memcpy( result, ctx->path, ctx->found * sizeof(*result) );
+            ret = ctx->found;
+        }
+    }
+
+end:
+    free( ctx->word_index );
+    free( ctx->table );
+    free( ctx );
+    return ret;
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "genetic_asm.h"
+
+/* Writer of finished programs as code to build into an encoder. Given a
+ * prefix, it writes
+ *
+ *     PREFIX.asm        each program as an x264asm cglobal function, to
+ *                       assemble with x86inc.asm on the include path
+ *     PREFIX.c          each program as a C function on SSE intrinsics
+ *     PREFIX_bench.c    a standalone program checking the C functions
+ *                       against a scalar scan through the target table, and
+ *                       timing all of them with rdtsc
+ *
+ * The functions take (int16_t *level, const int16_t *dct) like the x264
+ * zigzag scans, with both arrays 16-byte aligned. The program registers map
+ * to xmm registers of the same number. The input words are loaded into the
+ * first registers, the ones the program reads before writing start out
+ * zeroed, and the result is stored from the first registers. */
+
+static const char * const isa_suffixes[NUM_ISAS] = { "sse2", "ssse3", "sse4" };
+static const char * const isa_cflags[NUM_ISAS] = { "-msse2", "-mssse3", "-msse4.1" };
+
+static const char * const intrinsics[NUM_INSTR] =
+{
+    [PUNPCKLWD]  = "_mm_unpacklo_epi16",  [PUNPCKHWD]  = "_mm_unpackhi_epi16",
+    [PUNPCKLDQ]  = "_mm_unpacklo_epi32",  [PUNPCKHDQ]  = "_mm_unpackhi_epi32",
+    [PUNPCKLQDQ] = "_mm_unpacklo_epi64",  [PUNPCKHQDQ] = "_mm_unpackhi_epi64",
+    [PSLLDQ]     = "_mm_slli_si128",      [PSRLDQ]     = "_mm_srli_si128",
+    [PSLLQ]      = "_mm_slli_epi64",      [PSRLQ]      = "_mm_srli_epi64",
+    [PSLLD]      = "_mm_slli_epi32",      [PSRLD]      = "_mm_srli_epi32",
+    [PSHUFLW]    = "_mm_shufflelo_epi16", [PSHUFHW]    = "_mm_shufflehi_epi16",
+    [PSHUFD]     = "_mm_shuffle_epi32",   [PALIGNR]    = "_mm_alignr_epi8",
+    [PSHUFB]     = "_mm_shuffle_epi8",    [PBLENDW]    = "_mm_blend_epi16",
+};
+
+typedef struct kernel {
+    char name[64];
+    const program_t *prog;
+    int isa;
+    int num_regs;       /* highest register used + 1 */
+    unsigned regs;      /* registers used */
+    unsigned zeroed;    /* registers past the inputs read before written */
+} kernel_t;
+
+static void init_kernel( kernel_t *k, const char *base, int index, int num, const target_t *target,
+                         const program_t *prog )
+{
+    unsigned written = (1u << target->num_inputs) - 1;
+
+    if (num > 1)
+        snprintf( k->name, sizeof(k->name), "%s_%d", base, index + 1 );
+    else
+        snprintf( k->name, sizeof(k->name), "%s", base );
+    k->prog = prog;
+    k->isa = ISA_SSE2;
+    k->regs = written | ((1u << target->num_outputs) - 1);
+    k->zeroed = 0;
+    for (int i = 0; i < prog->length[LEN_EFFECTIVE]; i++) {
+        const instruction_t *instr = &prog->effective[i];
+        int dst = instr->operands[0], src = instr->operands[1];
+
+        if (instr->opcode >= PBLENDW)
+            k->isa = ISA_SSE4;
+        else if (instr->opcode >= PALIGNR && k->isa < ISA_SSSE3)
+            k->isa = ISA_SSSE3;
+        if (reads_dst( instr ))
+            k->zeroed |= (1 << dst) & ~written;
+        if (reads_src( instr )) {
+            k->zeroed |= (1 << src) & ~written;
+            k->regs |= 1 << src;
+        }
+        written |= 1 << dst;
+    }
+    k->regs |= written;
+    for (k->num_regs = NUM_REGS; !(k->regs >> (k->num_regs - 1) & 1); k->num_regs--)
+        ;
+}
+
+/* Byte shifts of 16 or more clear the register, but the intrinsics only
+ * take counts up to 16. */
+static int immediate( const instruction_t *instr )
+{
+    if ((instr->opcode == PSLLDQ || instr->opcode == PSRLDQ) && instr->operands[2] > 16)
+        return 16;
+    return instr->operands[2];
+}
+
+static void write_masks( FILE *f, const char *base, const uint8_t *used, int assembly )
+{
+    for (int m = 0; m < PSHUFB_MASKS; m++) {
+        if (!used[m])
+            continue;
+        if (assembly)
+            fprintf( f, "%s_pshufb_%d: db ", base, m );
+        else
+            fprintf( f, "static const uint8_t %s_pshufb_%d[16] __attribute__((aligned(16))) = { ", base, m );
+        for (int i = 0; i < 16; i++)
+            fprintf( f, "0x%02x%s", pshufb_masks[m][0].b[i], i < 15 ? "," : "" );
+        fprintf( f, assembly ? "\n" : " };\n" );
+    }
+}
+
+static void write_asm( FILE *f, const char *name, const char *base, const kernel_t *kernels, int num,
+                       const target_t *target, const uint8_t *used )
+{
+    fprintf( f, ";*****************************************************************************\n"
+                ";* %s.asm: generated by genetic_asm\n"
+                ";*****************************************************************************\n\n"
+                "%%include \"x86inc.asm\"\n\n", name );
+    if (used[PSHUFB_MASKS]) {
+        fprintf( f, "SECTION_RODATA 16\n\n" );
+        write_masks( f, base, used, 1 );
+        fprintf( f, "\n" );
+    }
+    fprintf( f, "SECTION .text\n" );
+
+    for (int k = 0; k < num; k++) {
+        const program_t *prog = kernels[k].prog;
+
+        fprintf( f, "\n;-----------------------------------------------------------------------------\n"
+                    "; void %s( int16_t level[%d], int16_t dct[%d] )\n"
+                    "; %d instructions, estimated %.2f cycles\n"
+                    ";-----------------------------------------------------------------------------\n"
+                    "INIT_XMM %s\n"
+                    "cglobal %s, 2,2,%d\n",
+                 kernels[k].name, target->num_outputs * 8, target->num_inputs * 8,
+                 prog->length[LEN_EFFECTIVE], (double)prog->cost / COST_SCALE,
+                 isa_suffixes[kernels[k].isa], kernels[k].name, kernels[k].num_regs );
+        for (int r = 0; r < target->num_inputs; r++)
+            fprintf( f, "    mova       m%d, [r1+%d]\n", r, 16 * r );
+        for (int r = 0; r < NUM_REGS; r++)
+            if (kernels[k].zeroed >> r & 1)
+                fprintf( f, "    pxor       m%d, m%d\n", r, r );
+        for (int i = 0; i < prog->length[LEN_EFFECTIVE]; i++) {
+            const instruction_t *instr = &prog->effective[i];
+            int op = instr->opcode;
+
+            fprintf( f, "    %-10s m%d, ", op == MOVDQA ? "mova" : instruction_names[op], instr->operands[0] );
+            if (op < PSLLDQ)
+                fprintf( f, "m%d\n", instr->operands[1] );
+            else if (op == PSHUFB)
+                fprintf( f, "[%s_pshufb_%d]\n", base, instr->operands[2] );
+            else if (op < PSHUFLW)
+                fprintf( f, "%d\n", immediate( instr ) );
+            else
+                fprintf( f, "m%d, 0x%x\n", instr->operands[1], instr->operands[2] );
+        }
+        for (int r = 0; r < target->num_outputs; r++)
+            fprintf( f, "    mova       [r0+%d], m%d\n", 16 * r, r );
+        fprintf( f, "    RET\n" );
+    }
+}
+
+static void write_intrinsics( FILE *f, const char *name, const char *base, const kernel_t *kernels, int num,
+                              const target_t *target, const uint8_t *used, int isa )
+{
+    fprintf( f, "/* %s.c: generated by genetic_asm, build with %s or higher. */\n\n"
+                "#include <stdint.h>\n"
+                "#include <%s>\n\n",
+             name, isa_cflags[isa], isa == ISA_SSE4 ? "smmintrin.h" : isa == ISA_SSSE3 ? "tmmintrin.h" : "emmintrin.h" );
+    if (used[PSHUFB_MASKS]) {
+        write_masks( f, base, used, 0 );
+        fprintf( f, "\n" );
+    }
+
+    for (int k = 0; k < num; k++) {
+        const program_t *prog = kernels[k].prog;
+
+        fprintf( f, "/* %d instructions, estimated %.2f cycles */\n"
+                    "void %s( int16_t *level, const int16_t *dct )\n"
+                    "{\n",
+                 prog->length[LEN_EFFECTIVE], (double)prog->cost / COST_SCALE, kernels[k].name );
+        for (int r = 0; r < kernels[k].num_regs; r++) {
+            if (!(kernels[k].regs >> r & 1))
+                continue;
+            if (r < target->num_inputs)
+                fprintf( f, "    __m128i m%d = _mm_load_si128( (const __m128i*)dct + %d );\n", r, r );
+            else
+                fprintf( f, "    __m128i m%d = _mm_setzero_si128();\n", r );
+        }
+        fprintf( f, "\n" );
+        for (int i = 0; i < prog->length[LEN_EFFECTIVE]; i++) {
+            const instruction_t *instr = &prog->effective[i];
+            int op = instr->opcode, dst = instr->operands[0], src = instr->operands[1];
+
+            if (op == MOVDQA)
+                fprintf( f, "    m%d = m%d;\n", dst, src );
+            else if (op < PSLLDQ)
+                fprintf( f, "    m%d = %s( m%d, m%d );\n", dst, intrinsics[op], dst, src );
+            else if (op == PSHUFB)
+                fprintf( f, "    m%d = %s( m%d, _mm_load_si128( (const __m128i*)%s_pshufb_%d ) );\n",
+                         dst, intrinsics[op], dst, base, instr->operands[2] );
+            else if (op < PSHUFLW)
+                fprintf( f, "    m%d = %s( m%d, %d );\n", dst, intrinsics[op], dst, immediate( instr ) );
+            else if (op <= PSHUFD)
+                fprintf( f, "    m%d = %s( m%d, 0x%x );\n", dst, intrinsics[op], src, instr->operands[2] );
+            else
+                fprintf( f, "    m%d = %s( m%d, m%d, 0x%x );\n", dst, intrinsics[op], dst, src, instr->operands[2] );
+        }
+        fprintf( f, "\n" );
+        for (int r = 0; r < target->num_outputs; r++)
+            fprintf( f, "    _mm_store_si128( (__m128i*)level + %d, m%d );\n", r, r );
+        fprintf( f, "}\n%s", k < num - 1 ? "\n" : "" );
+    }
+}
+
+static void write_bench( FILE *f, const char *name, const char *base, const kernel_t *kernels, int num,
+                         const target_t *target, int isa )
+{
+    int num_words = target->num_outputs * 8;
+
+    fprintf( f, "/* %s_bench.c: generated by genetic_asm.\n"
+                " *\n"
+                " * Checks the functions of %s.c against the scalar scan on random\n"
+                " * blocks, then prints the fewest TSC cycles per block of each over a\n"
+                " * number of runs.\n"
+                " *\n"
+                " *     cc -O2 %s -o %s_bench %s_bench.c\n"
+                " *\n"
+                " * With -DHAVE_ASM and the object assembled from %s.asm, the x264asm\n"
+                " * functions are checked and timed as well. */\n\n"
+                "#include <stdio.h>\n"
+                "#include <stdlib.h>\n"
+                "#include <stdint.h>\n"
+                "#include <string.h>\n"
+                "#include <x86intrin.h>\n\n"
+                "#include \"%s.c\"\n\n"
+                "#define BLOCKS 256\n"
+                "#define RUNS 2000\n\n",
+             name, name, isa_cflags[isa], name, name, name, name );
+
+    fprintf( f, "/* level[i] = dct[%s_scan[i]] */\n"
+                "static const uint8_t %s_scan[%d] =\n{", base, base, num_words );
+    for (int i = 0; i < num_words; i++)
+        fprintf( f, "%s%2d,", i % 8 ? " " : "\n    ", target->map[i] );
+    fprintf( f, "\n};\n\n"
+                "static void %s_c( int16_t *level, const int16_t *dct )\n"
+                "{\n"
+                "    for( int i = 0; i < %d; i++ )\n"
+                "        level[i] = dct[%s_scan[i]];\n"
+                "}\n\n", base, num_words, base );
+
+    fprintf( f, "#ifdef HAVE_ASM\n" );
+    for (int k = 0; k < num; k++)
+        fprintf( f, "void x264_%s_%s( int16_t *level, const int16_t *dct );\n",
+                 kernels[k].name, isa_suffixes[kernels[k].isa] );
+    fprintf( f, "#endif\n\n"
+                "typedef void (*scan_t)( int16_t *level, const int16_t *dct );\n\n"
+                "static const struct {\n"
+                "    const char *name;\n"
+                "    scan_t scan;\n"
+                "} functions[] =\n"
+                "{\n"
+                "    { \"%s_c\", %s_c },\n", base, base );
+    for (int k = 0; k < num; k++)
+        fprintf( f, "    { \"%s\", %s },\n", kernels[k].name, kernels[k].name );
+    fprintf( f, "#ifdef HAVE_ASM\n" );
+    for (int k = 0; k < num; k++)
+        fprintf( f, "    { \"x264_%s_%s\", x264_%s_%s },\n", kernels[k].name, isa_suffixes[kernels[k].isa],
+                 kernels[k].name, isa_suffixes[kernels[k].isa] );
+    fprintf( f, "#endif\n"
+                "};\n\n" );
+
+    fprintf( f, "static int16_t dct[BLOCKS][%d] __attribute__((aligned(16)));\n"
+                "static int16_t level[BLOCKS][%d] __attribute__((aligned(16)));\n"
+                "static int16_t expected[BLOCKS][%d];\n\n"
+                "static double bench( scan_t scan )\n"
+                "{\n"
+                "    uint64_t best = UINT64_MAX;\n\n"
+                "    for( int r = 0; r < RUNS; r++ ) {\n"
+                "        uint64_t t = __rdtsc();\n"
+                "        for( int b = 0; b < BLOCKS; b++ )\n"
+                "            scan( level[b], dct[b] );\n"
+                "        t = __rdtsc() - t;\n"
+                "        if( t < best )\n"
+                "            best = t;\n"
+                "    }\n"
+                "    return (double)best / BLOCKS;\n"
+                "}\n\n",
+             target->num_inputs * 8, num_words, num_words );
+
+    fprintf( f, "int main( void )\n"
+                "{\n"
+                "    int failed = 0;\n\n"
+                "    srand( 1 );\n"
+                "    for( int b = 0; b < BLOCKS; b++ ) {\n"
+                "        for( int i = 0; i < %d; i++ )\n"
+                "            dct[b][i] = rand();\n"
+                "        %s_c( expected[b], dct[b] );\n"
+                "    }\n\n"
+                "    for( size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++ ) {\n"
+                "        memset( level, 0, sizeof(level) );\n"
+                "        for( int b = 0; b < BLOCKS; b++ )\n"
+                "            functions[i].scan( level[b], dct[b] );\n"
+                "        if( memcmp( level, expected, sizeof(level) ) ) {\n"
+                "            printf( \"%%-32s MISMATCH\\n\", functions[i].name );\n"
+                "            failed = 1;\n"
+                "            continue;\n"
+                "        }\n"
+                "        printf( \"%%-32s %%6.2f cycles per block\\n\", functions[i].name, bench( functions[i].scan ) );\n"
+                "    }\n"
+                "    return failed;\n"
+                "}\n",
+             target->num_inputs * 8, base );
+}
+
+static FILE *open_output( const char *prefix, const char *suffix )
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf( path, sizeof(path), "%s%s", prefix, suffix );
+    f = fopen( path, "w" );
+    if (!f)
+        printf( "ERROR: cannot write %s\n", path );
+    return f;
+}
+
+/* Export num programs with the result in the first target->num_outputs
+ * registers, as written by the search. The function names come from the
+ * file name part of prefix made into a C identifier, numbered from 1 if there
+ * is more than one, while the files name each other as written. A
+ * target that is not valid, such as one never set up, is refused rather
+ * than written out as kernels that load and store nothing. */
+int export_programs( const char *prefix, const target_t *target, const program_t *progs, int num )
+{
+    kernel_t *kernels = calloc( num, sizeof(*kernels) );
+    uint8_t used[PSHUFB_MASKS + 1] = { 0 };  /* each mask, then whether any is */
+    const char *slash = strrchr( prefix, '/' ), *name = slash ? slash + 1 : prefix;
+    char base[48];
+    FILE *f[3];
+    const char * const suffixes[3] = { ".asm", ".c", "_bench.c" };
+    int isa = ISA_SSE2, ret = 0;
+
+    if (!target_valid( target )) {
+        printf( "ERROR: no valid target to export programs for\n" );
+        free( kernels );
+        return -1;
+    }
+    if (!kernels)
+        return -1;
+    snprintf( base, sizeof(base), "%s", name );
+    for (char *c = base; *c; c++)
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9' && c > base)))
+            *c = '_';
+    for (int k = 0; k < num; k++) {
+        init_kernel( &kernels[k], base, k, num, target, &progs[k] );
+        if (isa < kernels[k].isa)
+            isa = kernels[k].isa;
+        for (int i = 0; i < progs[k].length[LEN_EFFECTIVE]; i++)
+            if (progs[k].effective[i].opcode == PSHUFB)
+                used[progs[k].effective[i].operands[2]] = used[PSHUFB_MASKS] = 1;
+    }
+
+    for (int i = 0; i < 3; i++)
+        if (!(f[i] = open_output( prefix, suffixes[i] ))) {
+            while (i--)
+                fclose( f[i] );
+            free( kernels );
+            return -1;
+        }
+    write_asm( f[0], name, base, kernels, num, target, used );
+    write_intrinsics( f[1], name, base, kernels, num, target, used, isa );
+    write_bench( f[2], name, base, kernels, num, target, isa );
+    for (int i = 0; i < 3; i++)
+        if (ferror( f[i] ) | fclose( f[i] )) {
+            printf( "ERROR: cannot write %s%s\n", prefix, suffixes[i] );
+            ret = -1;
+        }
+    free( kernels );
+    if (!ret)
+        printf( "Exported %d program%s to %s.asm, %s.c and %s_bench.c\n", num, num > 1 ? "s" : "",
+                prefix, prefix, prefix );
+    return ret;
+}
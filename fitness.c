@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "genetic_asm.h"
+
+/* Fitness of the register file a program leaves. The exact fitness counts
+ * the words of registers 0 to num_outputs-1 that differ from the expected
+ * output, squares the count and sums that over the reference vectors.
+ *
+ * The distance fitness gives partial credit instead. On the first reference,
+ * whose words are all distinct, each expected word costs nothing in its
+ * lane, its lane distance when it is elsewhere in the same register,
+ * DIST_REGISTER plus the lane distance when it is only found in another
+ * register and DIST_MISSING when no register holds it any more. The result
+ * may end up in any registers: the score is that of the cheapest assignment
+ * of program registers to output registers, found with the Hungarian method.
+ * The other references then only confirm the words in place, any of which
+ * differs there costs DIST_MISSING as well. Both are 0 only for a correct
+ * program. */
+
+#define DIST_REGISTER 8
+#define DIST_MISSING  16
+#define NO_WORD       0xff
+
+static inline unsigned word_hash( uint16_t value )
+{
+    return (value * 40503u & 0xffff) >> (16 - WORD_HASH_BITS);
+}
+
+/* First output word holding value, or -1. */
+static inline int find_word( const fitness_t *f, uint16_t value )
+{
+    for (unsigned i = word_hash( value ); f->hash_word[i]; i = (i + 1) & (WORD_HASH_SIZE - 1))
+        if (f->hash_value[i] == value)
+            return f->hash_word[i] - 1;
+    return -1;
+}
+
+void fitness_init( fitness_t *f, int type, const reference_t *ref, int num_ref )
+{
+    memset( f, 0, sizeof(*f) );
+    f->type = type;
+    f->num_ref = num_ref;
+    f->num_outputs = ref[0].num_regs_used[1];
+    f->ref = ref;
+
+    /* Words are entered last to first so every chain runs in order. */
+    for (int w = f->num_outputs * 8 - 1; w >= 0; w--) {
+        uint16_t value = ref[0].output[w/8].wd[w%8];
+        unsigned i = word_hash( value );
+
+        while (f->hash_word[i] && f->hash_value[i] != value)
+            i = (i + 1) & (WORD_HASH_SIZE - 1);
+        f->next[w] = f->hash_word[i] ? f->hash_word[i] - 1 : NO_WORD;
+        f->hash_value[i] = value;
+        f->hash_word[i] = w + 1;
+    }
+}
+
+/* Registers the fitness may depend on at the end of a program that was
+ * never scored. Once it is, only the registers program_fitness() credited
+ * are kept live in its offspring. */
+unsigned fitness_live_out( const fitness_t *f )
+{
+    return f->type == FITNESS_DISTANCE ? (1u << NUM_REGS) - 1 : (1u << f->num_outputs) - 1;
+}
+
+static int exact_fitness( const fitness_t *f, const batch_register_t *registers )
+{
+    int fitness = 0;
+
+    for (int k = 0; k < f->num_ref; k++) {
+        int sumerror = 0;
+
+        for (int r = 0; r < f->num_outputs; r++)
+            for (int i = 0; i < 2; i++) {
+                /* Set the top bit of every word that differs and count them. */
+                uint64_t x = registers[r][k].q[i] ^ f->ref[k].output[r].q[i];
+                x |= (x & 0x7fff7fff7fff7fffULL) + 0x7fff7fff7fff7fffULL;
+                sumerror += __builtin_popcountll( x & 0x8000800080008000ULL );
+            }
+        fitness += sumerror * sumerror;
+    }
+    return fitness;
+}
+
+/* Cost of every output register o held in program register r as
+ * cost[o][r], on the first reference. Returns the registers holding any
+ * expected word. */
+static unsigned distance_costs( const fitness_t *f, const batch_register_t *registers, int cost[][NUM_REGS] )
+{
+    /* The closest copy of each expected word in each register. */
+    struct { uint8_t reg, word, dist; } hits[NUM_REGS * MAX_TARGET_WORDS];
+    uint8_t nearest[MAX_TARGET_WORDS];
+    int num_hits = 0, base[NUM_REGS] = { 0 };
+    unsigned found = 0;
+
+    memset( nearest, NO_WORD, f->num_outputs * 8 );
+    for (int r = 0; r < NUM_REGS; r++) {
+        int first = num_hits;
+
+        for (int j = 0; j < 8; j++)
+            for (int w = find_word( f, registers[r][0].wd[j] ); w >= 0 && w != NO_WORD; w = f->next[w]) {
+                int dist = abs( w % 8 - j ), h;
+
+                if (dist < nearest[w])
+                    nearest[w] = dist;
+                for (h = first; h < num_hits && hits[h].word != w; h++)
+                    ;
+                if (h == num_hits) {
+                    hits[h].reg = r;
+                    hits[h].word = w;
+                    hits[h].dist = dist;
+                    num_hits++;
+                } else if (dist < hits[h].dist)
+                    hits[h].dist = dist;
+            }
+    }
+
+    /* Every word costs as much as if it were in none of the candidate
+     * registers, less the part saved by the copy in each. */
+    for (int w = 0; w < f->num_outputs * 8; w++)
+        base[w/8] += nearest[w] == NO_WORD ? DIST_MISSING : DIST_REGISTER + nearest[w];
+    for (int o = 0; o < f->num_outputs; o++)
+        for (int r = 0; r < NUM_REGS; r++)
+            cost[o][r] = base[o];
+    for (int h = 0; h < num_hits; h++) {
+        int w = hits[h].word;
+        cost[w/8][hits[h].reg] -= DIST_REGISTER + nearest[w] - hits[h].dist;
+        found |= 1 << hits[h].reg;
+    }
+    return found;
+}
+
+/* Cheapest assignment of n rows to distinct columns of cost, by the
+ * Hungarian method with potentials, O(n^2 * NUM_REGS). */
+static int assign_registers( int cost[][NUM_REGS], int n, int *assignment )
+{
+    int u[NUM_REGS+1] = { 0 }, v[NUM_REGS+1] = { 0 }, row[NUM_REGS+1] = { 0 }, way[NUM_REGS+1];
+    int total = 0;
+
+    for (int i = 1; i <= n; i++) {
+        int minv[NUM_REGS+1];
+        uint8_t used[NUM_REGS+1] = { 0 };
+        int col = 0;
+
+        row[0] = i;
+        for (int j = 0; j <= NUM_REGS; j++)
+            minv[j] = INT_MAX;
+        do {
+            int r = row[col], delta = INT_MAX, next = 0;
+
+            used[col] = 1;
+            for (int j = 1; j <= NUM_REGS; j++)
+                if (!used[j]) {
+                    int c = cost[r-1][j-1] - u[r] - v[j];
+                    if (c < minv[j]) {
+                        minv[j] = c;
+                        way[j] = col;
+                    }
+                    /* On a tie a free column ends the search sooner. */
+                    if (minv[j] < delta || (minv[j] == delta && !row[j] && row[next])) {
+                        delta = minv[j];
+                        next = j;
+                    }
+                }
+            for (int j = 0; j <= NUM_REGS; j++)
+                if (used[j]) {
+                    u[row[j]] += delta;
+                    v[j] -= delta;
+                } else
+                    minv[j] -= delta;
+            col = next;
+        } while (row[col]);
+        do {
+            int prev = way[col];
+            row[col] = row[prev];
+            col = prev;
+        } while (col);
+    }
+
+    for (int j = 1; j <= NUM_REGS; j++)
+        if (row[j]) {
+            assignment[row[j]-1] = j - 1;
+            total += cost[row[j]-1][j-1];
+        }
+    return total;
+}
+
+/* Fitness of the register file after a batch evaluation. If assignment is
+ * not NULL, it receives the program register holding each output. If
+ * credited is not NULL, it receives the output registers and those holding
+ * a word the fitness gives credit for. */
+int program_fitness( const fitness_t *f, const batch_register_t *registers, int *assignment, unsigned *credited )
+{
+    int cost[NUM_REGS][NUM_REGS];
+    int identity = 0, fitness, tmp[NUM_REGS];
+    unsigned taken = 0, shared = 0, found, outputs = (1u << f->num_outputs) - 1;
+
+    if (!assignment)
+        assignment = tmp;
+    if (f->type == FITNESS_EXACT) {
+        for (int o = 0; o < f->num_outputs; o++)
+            assignment[o] = o;
+        if (credited)
+            *credited = outputs;
+        return exact_fitness( f, registers );
+    }
+
+    found = distance_costs( f, registers, cost );
+    if (credited)
+        *credited = outputs | found;
+
+    /* The cheapest register of every output, preferring the expected one,
+     * is the answer unless two outputs want the same register. */
+    fitness = 0;
+    for (int o = 0; o < f->num_outputs; o++) {
+        assignment[o] = o;
+        for (int r = 0; r < NUM_REGS; r++)
+            if (cost[o][r] < cost[o][assignment[o]])
+                assignment[o] = r;
+        fitness += cost[o][assignment[o]];
+        identity += cost[o][o];
+        shared |= taken & (1 << assignment[o]);
+        taken |= 1 << assignment[o];
+    }
+    if (shared) {
+        fitness = assign_registers( cost, f->num_outputs, assignment );
+        /* Keep the result where it is expected when that is as good. */
+        if (identity <= fitness) {
+            for (int o = 0; o < f->num_outputs; o++)
+                assignment[o] = o;
+            fitness = identity;
+        }
+    }
+
+    for (int o = 0; o < f->num_outputs; o++) {
+        const xmm_register_t *reg = registers[assignment[o]];
+        for (int i = 0; i < 8; i++)
+            if (reg[0].wd[i] == f->ref[0].output[o].wd[i])
+                for (int k = 1; k < f->num_ref; k++)
+                    if (reg[k].wd[i] != f->ref[k].output[o].wd[i]) {
+                        fitness += DIST_MISSING;
+                        break;
+                    }
+    }
+    return fitness;
+}
+
+/* Move the result of a straight-line program from registers assignment[o] to
+ * registers o. Registers are renamed where possible: the values are grouped
+ * into webs, joining the old and new value of every instruction that writes
+ * its destination in place, and each web gets a register free over its live
+ * range, with inputs staying in their registers and outputs going to theirs.
+ * Outputs that cannot be placed that way are copied with movdqa at the end.
+ * Returns the new length, or -1 if the copies do not fit in capacity
+ * instructions. */
+int remap_outputs( instruction_t *instr, int length, int capacity, const int *assignment, int num_outputs )
+{
+    enum { NUM_VALUES = NUM_REGS + MAX_INSTR };
+    int web[NUM_VALUES], start[NUM_VALUES], end[NUM_VALUES], pin[NUM_VALUES], owner[NUM_VALUES], reg[NUM_VALUES];
+    int src[MAX_INSTR], cur[NUM_REGS], busy[NUM_REGS], from[NUM_REGS];
+    unsigned renamed = (1u << num_outputs) - 1;     /* outputs placed by renaming */
+    int num_values = NUM_REGS + length, failed;
+
+    for (int o = 0; o < NUM_REGS; o++)
+        from[o] = o < num_outputs && assignment[o] != o ? assignment[o] : -1;
+    if (length > MAX_INSTR)
+        goto copy;
+
+    /* Values 0 to NUM_REGS-1 are the initial registers, NUM_REGS+i the
+     * result of instruction i. A value occupies its register from its
+     * definition up to its last use. */
+    for (int v = 0; v < num_values; v++) {
+        web[v] = v;
+        start[v] = v < NUM_REGS ? -1 : v - NUM_REGS;
+        end[v] = v < NUM_REGS ? -1 : v - NUM_REGS + 1;
+    }
+    for (int r = 0; r < NUM_REGS; r++)
+        cur[r] = r;
+    for (int i = 0; i < length; i++) {
+        int d = instr[i].operands[0];
+
+        if (reads_src( &instr[i] )) {
+            src[i] = cur[instr[i].operands[1]];
+            if (end[src[i]] < i)
+                end[src[i]] = i;
+        }
+        if (reads_dst( &instr[i] )) {
+            int w = cur[d];
+            if (end[w] < i)
+                end[w] = i;
+            /* Earlier values lead their web, so the leader has its start. */
+            web[NUM_REGS + i] = web[w];
+        }
+        cur[d] = NUM_REGS + i;
+    }
+    for (int o = 0; o < num_outputs; o++)
+        end[cur[assignment[o]]] = length + 1;
+    for (int v = 0; v < num_values; v++)
+        if (web[v] != v && end[v] > end[web[v]])
+            end[web[v]] = end[v];
+
+    do {
+        /* Pin the webs of the inputs and of the outputs still renamed. */
+        for (int v = 0; v < num_values; v++)
+            pin[v] = owner[v] = -1;
+        for (int r = 0; r < NUM_REGS; r++)
+            if (end[r] >= 0)
+                pin[r] = r;
+        for (int o = 0; o < num_outputs; o++) {
+            int w = web[cur[assignment[o]]];
+            if (!(renamed & (1 << o)))
+                continue;
+            if (pin[w] >= 0 && pin[w] != o)
+                renamed &= ~(1 << o);
+            else {
+                pin[w] = o;
+                owner[w] = o;
+            }
+        }
+
+        /* Webs in order of their start, each to its pinned register, its own
+         * one if that is free or the first one free. A register is not free
+         * if a pinned web overlapping the range still needs it. When an
+         * output cannot get its register it is copied instead. */
+        for (int r = 0; r < NUM_REGS; r++)
+            busy[r] = -1;
+        failed = 0;
+        for (int v = 0; v < num_values; v++) {
+            int r = -1;
+
+            if (web[v] != v) {
+                reg[v] = reg[web[v]];
+                continue;
+            }
+            if (end[v] < 0)
+                continue;
+            if (pin[v] >= 0)
+                r = busy[pin[v]] <= start[v] ? pin[v] : -1;
+            else {
+                int own = v < NUM_REGS ? v : instr[v - NUM_REGS].operands[0];
+                for (int n = -1; n < NUM_REGS && r < 0; n++) {
+                    int c = n < 0 ? own : n, ok = busy[c] <= start[v];
+                    for (int w = v + 1; w < num_values && ok; w++)
+                        if (web[w] == w && pin[w] == c && start[w] < end[v] && end[w] >= 0)
+                            ok = 0;
+                    if (ok)
+                        r = c;
+                }
+            }
+            if (r < 0) {
+                if (!renamed)
+                    goto copy;
+                renamed = owner[v] >= 0 ? renamed & ~(1 << owner[v]) : 0;
+                failed = 1;
+                break;
+            }
+            reg[v] = r;
+            busy[r] = end[v];
+        }
+    } while (failed);
+
+    /* Copies may now be to the same register. */
+    for (int i = num_values = 0; i < length; i++) {
+        if (reads_src( &instr[i] ))
+            instr[i].operands[1] = reg[src[i]];
+        instr[i].operands[0] = reg[NUM_REGS + i];
+        if (instr[i].opcode != MOVDQA || instr[i].operands[0] != instr[i].operands[1])
+            instr[num_values++] = instr[i];
+    }
+    length = num_values;
+    for (int o = 0; o < num_outputs; o++) {
+        int r = reg[cur[assignment[o]]];
+        from[o] = (renamed & (1 << o)) || r == o ? -1 : r;
+    }
+
+copy:
+    /* Sequence the copies so none overwrites a register still to be read,
+     * breaking cycles through a register outside the result. */
+    for (;;) {
+        int o, pending = -1, read = 0;
+
+        for (o = 0; o < num_outputs; o++)
+            if (from[o] >= 0)
+                read |= 1 << from[o];
+        for (o = 0; o < num_outputs; o++)
+            if (from[o] >= 0) {
+                pending = o;
+                if (!(read & (1 << o)))
+                    break;
+            }
+        if (pending < 0)
+            return length;
+        if (length == capacity)
+            return -1;
+        instr[length].opcode = MOVDQA;
+        instr[length].operands[2] = 0;
+        if (o < num_outputs) {
+            instr[length].operands[0] = o;
+            instr[length++].operands[1] = from[o];
+            from[o] = -1;
+        } else {
+            int t;
+            for (t = num_outputs; t < NUM_REGS && (read & (1 << t)); t++)
+                ;
+            if (t == NUM_REGS)
+                return -1;
+            instr[length].operands[0] = t;
+            instr[length++].operands[1] = pending;
+            for (o = 0; o < num_outputs; o++)
+                if (from[o] == pending)
+                    from[o] = t;
+        }
+    }
+}
@@ -2,89 +2,374 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <time.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#ifdef TIMERS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#include "genetic_asm.h"
+
+#define DEFAULT_MIGRATE 1000
+#define MAX_THREADS 256
+#define MAX_ISLANDS 256
+#define QUEUE_SIZE 4
+#define TOURNAMENT_SIZE 8
+#define DEFAULT_CHECKPOINT 16
+#define CHECKPOINT_CACHE 256
+#define DEFAULT_CACHE (1 << 16)
+#define DEFAULT_CPU_PROFILE "skylake"
+#define DEFAULT_MAX_DEPTH 12
+#define DEFAULT_ENUM_REGS 4
+#define DEFAULT_MEMORY 1024
+#define DEFAULT_SNAPSHOT_INTERVAL 1000000
+#define DEFAULT_SEED_VARIANTS 3
+#define DEFAULT_BENCH_SEEDS 8
+#define DEFAULT_TARGET "4x4-frame"
+#define BENCH_CALLS 200000      /* calls timed by each microbenchmark */
+#define STATS_BINS 32
+#define MAX_WORKERS 256
+#define MUTATION_DECAY 0.999f   /* weight of the earlier outcomes of an operator at each use */
+#define MUTATION_FLOOR 0.02f    /* least probability of any mutation operator */
+#define MAX_DUPLICATE 8         /* longest block copied by a duplication */
+#define MAX_SEGMENT 32          /* longest segment exchanged by crossover */
+#define NET_POOL 64             /* best programs the coordinator hands out */
+
+/* Hot path timers, built with make CFLAGS="-O2 -DTIMERS". Without TIMERS
+ * they compile to nothing. Ticks are TSC cycles on x86, ns elsewhere. */
+enum {
+    TIMER_EVALUATE,     /* including TIMER_EFFECTIVE */
+    TIMER_EFFECTIVE,
+    TIMER_SELECT,
+    TIMER_CROSSOVER,
+    TIMER_MUTATE,
+    TIMER_REPLACE,
+    NUM_TIMERS
+};
 
-#define NUM_REGS 16
-#define MAX_INSTR 500
-#define MIN_INSTR 5
-#define INITIAL_INSTR 96
-#define DEFAULT_PROGRAMS 100
-#define LEN_ABSOLUTE  0
-#define LEN_EFFECTIVE 1
-#define NUM_REF 3
-
-typedef union xmm_register {
-    uint64_t q[2];
-    uint32_t d[4];
-    uint16_t wd[8];
-    uint8_t  b[16];
-} xmm_register_t;
-
-typedef struct instruction {
-    uint8_t opcode;
-    uint8_t operands[3];
-    uint8_t flags;
-    void (*fp)(uint16_t src[8], uint16_t dst[8], uint8_t imm);
-} instruction_t;
-
-typedef struct program {
-    int length[2];  /* 0 = absolute, 1 = effective */
-    int fitness;
-    int cost;
-    xmm_register_t registers[NUM_REGS];
-    instruction_t instructions[MAX_INSTR];
-    instruction_t effective[MAX_INSTR];
-} program_t;
+#ifdef TIMERS
+static const char * const timer_names[NUM_TIMERS] =
+    { "evaluate", "effective", "select", "crossover", "mutate", "replace" };
+
+static inline uint64_t read_timer(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+#define START_TIMER(name) uint64_t name = read_timer()
+#define STOP_TIMER(isl, timer, name) ((isl)->timers[timer] += read_timer() - (name))
+#else
+#define START_TIMER(name)
+#define STOP_TIMER(isl, timer, name)
+#endif
+#define SNAPSHOT_MAGIC "GASMSNAP"
+#define SNAPSHOT_VERSION 9
+
+/* Single producer, single consumer ring of migrants between two neighbouring
+ * islands. Each island only ever writes one end, so head and tail are the
+ * only shared state. */
+typedef struct migration_queue {
+    program_t slots[QUEUE_SIZE];
+    uint8_t storage[QUEUE_SIZE][PROGRAM_STORAGE(MAX_INSTR)];
+    int head;   /* next slot to read, owned by the consumer */
+    int tail;   /* next slot to write, owned by the producer */
+} migration_queue_t;
+
+/* Register files saved every checkpoint interval along the effective program,
+ * so a changed program can resume from the last state before the change.
+ * Each island caches them for a few population slots, and keeps one for each
+ * offspring until it is known whether it enters the population. */
+typedef struct checkpoint {
+    int slot;               /* population slot the states belong to, -1 if none */
+    unsigned version;       /* of that slot when the states were saved */
+    int num;                /* states[c] is the register file before effective */
+    int capacity;           /* instruction (c+1)*interval */
+    batch_register_t (*states)[NUM_REGS];
+    /* Offspring only: the first prefix states are still in the cache entry
+     * of the parent and are not duplicated here. */
+    int prefix;
+    int parent;
+    unsigned parent_version;
+} checkpoint_t;
+
+/* Mutation operators. Each island picks them with probabilities that follow
+ * how often each has lately made an offspring better than its parent. */
+enum {
+    MUTATE_OPCODE,
+    MUTATE_REGISTER,
+    MUTATE_IMMEDIATE,
+    MUTATE_INSERT,
+    MUTATE_DELETE,
+    MUTATE_SWAP,
+    MUTATE_DUPLICATE,
+    NUM_MUTATIONS
+};
+
+static const char * const mutation_names[NUM_MUTATIONS] =
+    { "opcode", "register", "immediate", "insert", "delete", "swap", "duplicate" };
+
+enum {
+    CROSSOVER_LINEAR,
+    CROSSOVER_HOMOLOGOUS,
+    CROSSOVER_EFFECTIVE,
+    NUM_CROSSOVERS,
+};
+
+static const char * const crossover_names[NUM_CROSSOVERS] = { "linear", "homologous", "effective" };
+
+/* A snapshot holds the whole state of an evolve run, in native byte order:
+ * the header, the references, then for each island a snapshot_island_t, its
+ * rank heap and every program as a snapshot_program_t followed by the genome.
+ * Effective programs are rebuilt on resume. */
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint16_t num_ref;
+    uint16_t num_regs;
+    uint16_t max_instr;
+    uint16_t num_instr;
+    int32_t random_seed;
+    int32_t num_programs;
+    int32_t num_islands;
+    int32_t migrate_interval;
+    int32_t iteration;      /* the next one to run */
+    int32_t fitness_type;
+    int32_t isa;
+    int32_t references;
+    int32_t crossover;
+    char cpu_profile[16];
+    target_t target;
+} snapshot_header_t;
+
+typedef struct snapshot_island {
+    uint64_t rng[4];
+    int32_t best;
+    int64_t evaluations;
+    float mutation_uses[NUM_MUTATIONS];
+    float mutation_successes[NUM_MUTATIONS];
+} snapshot_island_t;
+
+typedef struct snapshot_program {
+    int32_t fitness;
+    int32_t cost;
+    int32_t length;
+    int32_t live_out;   /* registers the effective program was built for */
+} snapshot_program_t;
+
+enum {
+    CACHE_NEUTRAL,  /* effective program unchanged from the parent */
+    CACHE_HIT,
+    CACHE_MISS,
+};
 
-typedef struct reference {
-    xmm_register_t input[NUM_REGS];
-    xmm_register_t output[NUM_REGS];
-    int num_regs_used[2];
-} reference_t;
+/* A barrier that threads done evolving leave, releasing the others if they
+ * were the last ones missing. */
+typedef struct island_barrier {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int threads;        /* still evolving */
+    int waiting;
+    unsigned generation;
+} island_barrier_t;
+
+struct genetic_asm_s;
+
+typedef struct island {
+    int id;
+    struct genetic_asm_s *h;
+    rng_t rng;
+    genome_arena_t arena;
+    program_t *programs;
+    int num_programs;
+    program_t winners[2];
+    int parents[2];
+    int mutation[2];        /* operator applied to each winner, -1 if none */
+    float mutation_rate[NUM_MUTATIONS];         /* probability of each operator */
+    float mutation_uses[NUM_MUTATIONS];         /* decayed counts of its uses */
+    float mutation_successes[NUM_MUTATIONS];    /* and of the better offspring */
+    uint8_t winner_storage[2][PROGRAM_STORAGE(MAX_INSTR)];
+    checkpoint_t offspring[2];
+    checkpoint_t *checkpoints;
+    int num_checkpoints;
+    unsigned *version;      /* bumped whenever a population slot changes */
+    migration_queue_t *inbox;
+    migration_queue_t *outbox;
+    rank_t rank;
+    int fitness;    /* of the best program */
+    int fitness_iteration;  /* the iteration it was reached */
+    int best;
+    int iterations;
+    int64_t evaluations;
+    int64_t instructions[2];    /* effective instructions executed, skipped */
+    int64_t cache_stats[3];
+    uint64_t timers[NUM_TIMERS];
+} island_t;
 
 typedef struct genetic_asm_s {
     int random_seed;
+    rng_t rng;              /* stream 0 of the seed, for the references */
+    const char *target_name;
+    target_t target;
+    int fitness_type;
+    fitness_t fitness;
+    int isa;
+    int num_opcodes;        /* of the instruction set level */
+    int references;
+    int crossover;
+    const char *coordinator;    /* address of the coordinator, or NULL */
+    net_connection_t net;       /* to the coordinator, for the first island */
+    const char *export_prefix;  /* files the solution is exported to, or NULL */
     int num_programs;
-    program_t *programs;
+    int emulator;
+    int num_islands;
+    int num_threads;        /* the islands are spread over */
+    int migrate_interval;
+    int checkpoint_interval;
+    int cache_size;
+    const char *cpu_profile;
+    int mode;
+    int max_depth;
+    int enum_regs;
+    int memory;     /* MB for the enumeration state table */
+    const char *snapshot_file;
+    int snapshot_interval;
+    const char *resume_file;
+    const uint8_t *snapshot;            /* mapped snapshot being resumed */
+    size_t snapshot_size;
+    const uint8_t **snapshot_islands;   /* start of each island in it */
+    int start_iteration;
+    pid_t writer;                       /* process writing the last snapshot */
+    island_barrier_t barrier;
+    const char *seed_file;
+    int seed_variants;      /* mutated copies of each seeded program */
+    seed_corpus_t seeds;
+    int max_iterations;     /* 0 runs until a solution is found */
+    int bench_seeds;
+    int quiet;
+    int stats_interval;     /* iterations between population statistics, 0 for none */
+    const char *stats_file;
+    FILE *stats;
+    fitness_cache_t cache;
+    reference_t ref[NUM_REF];
+    batch_register_t input[NUM_REGS];   /* ref[].input interleaved for execute_batch */
+    island_t *islands;
+    migration_queue_t *queues;
+    int stop_iteration;
+    /* Outcome of the last main_loop(). */
+    int64_t evaluations;
+    double elapsed;
+    int solved;             /* iterations to the solution, -1 if none */
+    int best_fitness;       /* of all islands, and the iteration it was */
+    int best_iteration;     /* first reached */
 } genetic_asm_t;
 
 enum {
     OPT_SEED = 256,
+    OPT_EMULATOR,
+    OPT_MIGRATE,
+    OPT_CHECKPOINT,
+    OPT_FITNESS_CACHE,
+    OPT_CPU_PROFILE,
+    OPT_MODE,
+    OPT_MAX_DEPTH,
+    OPT_ENUM_REGS,
+    OPT_MEMORY,
+    OPT_SNAPSHOT,
+    OPT_SNAPSHOT_INTERVAL,
+    OPT_RESUME,
+    OPT_SEED_FILE,
+    OPT_SEED_VARIANTS,
+    OPT_ITERATIONS,
+    OPT_BENCH_SEEDS,
+    OPT_STATS,
+    OPT_STATS_FILE,
+    OPT_TARGET,
+    OPT_FITNESS,
+    OPT_ISA,
+    OPT_REFERENCES,
+    OPT_COORDINATOR,
+    OPT_EXPORT,
+    OPT_CROSSOVER,
+    OPT_ISLANDS,
+};
+
+/* Symbolic references hold the provenance of every byte in the first
+ * reference and score programs on it alone, random ones score on all
+ * NUM_REF references filled with random words. */
+enum {
+    REFERENCES_SYMBOLIC,
+    REFERENCES_RANDOM,
 };
 
-static char short_options[] = "hp:";
+/* Input bytes are numbered from 1 and PROVENANCE_MIXED is not a number. */
+#define SYMBOLIC_INPUTS ((PROVENANCE_MIXED - 1) / 16)
+
+enum {
+    MODE_EVOLVE,
+    MODE_ENUMERATE,
+    MODE_BENCH,
+    MODE_COORDINATE,
+    MODE_EXPORT,
+};
+
+static char short_options[] = "hp:t:";
 static struct option long_options[] =
 {
     {"help",       no_argument,       NULL, 'h'},
     {"population", required_argument, NULL, 'p'},
     {"seed",       required_argument, NULL, OPT_SEED},
+    {"emulator",   required_argument, NULL, OPT_EMULATOR},
+    {"threads",    required_argument, NULL, 't'},
+    {"islands",    required_argument, NULL, OPT_ISLANDS},
+    {"migrate",    required_argument, NULL, OPT_MIGRATE},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"fitness-cache", required_argument, NULL, OPT_FITNESS_CACHE},
+    {"cpu-profile", required_argument, NULL, OPT_CPU_PROFILE},
+    {"mode",       required_argument, NULL, OPT_MODE},
+    {"max-depth",  required_argument, NULL, OPT_MAX_DEPTH},
+    {"enum-regs",  required_argument, NULL, OPT_ENUM_REGS},
+    {"memory",     required_argument, NULL, OPT_MEMORY},
+    {"snapshot",   required_argument, NULL, OPT_SNAPSHOT},
+    {"snapshot-interval", required_argument, NULL, OPT_SNAPSHOT_INTERVAL},
+    {"resume",     required_argument, NULL, OPT_RESUME},
+    {"seed-file",  required_argument, NULL, OPT_SEED_FILE},
+    {"seed-variants", required_argument, NULL, OPT_SEED_VARIANTS},
+    {"iterations", required_argument, NULL, OPT_ITERATIONS},
+    {"bench-seeds", required_argument, NULL, OPT_BENCH_SEEDS},
+    {"stats",      required_argument, NULL, OPT_STATS},
+    {"stats-file", required_argument, NULL, OPT_STATS_FILE},
+    {"target",     required_argument, NULL, OPT_TARGET},
+    {"fitness",    required_argument, NULL, OPT_FITNESS},
+    {"isa",        required_argument, NULL, OPT_ISA},
+    {"references", required_argument, NULL, OPT_REFERENCES},
+    {"coordinator", required_argument, NULL, OPT_COORDINATOR},
+    {"export",     required_argument, NULL, OPT_EXPORT},
+    {"crossover",  required_argument, NULL, OPT_CROSSOVER},
     {0, 0, 0, 0},
 };
 
-enum instructions {
-    PUNPCKLWD   = 0,
-    PUNPCKHWD,
-    PUNPCKLDQ,
-    PUNPCKHDQ,
-    PUNPCKLQDQ,
-    PUNPCKHQDQ,
-    MOVDQA,
-    PSLLDQ,
-    PSRLDQ,
-    PSLLQ,
-    PSRLQ,
-    PSLLD,
-    PSRLD,
-    PSHUFLW,
-    PSHUFHW,
-    NUM_INSTR
-};
-
 static const uint8_t allowedshuf[24] = { (0<<6)+(1<<4)+(2<<2)+(3<<0), (0<<6)+(1<<4)+(3<<2)+(2<<0),
                                          (0<<6)+(2<<4)+(3<<2)+(1<<0), (0<<6)+(2<<4)+(1<<2)+(3<<0),
                                          (0<<6)+(3<<4)+(2<<2)+(1<<0), (0<<6)+(3<<4)+(1<<2)+(2<<0),
@@ -101,701 +386,2127 @@ static const uint8_t allowedshuf[24] = { (0<<6)+(1<<4)+(2<<2)+(3<<0), (0<<6)+(1<
                                          (3<<6)+(2<<4)+(0<<2)+(1<<0), (3<<6)+(2<<4)+(1<<2)+(0<<0),
                                          (3<<6)+(0<<4)+(2<<2)+(1<<0), (3<<6)+(0<<4)+(1<<2)+(2<<0) };
 
-#define ZIG(i,y,x) levels[i] = coeffs[x*8+y];
-
-static void init_levels_8x8()
-{
-    uint16_t levels[8*8];
-    uint16_t coeffs[8*8];
-
-    ZIG( 0,0,0) ZIG( 1,0,1) ZIG( 2,1,0) ZIG( 3,2,0)
-    ZIG( 4,1,1) ZIG( 5,0,2) ZIG( 6,0,3) ZIG( 7,1,2)
-    ZIG( 8,2,1) ZIG( 9,3,0) ZIG(10,4,0) ZIG(11,3,1)
-    ZIG(12,2,2) ZIG(13,1,3) ZIG(14,0,4) ZIG(15,0,5)
-    ZIG(16,1,4) ZIG(17,2,3) ZIG(18,3,2) ZIG(19,4,1)
-    ZIG(20,5,0) ZIG(21,6,0) ZIG(22,5,1) ZIG(23,4,2)
-    ZIG(24,3,3) ZIG(25,2,4) ZIG(26,1,5) ZIG(27,0,6)
-    ZIG(28,0,7) ZIG(29,1,6) ZIG(30,2,5) ZIG(31,3,4)
-    ZIG(32,4,3) ZIG(33,5,2) ZIG(34,6,1) ZIG(35,7,0)
-    ZIG(36,7,1) ZIG(37,6,2) ZIG(38,5,3) ZIG(39,4,4)
-    ZIG(40,3,5) ZIG(41,2,6) ZIG(42,1,7) ZIG(43,2,7)
-    ZIG(44,3,6) ZIG(45,4,5) ZIG(46,5,4) ZIG(47,6,3)
-    ZIG(48,7,2) ZIG(49,7,3) ZIG(50,6,4) ZIG(51,5,5)
-    ZIG(52,4,6) ZIG(53,3,7) ZIG(54,4,7) ZIG(55,5,6)
-    ZIG(56,6,5) ZIG(57,7,4) ZIG(58,7,5) ZIG(59,6,6)
-    ZIG(60,5,7) ZIG(61,6,7) ZIG(62,7,6) ZIG(63,7,7)
-}
-
-#undef ZIG
-#define ZIG(i,y,x) levels[i] = coeffs[x*4+y];
+static const char * const isa_names[NUM_ISAS] = { "sse2", "ssse3", "sse4" };
+static const int isa_opcodes[NUM_ISAS] = { PSHUFD + 1, PSHUFB + 1, PBLENDW + 1 };
 
-static void init_levels_4x4(reference_t *ref)
+/* Every island draws from its own stream so threads never share RNG state. */
+static inline int island_random(island_t *isl, int bound)
 {
-    uint16_t coeffs[4*4];
-    uint16_t levels[4*4];
-    int r;
-
-    ref->num_regs_used[0] = ref->num_regs_used[1] = 2;
-
-    for(r = 0; r < ref->num_regs_used[0]; r++)
-        memcpy(&coeffs[r*8], &ref->input[r], sizeof(coeffs[0]) * 8);
-    ZIG( 0,0,0) ZIG( 1,0,1) ZIG( 2,1,0) ZIG( 3,2,0)
-    ZIG( 4,1,1) ZIG( 5,0,2) ZIG( 6,0,3) ZIG( 7,1,2)
-    ZIG( 8,2,1) ZIG( 9,3,0) ZIG(10,3,1) ZIG(11,2,2)
-    ZIG(12,1,3) ZIG(13,2,3) ZIG(14,3,2) ZIG(15,3,3)
-    for(int r = 0; r < ref->num_regs_used[1]; r++)
-        memcpy(&ref->output[r], &levels[r*8], sizeof(ref->output[0]));
-    for( ; r < NUM_REGS; r++)
-        memset(&ref->output[r], 0, sizeof(ref->output[0]));
+    return rng_bounded(&isl->rng, bound);
 }
 
-static void print_instruction( instruction_t *instr, int debug )
+static void print_instruction( instruction_t *instr )
 {
-    switch( instr->opcode ) {
-        case PUNPCKLWD:
-            printf( "punpcklwd" );
-            break;
-        case PUNPCKHWD:
-            printf( "punpckhwd" );
-            break;
-        case PUNPCKLDQ:
-            printf( "punpckldq" );
-            break;
-        case PUNPCKHDQ:
-            printf( "punpckhdq" );
-            break;
-        case PUNPCKLQDQ:
-            printf( "punpcklqdq" );
-            break;
-        case PUNPCKHQDQ:
-            printf( "punpckhqdq" );
-            break;
-        case MOVDQA:
-            printf( "movdqa" );
-            break;
-        case PSLLDQ:
-            printf( "pslldq" );
-            break;
-        case PSRLDQ:
-            printf( "psrldq" );
-            break;
-        case PSLLQ:
-            printf( "psllq" );
-            break;
-        case PSRLQ:
-            printf( "psrlq" );
-            break;
-        case PSLLD:
-            printf( "pslld" );
-            break;
-        case PSRLD:
-            printf( "psrld" );
-            break;
-        case PSHUFLW:
-            printf( "pshuflw" );
-            break;
-        case PSHUFHW:
-            printf( "pshufhw" );
-            break;
-        default:
-            fprintf( stderr, "Error: unsupported instruction!\n");
-            assert(0);
-    }
+    assert(instr->opcode < NUM_INSTR);
+    printf( "%s", instruction_names[instr->opcode] );
     if(instr->opcode < PSLLDQ ) {
                                         printf(" m%d, ", instr->operands[0]);
         if (instr->operands[1] < NUM_REGS)
                                         printf("m%d", instr->operands[1]);
         else
                                         printf("0x%x", allowedshuf[instr->operands[1] - NUM_REGS]);
-    } else if(instr->opcode < PSHUFLW)  printf(" m%d, %d", instr->operands[0], instr->operands[2]);
+    } else if(instr->opcode < PSHUFLW || instr->opcode == PSHUFB)
+                                        printf(" m%d, %d", instr->operands[0], instr->operands[2]);
     else                                printf(" m%d, m%d, 0x%x", instr->operands[0], instr->operands[1], instr->operands[2] );
-    if (debug && instr->flags)          printf(" *");
 }
 
-static void print_instructions( program_t *program, int debug )
+static void print_instructions( program_t *program )
 {
     for( int i = 0; i < program->length[LEN_EFFECTIVE]; i++ ) {
         instruction_t *instr = &program->effective[i];
-        print_instruction(instr, debug);
+        print_instruction(instr);
         printf("\n");
     }
 }
 
-static void print_program( program_t *program, int debug )
+static void print_program( program_t *program )
 {
     printf("length (absolute effective) = %d %d\n", program->length[LEN_ABSOLUTE], program->length[LEN_EFFECTIVE]);
     printf("fitness = %d\n", program->fitness);
-    printf("cost = %d\n", program->cost);
-    print_instructions(program, debug);
+    printf("cost = %d (%.2f cycles)\n", program->cost, (double)program->cost / COST_SCALE);
+    print_instructions(program);
     printf("\n");
 }
 
-static void print_register( xmm_register_t *reg, int type )
+static void init_srcregisters(rng_t *rng, xmm_register_t *regs)
 {
-    switch (type) {
-        case 0:
-            for(int i = 0; i < 8; i++)
-                printf("%2u ", reg->wd[i]);
-            break;
-    }
+    for(int r = 0; r < NUM_REGS; r++)
+        for(int i = 0; i < 2; i++)
+            regs[r].q[i] = rng_next(rng);
 }
 
-static void execute_instruction( instruction_t instr, xmm_register_t *registers )
+/* Run instructions over the interleaved references the fitness is taken from. */
+static inline void run_references(const genetic_asm_t *h, const instruction_t *instr, int length,
+                                  batch_register_t *registers)
 {
-    xmm_register_t temp;
-    xmm_register_t *output = &registers[instr.operands[0]];
-    xmm_register_t *input1 = &registers[instr.operands[1]];
-    uint8_t imm = instr.operands[2];
-    int i;
-
-    switch( instr.opcode )
-    {
-        case PUNPCKLWD:
-            temp.wd[0] = output->wd[0];
-            temp.wd[2] = output->wd[1];
-            temp.wd[4] = output->wd[2];
-            temp.wd[6] = output->wd[3];
-            temp.wd[1] = input1->wd[0];
-            temp.wd[3] = input1->wd[1];
-            temp.wd[5] = input1->wd[2];
-            temp.wd[7] = input1->wd[3];
-            break;
-        case PUNPCKHWD:
-            temp.wd[0] = output->wd[4];
-            temp.wd[2] = output->wd[5];
-            temp.wd[4] = output->wd[6];
-            temp.wd[6] = output->wd[7];
-            temp.wd[1] = input1->wd[4];
-            temp.wd[3] = input1->wd[5];
-            temp.wd[5] = input1->wd[6];
-            temp.wd[7] = input1->wd[7];
-            break;
-        case PUNPCKLDQ:
-            temp.d[0] = output->d[0];
-            temp.d[2] = output->d[1];
-            temp.d[1] = input1->d[0];
-            temp.d[3] = input1->d[1];
-            break;
-        case PUNPCKHDQ:
-            temp.d[0] = output->d[2];
-            temp.d[2] = output->d[3];
-            temp.d[1] = input1->d[2];
-            temp.d[3] = input1->d[3];
-            break;
-        case PUNPCKLQDQ:
-            temp.q[0] = output->q[0];
-            temp.q[1] = input1->q[0];
-            break;
-        case PUNPCKHQDQ:
-            temp.q[0] = output->q[1];
-            temp.q[1] = input1->q[1];
-            break;
-        case MOVDQA:
-            temp.q[0] = input1->q[0];
-            temp.q[1] = input1->q[1];
-            break;
-        case PSLLDQ:
-            if (imm > 16) imm = 16;
-            for( i = 0; i < 16 - imm; i++ )
-                temp.b[i] = output->b[i+imm];
-            for( ; i < 16; i++ )
-                temp.b[i] = 0;
-            break;
-        case PSRLDQ:
-            if (imm > 16) imm = 16;
-            for( i = 0; i < imm; i++ )
-                temp.b[i] = 0;
-            for( ; i < 16; i++ )
-                temp.b[i] = output->b[i-imm];
-            break;
-        case PSLLQ:
-            if (imm > 64) {
-                temp.q[0] = 0;
-                temp.q[1] = 0;
-            } else {
-                for (i = 0; i < 2; i++)
-                    temp.q[i] = output->q[i] << imm;
-            }
-            break;
-        case PSRLQ:
-            if (imm > 64) {
-                temp.q[0] = 0;
-                temp.q[1] = 0;
-            } else {
-                for (i = 0; i < 2; i++)
-                    temp.q[i] = output->q[i] >> imm;
-            }
-            break;
-        case PSLLD:
-            if (imm > 32) {
-                temp.q[0] = 0;
-                temp.q[1] = 0;
-            } else {
-                for (i = 0; i < 4; i++)
-                    temp.d[i] = output->d[i] << imm;
-            }
-            break;
-        case PSRLD:
-            if (imm > 32) {
-                temp.q[0] = 0;
-                temp.q[1] = 0;
-            } else {
-                for (i = 0; i < 4; i++)
-                    temp.d[i] = output->d[i] >> imm;
-            }
-            break;
-        case PSHUFLW:
-            temp.wd[0] = input1->wd[imm&0x3]; imm >>= 2;
-            temp.wd[1] = input1->wd[imm&0x3]; imm >>= 2;
-            temp.wd[2] = input1->wd[imm&0x3]; imm >>= 2;
-            temp.wd[3] = input1->wd[imm&0x3];
-            temp.q[1] = input1->q[1];
-            break;
-        case PSHUFHW:
-            temp.q[0] = input1->q[0];
-            temp.wd[4] = input1->wd[4+(imm&0x3)]; imm >>= 2;
-            temp.wd[5] = input1->wd[4+(imm&0x3)]; imm >>= 2;
-            temp.wd[6] = input1->wd[4+(imm&0x3)]; imm >>= 2;
-            temp.wd[7] = input1->wd[4+(imm&0x3)];
-            break;
-        default:
-            fprintf( stderr, "Error: unsupported instruction %d %d %d %d!\n", instr.opcode, instr.operands[0], instr.operands[1], instr.operands[2]);
-            assert(instr.opcode < NUM_INSTR);
-    }
-
-    memcpy( output, &temp, sizeof(*output) );
+    if (h->references == REFERENCES_SYMBOLIC)
+        execute_batch_provenance(instr, length, registers);
+    else
+        execute_batch(instr, length, registers);
 }
 
-static void init_resultregisters(xmm_register_t *reference)
+static inline int scored_references(const genetic_asm_t *h)
 {
-    int r, i;
-    uint16_t levels[8*8];
-
-    for(r=0;r<8;r++)
-        for(i=0;i<8;i++)
-            reference[r].wd[i] = levels[i+r*8];
+    return h->references == REFERENCES_SYMBOLIC ? 1 : NUM_REF;
 }
 
-static void init_srcregisters(xmm_register_t *regs)
+static int mutate_program( island_t *isl, program_t *prog );
+
+/* Fill a slot with seeded program i % number of seeds, verbatim for the
+ * first round and with one to three mutations after that. */
+static int seed_program(island_t *isl, program_t *prog, int i)
 {
-    for(int r = 0; r < NUM_REGS; r++)
-        for(int i = 0; i < 4; i++)
-            regs[r].d[i] = random();
+    const seed_corpus_t *seeds = &isl->h->seeds;
+    int s = i % seeds->num_programs;
+    int length = seeds->start[s+1] - seeds->start[s];
+
+    if (program_reserve(&isl->arena, prog, length) < 0)
+        return -1;
+    prog->length[LEN_ABSOLUTE] = length;
+    memcpy(prog->instructions, seeds->instructions + seeds->start[s], length * sizeof(instruction_t));
+    if (i >= seeds->num_programs)
+        for(int n = island_random(isl, 3); n >= 0; n--)
+            if (mutate_program(isl, prog) < 0)
+                return -1;
+    return 0;
 }
 
-static void init_registers(program_t *program, reference_t *ref)
+/* An immediate in the range that does something for the opcode. */
+static int random_immediate(island_t *isl, int instr)
 {
-    memcpy( program->registers, ref->input, sizeof(program->registers) );
+    /* FIXME: This should be completely random, instead of the guided randomnes we have below.
+     * This may help generate more valid code, however.
+     */
+    if( instr < PSLLDQ )
+        return island_random(isl, UINT8_MAX);
+    else if( instr < PSLLQ )
+        return island_random(isl, 7) + 1;
+    else if( instr < PSLLD )
+        return island_random(isl, 64);
+    else if( instr < PSHUFLW )
+        return island_random(isl, 32);
+    else if( instr == PALIGNR )
+        return island_random(isl, 16);
+    else {
+//         return allowedshuf[island_random(isl, 24)];
+        return island_random(isl, UINT8_MAX);
+    }
 }
 
-static void init_reference(reference_t *ref)
+static void random_instruction(island_t *isl, instruction_t *instruction)
 {
-    init_levels_4x4(ref);
-    for(int r = ref->num_regs_used[0]; r < NUM_REGS; r++)
-        memset(&ref->input[r], 0, sizeof(ref->input[0]));
+    int instr = island_random(isl, isl->h->num_opcodes);
+    int output = island_random(isl, NUM_REGS);
+    int input1 = island_random(isl, NUM_REGS);
+    int input2 = random_immediate(isl, instr);
+
+    assert(instr < NUM_INSTR);
+    instruction->opcode = instr;
+    instruction->operands[0] = output;
+    instruction->operands[1] = input1;
+    instruction->operands[2] = input2;
 }
 
-static void init_programs(genetic_asm_t *h)
+static int init_programs(island_t *isl)
 {
-    for(int i = 0; i < h->num_programs; i++) {
-        program_t *program = &h->programs[i];
-        program->length[LEN_ABSOLUTE] = (random() % INITIAL_INSTR) + MIN_INSTR;
-        for(int j = 0; j < program->length[LEN_ABSOLUTE]; j++) {
-            int instr = random() % NUM_INSTR;
-            int output = random() % NUM_REGS;
-            int input1 = NUM_REGS, input2 = 0;
-            assert(j < MAX_INSTR);
-            instruction_t *instruction = &program->instructions[j];
+    int64_t num_seeded = isl->h->seeds.num_programs * (1 + (int64_t)isl->h->seed_variants);
 
-            /* FIXME: This should be completely random, instead of the guided randomnes we have below.
-             * This may help generate more valid code, however.
-             */
-            input1 = random() % NUM_REGS;
-            if( instr < PSLLDQ )
-                input2 = random() % UINT8_MAX;
-            else if( instr < PSLLQ )
-                input2 = (random() % 7) + 1;
-            else if( instr < PSLLD )
-                input2 = random() % 64;
-            else if( instr < PSHUFLW )
-                input2 = random() % 32;
-            else {
-//                 input2 = allowedshuf[random() % 24];
-                input2 = random() % UINT8_MAX;
-            }
+    /* Leave at least half of the population random. */
+    if (num_seeded > isl->num_programs / 2)
+        num_seeded = isl->num_programs / 2;
 
-            assert(instr < NUM_INSTR);
-            instruction->opcode = instr;
-            instruction->operands[0] = output;
-            instruction->operands[1] = input1;
-            instruction->operands[2] = input2;
+    for(int i = 0; i < isl->num_programs; i++) {
+        program_t *program = &isl->programs[i];
+        if (i < num_seeded) {
+            if (seed_program(isl, program, i) < 0)
+                return -1;
+            continue;
         }
+        program->length[LEN_ABSOLUTE] = island_random(isl, INITIAL_INSTR) + MIN_INSTR;
+        if (program_reserve(&isl->arena, program, program->length[LEN_ABSOLUTE]) < 0)
+            return -1;
+        for(int j = 0; j < program->length[LEN_ABSOLUTE]; j++)
+            random_instruction(isl, &program->instructions[j]);
     }
+    return 0;
 }
 
-static void effective_program(program_t *prog, int num_output_regs)
+/* Collect the instructions that contribute to the live registers into
+ * prog->effective. live[i] holds the registers still needed after genome
+ * instruction i. Instructions before prog->dirty are unchanged since live[]
+ * was last computed, so once the backward scan reaches one of them with the
+ * same live set, nothing before it can change either. Returns how many
+ * effective instructions at the start are the same as before. */
+static int effective_program(program_t *prog, unsigned live)
 {
-    uint8_t reg_eff[NUM_REGS] = {0};
-    int i = prog->length[LEN_ABSOLUTE] - 1;
-    int j;
+    int length = prog->length[LEN_ABSOLUTE];
+    int i, j, unchanged;
 
-    /* We want our results starting at r0. */
-    for(int r = 0; r < num_output_regs; r++)
-        reg_eff[r] = 1;
-
-    while(i >= 0 && (prog->instructions[i].operands[0] != 0 && prog->instructions[i].operands[0] != 1)) {
-        assert(i < MAX_INSTR && i >= 0);
-        prog->instructions[i].flags = 0;
-        i--;
-    }
-    for( ; i >= 0; i--) {
+    for(i = length - 1; i >= 0; i--) {
         instruction_t *instr = &prog->instructions[i];
-        assert(i >= 0);
 
-        instr->flags = 0;
-        for (j = 0; j < NUM_REGS; j++)
-            if (reg_eff[j] && instr->operands[0] == j)
-                instr->flags = 1;
-
-        if (!instr->flags)
+        if (i < prog->dirty && prog->live[i] == live)
+            break;
+        prog->live[i] = live;
+        if (!(live & (1 << instr->operands[0])))
             continue;
-        if (instr->opcode >= PSHUFLW || instr->opcode == MOVDQA)
-            reg_eff[instr->operands[0]] = 0;
-        if (instr->operands[1] < NUM_REGS &&
-            (instr->opcode < PSLLDQ || instr->opcode > PSRLD))
-            reg_eff[instr->operands[1]] = 1;
+        if (!reads_dst(instr))
+            live &= ~(1 << instr->operands[0]);
+        if (reads_src(instr))
+            live |= 1 << instr->operands[1];
     }
 
-    for(j = i = 0; i < prog->length[LEN_ABSOLUTE]; i++) {
-        assert(i < MAX_INSTR);
-        if (!prog->instructions[i].flags)
-            continue;
-        prog->instructions[i].flags = 0;
-        prog->effective[j++] = prog->instructions[i];
-    }
+    for(unchanged = j = 0, i++; j < i; j++)
+        unchanged += (prog->live[j] >> prog->instructions[j].operands[0]) & 1;
+    for(j = unchanged; i < length; i++)
+        if ((prog->live[i] >> prog->instructions[i].operands[0]) & 1)
+            prog->effective[j++] = prog->instructions[i];
     prog->length[LEN_EFFECTIVE] = j;
-}
+    prog->dirty = MAX_INSTR;
 
-static int run_program( program_t *program, reference_t *ref, int debug )
-{
-    init_registers(program, ref);
-    if( debug ) {
-//         printf("sourceregs: \n");
-//         for(r=0; r<8; r++) {
-//             for(j=0; j<8; j++)
-//                 printf("%d ", srcregisters[r][j]);
-//             printf("\n");
-//         }
-        printf("\ntargetregs:\n");
-        for(int r = 0; r < ref->num_regs_used[0]; r++) {
-            print_register(&ref->output[r], 0);
-            printf("\n");
-        }
-    }
-    for(int i = 0; i < program->length[LEN_EFFECTIVE]; i++ ) {
-/*
-        if(debug) {
-            printf("regs: \n");
-            for(int r = 0;r < NUM_REGS; r++) {
-                print_register(&program->registers[r], 0);
-                printf("\n");
-            }
-        }
-*/
-        execute_instruction( program->effective[i], program->registers );
-    }
-    if(debug) {
-        printf("\nresultregs:\n");
-        for(int r = 0; r < NUM_REGS; r++) {
-            print_register(&program->registers[r], 0);
-            printf("\n");
-        }
-    }
-    return 1;
+    return unchanged;
 }
 
 //#define CHECK_LOC if( i >= 2 && i <= 5 ) continue;
 #define CHECK_LOC if( 0 ) continue;
 
-static int result_fitness( program_t *prog, reference_t *ref )
+static void result_cost( program_t *prog )
 {
-    int sumerror = 0;
-
-    for( int r = 0; r < ref->num_regs_used[1]; r++ ) {
-        int regerror = 0;
-        for(int i = 0; i < 8; i++ )
-            regerror += prog->registers[r].wd[i] != ref->output[r].wd[i];
-        sumerror += regerror;
-    }
+    prog->cost = program_cost(prog->effective, prog->length[LEN_EFFECTIVE]);
+    if(!prog->cost)
+        prog->cost = INT_MAX;
+}
 
-    return sumerror*sumerror;
+static void instruction_delete( instruction_t *instructions, int loc, int numinstructions )
+{
+    memmove( &instructions[loc], &instructions[loc+1], (numinstructions - loc - 1) * sizeof(*instructions) );
 }
 
-static void result_cost( program_t *prog )
+/* Open a gap of count instructions at loc. */
+static void instruction_shift( instruction_t *instructions, int loc, int count, int numinstructions )
 {
-    /* TODO: Use instruction latency/thouroghput */
-    prog->cost = prog->length[LEN_EFFECTIVE];
-    if(!prog->cost)
-        prog->cost = INT_MAX;
+    memmove( &instructions[loc+count], &instructions[loc], (numinstructions - loc) * sizeof(*instructions) );
 }
 
-static void instruction_delete( uint8_t (*instructions)[4], int loc, int numinstructions )
+/* Make room for length instructions in a population program, keeping its
+ * genome. Winners have room for MAX_INSTR already. */
+static int program_grow( island_t *isl, program_t *prog, int length )
 {
-    int i;
-    for( i = loc; i < numinstructions-1; i++ )
-    {
-        instructions[i][0] = instructions[i+1][0];
-        instructions[i][1] = instructions[i+1][1];
-        instructions[i][2] = instructions[i+1][2];
-        instructions[i][3] = instructions[i+1][3];
-    }
+    instruction_t genome[MAX_INSTR];
+
+    if (!prog->capacity || length <= prog->capacity)
+        return 0;
+    memcpy(genome, prog->instructions, prog->length[LEN_ABSOLUTE] * sizeof(*genome));
+    if (program_reserve(&isl->arena, prog, length) < 0)
+        return -1;
+    memcpy(prog->instructions, genome, prog->length[LEN_ABSOLUTE] * sizeof(*genome));
+    return 0;
 }
 
-static void instruction_shift( uint8_t (*instructions)[4], int loc, int numinstructions )
+/* Probability of each operator from its decayed rate of success, counting
+ * one success in two uses on top so untried operators get their turn. */
+static void update_mutation_rates( island_t *isl )
 {
-    int i;
-    for( i = numinstructions; i > loc; i-- )
-    {
-        instructions[i][0] = instructions[i-1][0];
-        instructions[i][1] = instructions[i-1][1];
-        instructions[i][2] = instructions[i-1][2];
-        instructions[i][3] = instructions[i-1][3];
+    float rate[NUM_MUTATIONS], sum = 0;
+
+    for (int op = 0; op < NUM_MUTATIONS; op++) {
+        rate[op] = (isl->mutation_successes[op] + 1) / (isl->mutation_uses[op] + 2);
+        sum += rate[op];
     }
+    for (int op = 0; op < NUM_MUTATIONS; op++)
+        isl->mutation_rate[op] = MUTATION_FLOOR + (1 - NUM_MUTATIONS * MUTATION_FLOOR) * rate[op] / sum;
 }
 
-static void mutate_program( program_t *prog, float probabilities[3] )
+static void credit_mutation( island_t *isl, int op, int success )
 {
-    if (prog->length[LEN_ABSOLUTE] == 0)
-        return;
-    int p = random();
-    int ins_idx = random() % prog->length[LEN_ABSOLUTE];
-    instruction_t *instr = &prog->instructions[ins_idx];
-
-    assert(ins_idx < MAX_INSTR);
+    isl->mutation_uses[op] = isl->mutation_uses[op] * MUTATION_DECAY + 1;
+    isl->mutation_successes[op] = isl->mutation_successes[op] * MUTATION_DECAY + success;
+    update_mutation_rates( isl );
+}
 
-    if(p < RAND_MAX * probabilities[0])                                 /* Modify an instruction */
-        instr->opcode = random() % NUM_INSTR;
-    else if (p < RAND_MAX * (probabilities[0] + probabilities[1])) {    /* Modify a regester */
-        if (random() < RAND_MAX / 2)
-            instr->operands[0] = random() % NUM_REGS;
-        else
-            instr->operands[1] = random() % NUM_REGS;
-    } else                                                              /* Modify a constant */
-        instr->operands[2] = random() % UINT8_MAX;
+/* Apply one mutation operator, returning which, or -1 if out of memory. */
+static int mutate_program( island_t *isl, program_t *prog )
+{
+    int length = prog->length[LEN_ABSOLUTE];
+    float p = rng_float(&isl->rng);
+    int op = 0, loc;
+    instruction_t *instr;
+
+    while (op < NUM_MUTATIONS - 1 && (p -= isl->mutation_rate[op]) >= 0)
+        op++;
+    /* Fall back to what the length allows. */
+    if (!length)
+        op = MUTATE_INSERT;
+    else if ((op == MUTATE_INSERT || op == MUTATE_DUPLICATE) && length == MAX_INSTR)
+        op = MUTATE_SWAP;
+    else if (op == MUTATE_DELETE && length == 1)
+        op = MUTATE_OPCODE;
+
+    loc = island_random(isl, length + (op == MUTATE_INSERT));
+    instr = &prog->instructions[loc];
+    switch (op) {
+        case MUTATE_OPCODE:
+            instr->opcode = island_random(isl, isl->h->num_opcodes);
+            break;
+        case MUTATE_REGISTER:
+            if (island_random(isl, 2))
+                instr->operands[0] = island_random(isl, NUM_REGS);
+            else
+                instr->operands[1] = island_random(isl, NUM_REGS);
+            break;
+        case MUTATE_IMMEDIATE:
+            instr->operands[2] = random_immediate(isl, instr->opcode);
+            break;
+        case MUTATE_INSERT:
+            if (program_grow(isl, prog, length + 1) < 0)
+                return -1;
+            instr = &prog->instructions[loc];
+            instruction_shift(prog->instructions, loc, 1, length);
+            random_instruction(isl, instr);
+            length++;
+            break;
+        case MUTATE_DELETE:
+            instruction_delete(prog->instructions, loc, length);
+            length--;
+            break;
+        case MUTATE_SWAP: {
+            int other = island_random(isl, length);
+            instruction_t temp = *instr;
+            *instr = prog->instructions[other];
+            prog->instructions[other] = temp;
+            if (other < loc)
+                loc = other;
+            break;
+        }
+        case MUTATE_DUPLICATE: {
+            /* Copy count instructions from loc to a random place. */
+            instruction_t block[MAX_DUPLICATE];
+            int count, to;
+
+            count = MAX_DUPLICATE < MAX_INSTR - length ? MAX_DUPLICATE : MAX_INSTR - length;
+            count = 1 + island_random(isl, count < length - loc ? count : length - loc);
+            to = island_random(isl, length + 1);
+            memcpy(block, instr, count * sizeof(*block));
+            if (program_grow(isl, prog, length + count) < 0)
+                return -1;
+            instruction_shift(prog->instructions, to, count, length);
+            memcpy(&prog->instructions[to], block, count * sizeof(*block));
+            length += count;
+            loc = to;
+            break;
+        }
+    }
 
-    assert(instr->opcode < NUM_INSTR);
+    prog->length[LEN_ABSOLUTE] = length;
     /* Invalidate existing fitness */
     prog->fitness = INT_MAX;
     prog->cost = 0;
+    if (loc < prog->dirty)
+        prog->dirty = loc;
+    return op;
 }
 
-static int instruction_cost( uint8_t (*instructions)[4], int numinstructions )
+/* Pick size distinct programs at random and copy the best of them to winner,
+ * returning its index.
+ * All are drawn at once and duplicates redrawn, which is cheap as size is
+ * tiny next to the population. */
+static int run_tournament(island_t *isl, program_t *winner, int size)
 {
-    int i;
-    int cost = 0;
-    for( i = 0; i < numinstructions; i++ )
-    {
-        cost++;
-        if( instructions[i][0] != PSHUFLW && instructions[i][0] != PSHUFHW && instructions[i][1] != instructions[i][3] ) cost++;
+    uint32_t contestants[TOURNAMENT_SIZE];
+    int best = -1;
+
+    if (size > isl->num_programs)
+        size = isl->num_programs;
+    assert(size <= TOURNAMENT_SIZE);
+
+    rng_fill_bounded(&isl->rng, isl->num_programs, contestants, size);
+    for(int i = 0; i < size; i++) {
+        int idx;
+        for(int j = 0; j < i; j++)
+            if (contestants[j] == contestants[i]) {
+                contestants[i] = island_random(isl, isl->num_programs);
+                j = -1;
+            }
+        idx = contestants[i];
+
+        if(best < 0 || program_better(&isl->programs[idx], &isl->programs[best]))
+            best = idx;
     }
-    return cost;
+    program_copy(NULL, winner, &isl->programs[best]);
+    return best;
 }
 
-static int run_tournament(genetic_asm_t *h, program_t *winner, int size)
+/* A random position in [lo, hi] of prog, of an effective instruction if
+ * effective is set. Returns -1 if there is none. */
+static int crossover_point( island_t *isl, const program_t *prog, int lo, int hi, int effective )
 {
-    int *contestants;
-    int idx = random() % h->num_programs;
-    program_t *best = &h->programs[idx];
+    int n = 0, k;
 
-    contestants = calloc(h->num_programs, sizeof(*contestants));
-    if (!contestants)
+    if (lo > hi)
         return -1;
+    if (!effective)
+        return lo + island_random(isl, hi - lo + 1);
+    for (int i = lo; i <= hi; i++)
+        n += (prog->live[i] >> prog->instructions[i].operands[0]) & 1;
+    if (!n)
+        return -1;
+    k = island_random(isl, n);
+    for (int i = lo; ; i++)
+        if ((prog->live[i] >> prog->instructions[i].operands[0]) & 1 && !k--)
+            return i;
+}
 
-    for(int i = 0, j = 0; i < h->num_programs - 1; i++) {
-        if(i == idx)
-            continue;
-        contestants[j++] = i;
+/* Swap segment [point[0], point[0] + length[0]) of the first genome with
+ * [point[1], point[1] + length[1]) of the second in place. The instructions
+ * after the segments only move when the lengths differ. */
+static void exchange_segments( program_t *parents, const int *point, const int *length )
+{
+    instruction_t segment[MAX_SEGMENT];
+    instruction_t *a = parents[0].instructions + point[0], *b = parents[1].instructions + point[1];
+    int tail[2];
+
+    for (int i = 0; i < 2; i++)
+        tail[i] = parents[i].length[LEN_ABSOLUTE] - point[i] - length[i];
+    memcpy(segment, a, length[0] * sizeof(*segment));
+    if (length[0] != length[1]) {
+        memmove(a + length[1], a + length[0], tail[0] * sizeof(*a));
+        memmove(b + length[0], b + length[1], tail[1] * sizeof(*b));
     }
-    for(int i = 0; i < (size - 1); i++) {
-        int ii = random() % ((h->num_programs-1)- (i+1));
-        program_t *prog;
+    memcpy(a, b, length[1] * sizeof(*a));
+    memcpy(b, segment, length[0] * sizeof(*b));
+    parents[0].length[LEN_ABSOLUTE] += length[1] - length[0];
+    parents[1].length[LEN_ABSOLUTE] += length[0] - length[1];
+}
+
+/* Exchange a segment of at most MAX_SEGMENT instructions between the two
+ * genomes. Linear crossover starts the segments at most delta_pos apart and
+ * makes their lengths differ by at most delta_length. Homologous crossover
+ * swaps segments at the same position and of the same length, effective
+ * crossover is linear with both segments starting at effective
+ * instructions. */
+static void crossover( island_t *isl, program_t *parents, int delta_length, int delta_pos )
+{
+    int len[2] = { parents[0].length[LEN_ABSOLUTE], parents[1].length[LEN_ABSOLUTE] };
+    int point[2], length[2], lo, hi;
+    int type = isl->h->crossover;
+
+    if (!len[0] || !len[1])
+        return;
+    if (type == CROSSOVER_HOMOLOGOUS) {
+        point[0] = point[1] = island_random(isl, len[0] < len[1] ? len[0] : len[1]);
+        hi = (len[0] < len[1] ? len[0] : len[1]) - point[0];
+        hi = hi < MAX_SEGMENT ? hi : MAX_SEGMENT;
+        length[0] = length[1] = 1 + island_random(isl, hi);
+    } else {
+        int effective = type == CROSSOVER_EFFECTIVE;
+
+        hi = len[1] - 1 + delta_pos;
+        point[0] = crossover_point(isl, &parents[0], 0, len[0] - 1 < hi ? len[0] - 1 : hi, effective);
+        if (point[0] < 0)
+            return;
+        lo = point[0] - delta_pos;
+        hi = point[0] + delta_pos;
+        point[1] = crossover_point(isl, &parents[1], lo > 0 ? lo : 0, hi < len[1] - 1 ? hi : len[1] - 1, effective);
+        if (point[1] < 0)
+            return;
 
-        idx = contestants[ii];
-        prog = &h->programs[idx];
-        if(prog->fitness < best->fitness)
-            best = prog;
-        else if(prog->fitness == best->fitness)
-            if(prog->cost < best->cost)
-                best = prog;
-        for(int j = idx; j < h->num_programs-1 - (i+1); j++)
-            contestants[j] = contestants[j+1];
+        hi = len[1] - point[1] + delta_length;
+        hi = len[0] - point[0] < hi ? len[0] - point[0] : hi;
+        hi = hi < MAX_SEGMENT ? hi : MAX_SEGMENT;
+        length[0] = 1 + island_random(isl, hi);
+        /* Within delta_length of it, leaving both genomes at most MAX_INSTR long. */
+        lo = length[0] - delta_length;
+        lo = lo > 1 ? lo : 1;
+        lo = lo > length[0] + len[1] - MAX_INSTR ? lo : length[0] + len[1] - MAX_INSTR;
+        hi = length[0] + delta_length;
+        hi = hi < len[1] - point[1] ? hi : len[1] - point[1];
+        hi = hi < MAX_SEGMENT ? hi : MAX_SEGMENT;
+        hi = hi < length[0] + MAX_INSTR - len[0] ? hi : length[0] + MAX_INSTR - len[0];
+        if (lo > hi)
+            return;
+        length[1] = lo + island_random(isl, hi - lo + 1);
     }
-    memcpy(winner, best, sizeof(*winner));
 
-    free(contestants);
+    exchange_segments(parents, point, length);
+    for (int i = 0; i < 2; i++)
+        if (point[i] < parents[i].dirty)
+            parents[i].dirty = point[i];
+}
+
+static int checkpoint_reserve(checkpoint_t *cp, int num)
+{
+    if (num > cp->capacity) {
+        void *states = realloc(cp->states, num * sizeof(*cp->states));
+        if (!states)
+            return -1;
+        cp->states = states;
+        cp->capacity = num;
+    }
     return 0;
 }
 
-static void crossover( program_t *parents, int delta_length, int delta_pos )
+/* Saved states of population slot idx, or NULL if there are none. */
+static checkpoint_t *find_checkpoint(island_t *isl, int idx)
 {
-    program_t temp[2];
-    /* FIXME: Respect delta_pos, delta_length */
-    int point[2];
-    int length[2];
-    int j;
+    checkpoint_t *cp;
 
-    for(int i = 0; i < 2; i++) {
-        if (parents[i].length[LEN_ABSOLUTE] == 0)
+    if (!isl->num_checkpoints)
+        return NULL;
+    cp = &isl->checkpoints[idx % isl->num_checkpoints];
+    return cp->slot == idx && cp->version == isl->version[idx] ? cp : NULL;
+}
+
+/* Move the states of an offspring that just entered slot idx into the
+ * cache, taking the shared prefix from its parent. */
+static void commit_checkpoint(island_t *isl, int idx, checkpoint_t *offspring)
+{
+    checkpoint_t *cp = &isl->checkpoints[idx % isl->num_checkpoints];
+    checkpoint_t *parent = NULL;
+
+    if (offspring->prefix) {
+        parent = &isl->checkpoints[offspring->parent % isl->num_checkpoints];
+        if (parent->slot != offspring->parent || parent->version != offspring->parent_version) {
+            cp->slot = -1;
             return;
-        point[i] = random() % parents[i].length[LEN_ABSOLUTE];
-        length[i] = random() % (parents[i].length[LEN_ABSOLUTE]+1 - point[i]);
+        }
+    }
+    if (checkpoint_reserve(cp, offspring->num) < 0) {
+        cp->slot = -1;
+        return;
     }
+    /* The parent may share the cache entry, then the prefix is in place. */
+    if (parent && parent != cp)
+        memcpy(cp->states, parent->states, offspring->prefix * sizeof(*cp->states));
+    memcpy(cp->states + offspring->prefix, offspring->states + offspring->prefix,
+           (offspring->num - offspring->prefix) * sizeof(*cp->states));
+    cp->num = offspring->num;
+    cp->slot = idx;
+    cp->version = isl->version[idx];
+}
 
-    for(int i = 0; i < 2; i++)
-        if (parents[!i].length[LEN_ABSOLUTE] - length[!i] + length[i] > MAX_INSTR)
-            length[i] = MAX_INSTR - (parents[!i].length[LEN_ABSOLUTE] - length[!i]);
+/* Run the effective program once over every reference vector at the same
+ * time, so the decode and dispatch cost is paid once per instruction rather
+ * than once per reference. With the saved states of the program it was
+ * derived from, execution resumes from the last state before the first
+ * changed effective instruction, and the new states are saved to to.
+ * Programs whose effective code matches their parent's or an entry of the
+ * fitness cache are not run at all. */
+static void analyse_program(island_t *isl, program_t *prog, const program_t *parent,
+                            const checkpoint_t *from, checkpoint_t *to)
+{
+    genetic_asm_t *h = isl->h;
+    batch_register_t registers[NUM_REGS];
+    int interval = h->checkpoint_interval;
+    int unchanged, length, resume = 0, pos;
+    uint64_t hash = 0;
+
+    START_TIMER(effective_start);
+    unchanged = effective_program(prog, prog->credited ? prog->credited : fitness_live_out(&h->fitness));
+    STOP_TIMER(isl, TIMER_EFFECTIVE, effective_start);
+    length = prog->length[LEN_EFFECTIVE];
+
+    if (interval && from) {
+        resume = unchanged / interval;
+        if (resume > from->num)
+            resume = from->num;
+    }
+    if (to) {
+        to->num = to->prefix = resume;
+        to->parent = from ? from->slot : -1;
+        to->parent_version = from ? from->version : 0;
+    }
 
-    for(int i = 0; i < 2; i++) {
-        for(j = 0; j < parents[i].length[LEN_ABSOLUTE] - length[i] + length[!i]; j++) {
-            assert(j - length[!i] + length[i] < parents[i].length[LEN_ABSOLUTE]);
-            if (j < point[i])
-                temp[i].instructions[j] = parents[i].instructions[j];
-            else if (j < point[i] + length[!i])
-                temp[i].instructions[j] = parents[!i].instructions[j + point[!i] - point[i]];
-            else
-                temp[i].instructions[j] = parents[i].instructions[j - length[!i] + length[i]];
+    /* A change that left the effective program alone cannot change the
+     * result, and other programs may already have been scored. Only the
+     * effective instructions after the unchanged ones were rebuilt. */
+    if (parent && length == parent->length[LEN_EFFECTIVE] &&
+        !memcmp(prog->effective + unchanged, parent->effective + unchanged,
+                (length - unchanged) * sizeof(*prog->effective))) {
+        prog->fitness = parent->fitness;
+        prog->cost = parent->cost;
+        prog->credited = parent->credited;
+        if (to && from && interval)
+            to->num = to->prefix = from->num;
+        isl->cache_stats[CACHE_NEUTRAL]++;
+        return;
+    }
+    if (h->cache.entries) {
+        hash = hash_program(prog->effective, length);
+        if (cache_lookup(&h->cache, hash, &prog->fitness, &prog->cost, &prog->credited)) {
+            isl->cache_stats[CACHE_HIT]++;
+            return;
+        }
+        isl->cache_stats[CACHE_MISS]++;
+    }
+
+    pos = resume * interval;
+    if (pos)
+        memcpy(registers, from->states[resume-1], sizeof(registers));
+    else
+        memcpy(registers, h->input, sizeof(registers));
+    isl->instructions[0] += length - pos;
+    isl->instructions[1] += pos;
+
+    while (pos < length) {
+        int next = interval ? (pos / interval + 1) * interval : length;
+        int end = next < length ? next : length;
+
+        run_references(h, prog->effective + pos, end - pos, registers);
+        pos = end;
+        if (to && pos < length) {
+            memcpy(to->states[pos / interval - 1], registers, sizeof(registers));
+            to->num = pos / interval;
         }
-        temp[i].length[LEN_ABSOLUTE] = j;
     }
 
-    memcpy(parents, temp, sizeof(*parents) *2);
+    prog->fitness = program_fitness(&h->fitness, registers, NULL, &prog->credited);
+    result_cost(prog);
+    if (h->cache.entries)
+        cache_store(&h->cache, hash, prog->fitness, prog->cost, prog->credited);
 }
 
-static void analyse_program(program_t *prog, reference_t refs[NUM_REF])
+static void update_best(island_t *isl, int i)
 {
-    prog->fitness = 0;
-    effective_program(prog, refs[0].num_regs_used[1]);
-    for(int i = 0; i < NUM_REF; i++) {
-        run_program(prog, &refs[i], 0);
-        prog->fitness += result_fitness(prog, &refs[i]);
-    }
-    result_cost(prog);
+    program_t *prog = &isl->programs[i];
+
+    if (program_better(prog, &isl->programs[isl->best]))
+        isl->best = i;
 }
 
-static int main_loop(genetic_asm_t *h)
+/* Overwrite the worst program if the candidate beats it, along with its saved
+ * states if there are any. Returns the index of the replaced program, or -1. */
+static int replace_worst(island_t *isl, program_t *prog, checkpoint_t *states)
 {
-    int fitness[2];
-    int cost[2];
-    int idx[2] = { 0 };
-    float probabilities[3] = { 0.4, 0.4, 0.2 };
-    program_t winners[2];
-    reference_t ref[NUM_REF];
-    program_t *progs[2];
+    int worst = rank_worst(&isl->rank);
 
-    h->programs = calloc(h->num_programs, sizeof(*h->programs));
-    if (!h->programs)
+    if (!program_better(prog, &isl->programs[worst]))
+        return -1;
+    if (program_copy(&isl->arena, &isl->programs[worst], prog) < 0)
         return -1;
+    isl->version[worst]++;
+    if (states && isl->num_checkpoints)
+        commit_checkpoint(isl, worst, states);
+    rank_update(&isl->rank, worst);
+    update_best(isl, worst);
+    return worst;
+}
 
-    fitness[0] = INT_MAX;
-    fitness[1] = 0;
-    cost[0] = INT_MAX;
-    cost[1] = 0;
+/* The program as it would be used: the instructions the result depends on,
+ * with the registers renamed so the result is where the target expects it.
+ * Until it is a solution, the words the fitness gives credit for are spread
+ * over more registers than the outputs, so the effective program is kept as
+ * it is. out needs room for FINAL_INSTR instructions. */
+static void final_program(genetic_asm_t *h, const program_t *prog, program_t *out)
+{
+    batch_register_t registers[NUM_REGS], result[NUM_REGS];
+    int assignment[NUM_REGS], num_outputs = h->fitness.num_outputs;
+    unsigned live = 0;
+    int length;
+
+    out->length[LEN_ABSOLUTE] = prog->length[LEN_ABSOLUTE];
+    out->fitness = prog->fitness;
+    if (prog->fitness) {
+        memcpy(out->effective, prog->effective, prog->length[LEN_EFFECTIVE] * sizeof(*out->effective));
+        out->length[LEN_EFFECTIVE] = prog->length[LEN_EFFECTIVE];
+        out->cost = prog->cost;
+        return;
+    }
 
-    for(int r = 0; r < 2; r++)
-        for(int i = 0; i < 8; i++)
-            ref[0].input[r].wd[i] = i+1+(r*8);
-    init_reference(&ref[0]);
+    memcpy(registers, h->input, sizeof(registers));
+    run_references(h, prog->effective, prog->length[LEN_EFFECTIVE], registers);
+    program_fitness(&h->fitness, registers, assignment, NULL);
+    for(int o = 0; o < num_outputs; o++)
+        live |= 1 << assignment[o];
+
+    length = trim_program(prog->effective, prog->length[LEN_EFFECTIVE], live, out->effective);
+    out->length[LEN_EFFECTIVE] = remap_outputs(out->effective, length, FINAL_INSTR, assignment, num_outputs);
+    if (out->length[LEN_EFFECTIVE] >= 0) {
+        /* Keep the renamed program only if it leaves the same result. */
+        memcpy(result, h->input, sizeof(result));
+        run_references(h, out->effective, out->length[LEN_EFFECTIVE], result);
+        for(int o = 0; o < num_outputs; o++)
+            if (memcmp(result[o], registers[assignment[o]], sizeof(result[o]))) {
+                printf("renaming the outputs changed the result, ");
+                out->length[LEN_EFFECTIVE] = -1;
+                trim_program(prog->effective, prog->length[LEN_EFFECTIVE], live, out->effective);
+                break;
+            }
+    }
+    if (out->length[LEN_EFFECTIVE] < 0) {
+        printf("result in registers");
+        for(int o = 0; o < num_outputs; o++)
+            printf(" m%d", assignment[o]);
+        printf("\n");
+        out->length[LEN_EFFECTIVE] = length;
+    } else
+        out->length[LEN_EFFECTIVE] = optimize_program(out->effective, out->length[LEN_EFFECTIVE],
+                                                      num_outputs, h->input);
+    out->cost = program_cost(out->effective, out->length[LEN_EFFECTIVE]);
+}
 
-    for(int i = 1; i < NUM_REF; i++) {
-        init_srcregisters(ref[i].input);
-        init_reference(&ref[i]);
+static void report_best(island_t *isl, program_t *prog)
+{
+    uint8_t storage[PROGRAM_STORAGE(FINAL_INSTR)];
+    program_t final;
+
+    program_attach(&final, storage, FINAL_INSTR);
+    flockfile(stdout);
+    if (isl->h->num_islands > 1)
+        printf("island %d, iteration %d:\n", isl->id, isl->iterations);
+    final_program(isl->h, prog, &final);
+    print_program(&final);
+    printf("\n");
+    funlockfile(stdout);
+}
+
+/* Take over the state of an island from the snapshot being resumed. The
+ * programs are scored again, which also checks that this build agrees with
+ * the one that wrote the snapshot. */
+static int resume_island(island_t *isl)
+{
+    const uint8_t *p = isl->h->snapshot_islands[isl->id];
+    const int32_t *heap;
+    snapshot_island_t si;
+
+    memcpy(&si, p, sizeof(si));
+    p += sizeof(si);
+    memcpy(isl->rng.s, si.rng, sizeof(isl->rng.s));
+    isl->evaluations = si.evaluations;
+    memcpy(isl->mutation_uses, si.mutation_uses, sizeof(isl->mutation_uses));
+    memcpy(isl->mutation_successes, si.mutation_successes, sizeof(isl->mutation_successes));
+    update_mutation_rates(isl);
+    heap = (const int32_t*)p;
+    p += isl->num_programs * sizeof(*heap);
+
+    for(int i = 0; i < isl->num_programs; i++) {
+        program_t *prog = &isl->programs[i];
+        snapshot_program_t sp;
+
+        memcpy(&sp, p, sizeof(sp));
+        p += sizeof(sp);
+        if (program_reserve(&isl->arena, prog, sp.length) < 0)
+            return -1;
+        prog->length[LEN_ABSOLUTE] = sp.length;
+        prog->credited = sp.live_out;
+        memcpy(prog->instructions, p, sp.length * sizeof(instruction_t));
+        p += sp.length * sizeof(instruction_t);
+
+        analyse_program(isl, prog, NULL, NULL, &isl->offspring[0]);
+        if (isl->num_checkpoints)
+            commit_checkpoint(isl, i, &isl->offspring[0]);
+        if (prog->fitness != sp.fitness || prog->cost != sp.cost) {
+            printf("ERROR: program %d of island %d scores differently than in the snapshot\n", i, isl->id);
+            return -1;
+        }
     }
-    init_programs(h);
 
+    if (rank_load(&isl->rank, isl->programs, heap, isl->num_programs) < 0) {
+        printf("ERROR: invalid rank heap of island %d in the snapshot\n", isl->id);
+        return -1;
+    }
+    isl->best = si.best;
+    isl->fitness = isl->programs[isl->best].fitness;
+    isl->fitness_iteration = isl->h->start_iteration;
+    return 0;
+}
 
-    for(int i = 0; i < h->num_programs; i++) {
-        program_t *prog = &h->programs[i];
-        analyse_program(prog, ref);
-        printf("length (absolute effective)= %d %d, ", prog->length[LEN_ABSOLUTE], prog->length[LEN_EFFECTIVE]);
+static int init_island(genetic_asm_t *h, island_t *isl, int id)
+{
+    program_t *best, *worst;
+
+    memset(isl, 0, sizeof(*isl));
+    isl->id = id;
+    isl->h = h;
+    isl->num_programs = h->num_programs;
+    update_mutation_rates(isl);
+    /* Island i draws from stream i + 1 of the seed, whichever thread runs it. */
+    rng_seed(&isl->rng, (uint32_t)h->random_seed);
+    for(int i = 0; i <= id; i++)
+        rng_jump(&isl->rng);
+    arena_init(&isl->arena);
+    isl->programs = calloc(isl->num_programs, sizeof(*isl->programs));
+    isl->version = calloc(isl->num_programs, sizeof(*isl->version));
+    if (!isl->programs || !isl->version)
+        return -1;
+    for(int i = 0; i < 2; i++)
+        program_attach(&isl->winners[i], isl->winner_storage[i], MAX_INSTR);
+    if (h->checkpoint_interval) {
+        isl->num_checkpoints = isl->num_programs < CHECKPOINT_CACHE ? isl->num_programs : CHECKPOINT_CACHE;
+        isl->checkpoints = calloc(isl->num_checkpoints, sizeof(*isl->checkpoints));
+        if (!isl->checkpoints)
+            return -1;
+        for(int i = 0; i < isl->num_checkpoints; i++)
+            isl->checkpoints[i].slot = -1;
+        for(int i = 0; i < 2; i++)
+            if (checkpoint_reserve(&isl->offspring[i], MAX_INSTR / h->checkpoint_interval) < 0)
+                return -1;
+    }
+    if (h->num_islands > 1) {
+        isl->inbox = &h->queues[id];
+        isl->outbox = &h->queues[(id + 1) % h->num_islands];
+    }
 
-        if (prog->fitness < fitness[0]) {
-            fitness[0] = prog->fitness;
-            idx[0] = i;
-        } else if (prog->fitness == fitness[0]) {
-            if (prog->cost && prog->cost < cost[0]) {
-                cost[0] = prog->cost;
-                idx[0] = i;
-            }
-        }
-        if (prog->fitness > fitness[1]) {
-            fitness[1] = prog->fitness;
-            idx[1] = i;
-        } else if (prog->fitness == fitness[1]) {
-            if (prog->cost > cost[1]) {
-                cost[1] = prog->cost;
-                idx[1] = i;
-            }
-        }
+    if (h->snapshot)
+        return resume_island(isl);
+    if (init_programs(isl) < 0)
+        return -1;
 
-        printf("fitness = %d\n", prog->fitness);
+    for(int i = 0; i < isl->num_programs; i++) {
+        program_t *prog = &isl->programs[i];
+        analyse_program(isl, prog, NULL, NULL, &isl->offspring[0]);
+        if (isl->num_checkpoints)
+            commit_checkpoint(isl, i, &isl->offspring[0]);
+        isl->evaluations++;
+        update_best(isl, i);
     }
 
-    progs[0] = &h->programs[idx[0]];
-    progs[1] = &h->programs[idx[1]];
-    /* Best program replaces the worst, with a random chance at mutation */
-    memcpy(progs[1], progs[0], sizeof(*h->programs));
-    mutate_program(progs[1], probabilities);
-    analyse_program(progs[1], ref);
-    printf("fitness = %d\n", progs[1]->fitness);
+    if (rank_init(&isl->rank, isl->programs, isl->num_programs) < 0)
+        return -1;
 
-    while (fitness[0] > 0) {
-        if (run_tournament(h, &winners[0], 8) < 0)
+    best = &isl->programs[isl->best];
+    worst = &isl->programs[rank_worst(&isl->rank)];
+    /* Best program replaces the worst, with a random chance at mutation */
+    if (worst != best) {
+        int idx = worst - isl->programs;
+        if (program_copy(&isl->arena, worst, best) < 0)
             return -1;
-        if (run_tournament(h, &winners[1], 8) < 0)
+        if (mutate_program(isl, worst) < 0)
             return -1;
-        crossover(winners, 5, 50);
-        for(int i = 0; i < 2; i++) {
-            if (random() < RAND_MAX * 0.75)
-                mutate_program(&winners[i], probabilities);
-            analyse_program(&winners[i], ref);
-        }
-        for (int j = 0; j < 2; j++) {
-            for (int i = 0; i < h->num_programs; i++) {
-                program_t *prog = &h->programs[i];
-                if(prog->fitness > winners[j].fitness) {
-                    memcpy(prog, &winners[j], sizeof(*prog));
-                    break;
-                }
-            }
-        }
-        for(int i = 0; i < h->num_programs; i++) {
-            program_t *prog = &h->programs[i];
-            if (fitness[0] > prog->fitness) {
-                fitness[0] = prog->fitness;
-                effective_program(prog, ref[0].num_regs_used[1]);
-                run_program(prog, &ref[0], 1);
-                print_program(prog, 0);
-                printf("\n");
-            }
-        }
+        analyse_program(isl, worst, best, find_checkpoint(isl, isl->best), &isl->offspring[0]);
+        isl->evaluations++;
+        isl->version[idx]++;
+        if (isl->num_checkpoints)
+            commit_checkpoint(isl, idx, &isl->offspring[0]);
+        rank_update(&isl->rank, idx);
+        update_best(isl, worst - isl->programs);
     }
+    isl->fitness = isl->programs[isl->best].fitness;
+
+    return 0;
+}
 
-    free(h->programs);
+static void free_island(island_t *isl)
+{
+    arena_free(&isl->arena);
+    rank_free(&isl->rank);
+    for(int j = 0; j < isl->num_checkpoints; j++)
+        free(isl->checkpoints[j].states);
+    for(int j = 0; j < 2; j++)
+        free(isl->offspring[j].states);
+    free(isl->checkpoints);
+    free(isl->version);
+    free(isl->programs);
+}
+
+static int stop_requested(island_t *isl)
+{
+    return isl->iterations >= __atomic_load_n(&isl->h->stop_iteration, __ATOMIC_ACQUIRE);
+}
 
+static int barrier_init(island_barrier_t *b, int threads)
+{
+    b->threads = threads;
+    b->waiting = 0;
+    b->generation = 0;
+    if (pthread_mutex_init(&b->lock, NULL))
+        return -1;
+    if (pthread_cond_init(&b->cond, NULL)) {
+        pthread_mutex_destroy(&b->lock);
+        return -1;
+    }
     return 0;
 }
 
-static void usage(void)
+static void barrier_destroy(island_barrier_t *b)
 {
-    printf("usage: genetic_asm [options]\n"
-           "\n"
-           "  -h, --help            print this help message\n"
-           "  -p, --population      set population size [%d]\n"
-           "      --seed            set random seed\n", DEFAULT_PROGRAMS);
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+}
 
+static void barrier_release(island_barrier_t *b)
+{
+    b->waiting = 0;
+    b->generation++;
+    pthread_cond_broadcast(&b->cond);
 }
 
-static int parse_cmdline(genetic_asm_t *h, int argc, char **argv)
+static void barrier_wait(island_barrier_t *b)
+{
+    unsigned generation;
+
+    pthread_mutex_lock(&b->lock);
+    generation = b->generation;
+    if (++b->waiting >= b->threads)
+        barrier_release(b);
+    while (generation == b->generation)
+        pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void barrier_leave(island_barrier_t *b)
+{
+    pthread_mutex_lock(&b->lock);
+    if (--b->threads && b->waiting >= b->threads)
+        barrier_release(b);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Queue operations spin until they can proceed. Islands wait for the migrant
+ * of exactly the current epoch, which keeps runs reproducible for a given
+ * seed and island count no matter how many threads run them and how they
+ * are scheduled. */
+static int queue_push(island_t *isl, migration_queue_t *q, program_t *prog)
+{
+    int tail = q->tail;
+
+    while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= QUEUE_SIZE) {
+        if (stop_requested(isl))
+            return -1;
+        sched_yield();
+    }
+    program_copy(NULL, &q->slots[tail % QUEUE_SIZE], prog);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int queue_pop(island_t *isl, migration_queue_t *q, program_t *prog)
+{
+    int head = q->head;
+    int ret;
+
+    while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head) {
+        if (stop_requested(isl))
+            return -1;
+        sched_yield();
+    }
+    ret = program_copy(NULL, prog, &q->slots[head % QUEUE_SIZE]);
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* Let the program from upstream replace our worst, once our best has been
+ * sent downstream. */
+static void migrate(island_t *isl)
+{
+    program_t *migrant = &isl->winners[0];
+
+    if (queue_pop(isl, isl->inbox, migrant) < 0)
+        return;
+    replace_worst(isl, migrant, NULL);
+}
+
+static void get_net_config(const genetic_asm_t *h, net_config_t *config)
+{
+    config->fitness_type = h->fitness_type;
+    config->isa = h->isa;
+    config->references = h->references;
+    config->target = h->target;
+}
+
+/* Send the best programs of an island to the coordinator, along with the
+ * evaluations of the whole process. */
+static int send_migrants(island_t *isl)
+{
+    genetic_asm_t *h = isl->h;
+    const program_t *batch[NET_BATCH];
+    uint8_t payload[NET_PROGRAMS_SIZE(NET_BATCH)];
+    int64_t evaluations = 0;
+    int num = 0;
+
+    for(int i = 0; i < isl->num_programs; i++) {
+        const program_t *prog = &isl->programs[i];
+        int j = num < NET_BATCH ? num++ : NET_BATCH;
+        for( ; j > 0 && program_better(prog, batch[j-1]); j--)
+            if (j < NET_BATCH)
+                batch[j] = batch[j-1];
+        if (j < NET_BATCH)
+            batch[j] = prog;
+    }
+    for(int i = 0; i < h->num_islands; i++)
+        evaluations += __atomic_load_n(&h->islands[i].evaluations, __ATOMIC_RELAXED);
+    return net_send(&h->net, NET_MIGRANTS, payload, net_pack_programs(payload, evaluations, batch, num));
+}
+
+static int valid_opcodes(const genetic_asm_t *h, const program_t *prog)
+{
+    for(int i = 0; i < prog->length[LEN_ABSOLUTE]; i++)
+        if (prog->instructions[i].opcode >= h->num_opcodes)
+            return 0;
+    return 1;
+}
+
+/* Let the programs the coordinator sent since the last exchange replace our
+ * worst. This never waits, so they arrive one exchange late. */
+static int receive_migrants(island_t *isl)
+{
+    genetic_asm_t *h = isl->h;
+    uint8_t storage[NET_BATCH][PROGRAM_STORAGE(MAX_INSTR)];
+    program_t migrants[NET_BATCH];
+    const uint8_t *payload;
+    size_t length;
+    int type, ret;
+
+    for(int i = 0; i < NET_BATCH; i++)
+        program_attach(&migrants[i], storage[i], MAX_INSTR);
+    while ((ret = net_receive(&h->net, 0, &type, &payload, &length)) > 0) {
+        int64_t evaluations;
+        int num = type == NET_MIGRANTS ?
+                  net_unpack_programs(payload, length, &evaluations, migrants, NET_BATCH) : -1;
+        if (num < 0)
+            return -1;
+        for(int i = 0; i < num; i++) {
+            if (!valid_opcodes(h, &migrants[i]))
+                continue;
+            analyse_program(isl, &migrants[i], NULL, NULL, NULL);
+            replace_worst(isl, &migrants[i], NULL);
+        }
+    }
+    return ret;
+}
+
+static void exchange_migrants(island_t *isl)
+{
+    genetic_asm_t *h = isl->h;
+
+    if (receive_migrants(isl) < 0 || send_migrants(isl) < 0) {
+        fprintf(stderr, "Error: lost the coordinator, carrying on alone\n");
+        net_close(&h->net);
+    }
+}
+
+static int write_snapshot(genetic_asm_t *h, int iteration)
+{
+    snapshot_header_t hdr;
+    char tmp[4096];
+    FILE *f;
+    int ok = 1;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", h->snapshot_file) >= (int)sizeof(tmp))
+        return -1;
+    f = fopen(tmp, "wb");
+    if (!f)
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.num_ref = NUM_REF;
+    hdr.num_regs = NUM_REGS;
+    hdr.max_instr = MAX_INSTR;
+    hdr.num_instr = NUM_INSTR;
+    hdr.random_seed = h->random_seed;
+    hdr.num_programs = h->num_programs;
+    hdr.num_islands = h->num_islands;
+    hdr.migrate_interval = h->migrate_interval;
+    hdr.iteration = iteration;
+    hdr.fitness_type = h->fitness_type;
+    hdr.isa = h->isa;
+    hdr.references = h->references;
+    hdr.crossover = h->crossover;
+    strncpy(hdr.cpu_profile, h->cpu_profile, sizeof(hdr.cpu_profile) - 1);
+    hdr.target = h->target;
+    ok &= fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    ok &= fwrite(h->ref, sizeof(h->ref), 1, f) == 1;
+
+    for(int i = 0; i < h->num_islands; i++) {
+        island_t *isl = &h->islands[i];
+        snapshot_island_t si = { .best = isl->best, .evaluations = isl->evaluations };
+
+        memcpy(si.rng, isl->rng.s, sizeof(si.rng));
+        memcpy(si.mutation_uses, isl->mutation_uses, sizeof(si.mutation_uses));
+        memcpy(si.mutation_successes, isl->mutation_successes, sizeof(si.mutation_successes));
+        ok &= fwrite(&si, sizeof(si), 1, f) == 1;
+        ok &= fwrite(isl->rank.heap, sizeof(int32_t), isl->num_programs, f) == (size_t)isl->num_programs;
+        for(int j = 0; j < isl->num_programs; j++) {
+            program_t *prog = &isl->programs[j];
+            int length = prog->length[LEN_ABSOLUTE];
+            snapshot_program_t sp = { prog->fitness, prog->cost, length, length ? prog->live[length-1] : 0 };
+
+            ok &= fwrite(&sp, sizeof(sp), 1, f) == 1;
+            ok &= fwrite(prog->instructions, sizeof(instruction_t), sp.length, f) == (size_t)sp.length;
+        }
+    }
+
+    ok &= !fflush(f) && !fsync(fileno(f));
+    if (fclose(f) || !ok || rename(tmp, h->snapshot_file)) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void wait_writer(genetic_asm_t *h)
+{
+    int status;
+
+    if (h->writer > 0 && waitpid(h->writer, &status, 0) == h->writer &&
+        !(WIFEXITED(status) && !WEXITSTATUS(status)))
+        fprintf(stderr, "Error: failed to write snapshot %s\n", h->snapshot_file);
+    h->writer = 0;
+}
+
+/* Save the state at the start of this iteration, once every thread has met
+ * at the barrier and none has stopped, so every migrant sent has been
+ * received. The thread of island 0 forks a child that writes the file from
+ * its copy of memory while evolution carries on, the others wait for it. */
+static void save_snapshot(genetic_asm_t *h, int first, int iteration)
+{
+    pid_t pid;
+
+    if (first) {
+        barrier_wait(&h->barrier);
+        return;
+    }
+
+    wait_writer(h);
+    pid = fork();
+    if (pid == 0)
+        _exit(write_snapshot(h, iteration) < 0);
+    if (pid < 0 && write_snapshot(h, iteration) < 0)
+        fprintf(stderr, "Error: failed to write snapshot %s\n", h->snapshot_file);
+    h->writer = pid > 0 ? pid : 0;
+
+    if (h->num_threads > 1)
+        barrier_wait(&h->barrier);
+}
+
+static int compare_hash(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Write a JSON line describing the population: the best program, means,
+ * a histogram of fitness in powers of two (bin 0 holds fitness 0, bin k
+ * fitness below 2^k), the share of distinct effective programs, and the
+ * timers when built with them. */
+static void report_stats(island_t *isl)
+{
+    genetic_asm_t *h = isl->h;
+    uint64_t *hashes = malloc(isl->num_programs * sizeof(*hashes));
+    int histogram[STATS_BINS] = { 0 };
+    int64_t fitness = 0, length[2] = { 0 };
+    int bins = 1, distinct = 0;
+    char line[1024], *p = line, *end = line + sizeof(line);
+
+    if (!hashes)
+        return;
+    for(int i = 0; i < isl->num_programs; i++) {
+        program_t *prog = &isl->programs[i];
+        int bin = 0;
+        while (bin < STATS_BINS - 1 && prog->fitness >> bin)
+            bin++;
+        histogram[bin]++;
+        if (bin >= bins)
+            bins = bin + 1;
+        fitness += prog->fitness;
+        length[0] += prog->length[LEN_ABSOLUTE];
+        length[1] += prog->length[LEN_EFFECTIVE];
+        hashes[i] = hash_program(prog->effective, prog->length[LEN_EFFECTIVE]);
+    }
+    qsort(hashes, isl->num_programs, sizeof(*hashes), compare_hash);
+    for(int i = 0; i < isl->num_programs; i++)
+        distinct += !i || hashes[i] != hashes[i-1];
+    free(hashes);
+
+    p += snprintf(p, end - p, "{\"island\":%d,\"iteration\":%d,\"evaluations\":%"PRId64","
+                  "\"best_fitness\":%d,\"best_cost\":%d,\"mean_fitness\":%.2f,"
+                  "\"mean_length\":%.2f,\"mean_effective\":%.2f,\"diversity\":%.3f,\"histogram\":[",
+                  isl->id, isl->iterations, isl->evaluations,
+                  isl->programs[isl->best].fitness, isl->programs[isl->best].cost,
+                  (double)fitness / isl->num_programs, (double)length[0] / isl->num_programs,
+                  (double)length[1] / isl->num_programs, (double)distinct / isl->num_programs);
+    for(int i = 0; i < bins; i++)
+        p += snprintf(p, end - p, "%s%d", i ? "," : "", histogram[i]);
+    p += snprintf(p, end - p, "]");
+    for(int i = 0; i < NUM_MUTATIONS; i++)
+        p += snprintf(p, end - p, "%s\"%s\":%.3f", i ? "," : ",\"mutation\":{", mutation_names[i],
+                      isl->mutation_rate[i]);
+    p += snprintf(p, end - p, "}");
+#ifdef TIMERS
+    for(int i = 0; i < NUM_TIMERS; i++)
+        p += snprintf(p, end - p, "%s\"%s\":%"PRIu64, i ? "," : ",\"timers\":{", timer_names[i], isl->timers[i]);
+    p += snprintf(p, end - p, "}");
+#endif
+    snprintf(p, end - p, "}\n");
+    fputs(line, h->stats);
+}
+
+/* One iteration of an island. Returns 1 once it has found a solution. */
+static int evolve_iteration(island_t *isl)
+{
+    genetic_asm_t *h = isl->h;
+    program_t *winners = isl->winners;
+
+    if (!isl->id && h->net.fd >= 0 && isl->iterations && isl->iterations % h->migrate_interval == 0)
+        exchange_migrants(isl);
+
+    if (h->stats && isl->iterations % h->stats_interval == 0)
+        report_stats(isl);
+
+    START_TIMER(select_start);
+    isl->parents[0] = run_tournament(isl, &winners[0], TOURNAMENT_SIZE);
+    isl->parents[1] = run_tournament(isl, &winners[1], TOURNAMENT_SIZE);
+    STOP_TIMER(isl, TIMER_SELECT, select_start);
+    START_TIMER(crossover_start);
+    crossover(isl, winners, 5, 50);
+    STOP_TIMER(isl, TIMER_CROSSOVER, crossover_start);
+    for(int i = 0; i < 2; i++) {
+        START_TIMER(mutate_start);
+        isl->mutation[i] = rng_float(&isl->rng) < 0.75f ? mutate_program(isl, &winners[i]) : -1;
+        STOP_TIMER(isl, TIMER_MUTATE, mutate_start);
+        START_TIMER(evaluate_start);
+        analyse_program(isl, &winners[i], &isl->programs[isl->parents[i]],
+                        find_checkpoint(isl, isl->parents[i]), &isl->offspring[i]);
+        STOP_TIMER(isl, TIMER_EVALUATE, evaluate_start);
+        isl->evaluations++;
+        if (isl->mutation[i] >= 0)
+            credit_mutation(isl, isl->mutation[i],
+                            program_better(&winners[i], &isl->programs[isl->parents[i]]));
+    }
+    START_TIMER(replace_start);
+    for (int j = 0; j < 2; j++)
+        replace_worst(isl, &winners[j], &isl->offspring[j]);
+    STOP_TIMER(isl, TIMER_REPLACE, replace_start);
+    if (isl->programs[isl->best].fitness < isl->fitness) {
+        isl->fitness = isl->programs[isl->best].fitness;
+        isl->fitness_iteration = isl->iterations;
+        if (!h->quiet)
+            report_best(isl, &isl->programs[isl->best]);
+    }
+
+    if (isl->fitness == 0) {
+        /* Let every island catch up to this iteration before stopping,
+         * so the overall winner does not depend on thread timing. */
+        int stop = __atomic_load_n(&h->stop_iteration, __ATOMIC_ACQUIRE);
+        while (isl->iterations + 1 < stop &&
+               !__atomic_compare_exchange_n(&h->stop_iteration, &stop, isl->iterations + 1,
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ;
+        return 1;
+    }
+    return 0;
+}
+
+/* Evolve the islands of a thread, first and every num_threads-th after it,
+ * in lockstep one iteration at a time. All of them send their migrants
+ * before any waits for one, so islands sharing a thread never wait for each
+ * other. An island that found a solution stays at that iteration. */
+static void evolve_islands(genetic_asm_t *h, int first)
+{
+    island_t *end = h->islands + h->num_islands, *isl;
+    int step = h->num_threads;
+
+    for (int iteration = h->start_iteration; ; iteration++) {
+        int snapshot = h->snapshot_file && iteration > h->start_iteration &&
+                       iteration % h->snapshot_interval == 0;
+
+        for (isl = &h->islands[first]; isl < end; isl += step)
+            if (iteration == h->start_iteration || isl->fitness)
+                isl->iterations = iteration;
+        /* Before a snapshot the threads meet first: nothing evolves while
+         * they check for a stop, so they all agree on it. */
+        if (snapshot && h->num_threads > 1)
+            barrier_wait(&h->barrier);
+        if (iteration >= __atomic_load_n(&h->stop_iteration, __ATOMIC_ACQUIRE))
+            break;
+
+        if (snapshot)
+            save_snapshot(h, first, iteration);
+        if (h->num_islands > 1 && iteration && iteration % h->migrate_interval == 0) {
+            for (isl = &h->islands[first]; isl < end; isl += step)
+                queue_push(isl, isl->outbox, &isl->programs[isl->best]);
+            for (isl = &h->islands[first]; isl < end; isl += step)
+                migrate(isl);
+        }
+
+        for (isl = &h->islands[first]; isl < end; isl += step)
+            if (!stop_requested(isl))
+                evolve_iteration(isl);
+    }
+}
+
+/* Runs islands id, id + num_threads and so on, given the first of them with
+ * its id and h filled in. */
+static void *island_thread(void *arg)
+{
+    island_t *isl = arg;
+    genetic_asm_t *h = isl->h;
+    int first = isl->id;
+
+    void *ret = NULL;
+
+    for(int i = first; i < h->num_islands && !ret; i += h->num_threads)
+        if (init_island(h, &h->islands[i], i) < 0) {
+            /* Release the threads waiting for migrants from it. */
+            __atomic_store_n(&h->stop_iteration, 0, __ATOMIC_RELEASE);
+            ret = (void*)-1;
+        }
+    if (!ret)
+        evolve_islands(h, first);
+    if (h->num_threads > 1)
+        barrier_leave(&h->barrier);
+    return ret;
+}
+
+static void init_input(genetic_asm_t *h);
+
+static void init_references(genetic_asm_t *h)
+{
+    reference_t *ref = h->ref;
+
+    /* Symbolic words have the number of their low byte in the low byte and
+     * that plus 0x80 in the high byte, to tell every byte apart. */
+    for(int r = 0; r < h->target.num_inputs; r++)
+        for(int i = 0; i < 8; i++)
+            ref[0].input[r].wd[i] = h->references == REFERENCES_SYMBOLIC ?
+                                    (i+1+(r*8)) * 0x101 + 0x8000 : i+1+(r*8);
+    apply_target(&h->target, &ref[0]);
+
+    for(int i = 1; i < NUM_REF; i++) {
+        init_srcregisters(&h->rng, ref[i].input);
+        apply_target(&h->target, &ref[i]);
+    }
+    init_input(h);
+}
+
+/* Interleave the reference inputs for execute_batch. */
+static void init_input(genetic_asm_t *h)
+{
+    memset(h->input, 0, sizeof(h->input));
+    for(int r = 0; r < NUM_REGS; r++)
+        for(int i = 0; i < NUM_REF; i++)
+            h->input[r][i] = h->ref[i].input[r];
+}
+
+static int enumerate_loop(genetic_asm_t *h)
+{
+    instruction_t instructions[MAX_INSTR];
+    uint8_t storage[PROGRAM_STORAGE(MAX_INSTR)];
+    program_t prog;
+    int length;
+
+    if (h->enum_regs < h->target.num_inputs || h->enum_regs < h->target.num_outputs) {
+        printf("ERROR: the target needs more than %d registers\n", h->enum_regs);
+        return -1;
+    }
+    init_references(h);
+    init_pshufb_masks(&h->ref[0]);
+    length = enumerate_programs(h->ref, h->input, h->max_depth, h->enum_regs, h->num_opcodes,
+                                (size_t)h->memory << 20, instructions);
+    if (length < -1)
+        return -1;
+    if (length < 0) {
+        printf("No program of up to %d instructions\n", h->max_depth);
+        return 0;
+    }
+
+    program_attach(&prog, storage, MAX_INSTR);
+    prog.length[LEN_ABSOLUTE] = prog.length[LEN_EFFECTIVE] = length;
+    memcpy(prog.instructions, instructions, length * sizeof(*instructions));
+    memcpy(prog.effective, instructions, length * sizeof(*instructions));
+    prog.fitness = 0;
+    prog.cost = program_cost(prog.effective, length);
+    printf("Shortest program:\n");
+    print_program(&prog);
+    if (h->export_prefix)
+        return export_programs(h->export_prefix, &h->target, &prog, 1);
+    return 0;
+}
+
+/* Map a snapshot and check it through, so islands can take their state
+ * straight from it. The run parameters it was written with replace those
+ * given on the command line. */
+static int load_snapshot(genetic_asm_t *h)
+{
+    const snapshot_header_t *hdr;
+    const uint8_t *p, *end;
+    struct stat st;
+    int fd;
+
+    fd = open(h->resume_file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("ERROR: cannot open snapshot %s\n", h->resume_file);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    p = st.st_size >= (off_t)sizeof(*hdr) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        printf("ERROR: cannot map snapshot %s\n", h->resume_file);
+        return -1;
+    }
+    h->snapshot = p;
+    h->snapshot_size = st.st_size;
+    end = p + st.st_size;
+
+    hdr = (const snapshot_header_t*)p;
+    p += sizeof(*hdr);
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) || hdr->version != SNAPSHOT_VERSION) {
+        printf("ERROR: %s is not a snapshot of version %d\n", h->resume_file, SNAPSHOT_VERSION);
+        return -1;
+    }
+    if (hdr->num_ref != NUM_REF || hdr->num_regs != NUM_REGS ||
+        hdr->max_instr != MAX_INSTR || hdr->num_instr != NUM_INSTR) {
+        printf("ERROR: snapshot %s is from a build with NUM_REF %d, NUM_REGS %d, MAX_INSTR %d, NUM_INSTR %d\n",
+               h->resume_file, hdr->num_ref, hdr->num_regs, hdr->max_instr, hdr->num_instr);
+        return -1;
+    }
+    if (hdr->num_programs < 2 || hdr->num_islands < 1 || hdr->num_islands > MAX_ISLANDS ||
+        hdr->migrate_interval < 1 || hdr->iteration < 0 ||
+        (hdr->fitness_type != FITNESS_DISTANCE && hdr->fitness_type != FITNESS_EXACT) ||
+        hdr->isa < 0 || hdr->isa >= NUM_ISAS ||
+        (hdr->references != REFERENCES_SYMBOLIC && hdr->references != REFERENCES_RANDOM) ||
+        hdr->crossover < 0 || hdr->crossover >= NUM_CROSSOVERS || !target_valid(&hdr->target) ||
+        !memchr(hdr->cpu_profile, 0, sizeof(hdr->cpu_profile)) || end - p < (ptrdiff_t)sizeof(h->ref))
+        goto invalid;
+    memcpy(h->ref, p, sizeof(h->ref));
+    p += sizeof(h->ref);
+
+    h->snapshot_islands = calloc(hdr->num_islands, sizeof(*h->snapshot_islands));
+    if (!h->snapshot_islands)
+        return -1;
+    for(int i = 0; i < hdr->num_islands; i++) {
+        snapshot_island_t si;
+
+        h->snapshot_islands[i] = p;
+        if (end - p < (ptrdiff_t)(sizeof(si) + hdr->num_programs * sizeof(int32_t)))
+            goto invalid;
+        memcpy(&si, p, sizeof(si));
+        if (si.best < 0 || si.best >= hdr->num_programs)
+            goto invalid;
+        p += sizeof(si) + hdr->num_programs * sizeof(int32_t);
+
+        for(int j = 0; j < hdr->num_programs; j++) {
+            snapshot_program_t sp;
+            instruction_t instr;
+
+            if (end - p < (ptrdiff_t)sizeof(sp))
+                goto invalid;
+            memcpy(&sp, p, sizeof(sp));
+            p += sizeof(sp);
+            if (sp.length < 0 || sp.length > MAX_INSTR || (uint32_t)sp.live_out >> NUM_REGS ||
+                end - p < (ptrdiff_t)(sp.length * sizeof(instr)))
+                goto invalid;
+            for(int k = 0; k < sp.length; k++, p += sizeof(instr)) {
+                memcpy(&instr, p, sizeof(instr));
+                if (instr.opcode >= NUM_INSTR || instr.operands[0] >= NUM_REGS ||
+                    instr.operands[1] >= NUM_REGS)
+                    goto invalid;
+            }
+        }
+    }
+    if (p != end)
+        goto invalid;
+
+    h->random_seed = hdr->random_seed;
+    h->num_programs = hdr->num_programs;
+    h->num_islands = hdr->num_islands;
+    h->migrate_interval = hdr->migrate_interval;
+    h->cpu_profile = hdr->cpu_profile;
+    h->start_iteration = hdr->iteration;
+    h->fitness_type = hdr->fitness_type;
+    h->isa = hdr->isa;
+    h->num_opcodes = isa_opcodes[h->isa];
+    h->references = hdr->references;
+    h->crossover = hdr->crossover;
+    h->target = hdr->target;
+    init_input(h);
+    printf("Resuming %s at iteration %d\n", h->resume_file, h->start_iteration);
+    return 0;
+
+invalid:
+    printf("ERROR: snapshot %s is corrupt\n", h->resume_file);
+    return -1;
+}
+
+static int main_loop(genetic_asm_t *h)
+{
+    /* Not in island_t, which the thread clears while initialising. */
+    pthread_t threads[MAX_THREADS];
+    island_t *winner = NULL;
+    struct timespec start, end;
+    int64_t evaluations = 0;
+    int64_t instructions[2] = { 0 };
+    int64_t cache_stats[3] = { 0 };
+    uint64_t timers[NUM_TIMERS] = { 0 };
+    double elapsed;
+    int ret = 0, barrier = 0;
+    int best_fitness = INT_MAX, best_iteration = 0;
+
+    if (h->num_threads > h->num_islands)
+        h->num_threads = h->num_islands;
+    h->islands = NULL;
+    h->queues = NULL;
+    if (!h->snapshot)
+        init_references(h);
+    if (h->seed_file && !h->snapshot) {
+        if (load_seed_file(&h->seeds, h->seed_file) < 0)
+            return -1;
+        for(int i = 0; i < h->seeds.start[h->seeds.num_programs]; i++)
+            if (h->seeds.instructions[i].opcode >= h->num_opcodes) {
+                printf("ERROR: %s uses %s, which is not in --isa %s\n", h->seed_file,
+                       instruction_names[h->seeds.instructions[i].opcode], isa_names[h->isa]);
+                seed_free(&h->seeds);
+                return -1;
+            }
+        if (!h->quiet)
+            printf("Seeded %d programs from %s\n", h->seeds.num_programs, h->seed_file);
+    }
+    fitness_init(&h->fitness, h->fitness_type, h->ref, scored_references(h));
+    init_pshufb_masks(&h->ref[0]);
+    ret = -1;
+    if (cache_init(&h->cache, h->cache_size) < 0)
+        goto end;
+    if (h->num_threads > 1) {
+        if (barrier_init(&h->barrier, h->num_threads) < 0)
+            goto end;
+        barrier = 1;
+    }
+    if (h->stats_interval) {
+        h->stats = h->stats_file ? fopen(h->stats_file, "w") : stdout;
+        if (!h->stats) {
+            printf("ERROR: cannot open stats file %s\n", h->stats_file);
+            goto end;
+        }
+    }
+    h->stop_iteration = h->max_iterations ? h->max_iterations : INT_MAX;
+    h->islands = calloc(h->num_islands, sizeof(*h->islands));
+    h->queues = calloc(h->num_islands, sizeof(*h->queues));
+    if (!h->islands || !h->queues)
+        goto end;
+    ret = 0;
+    for(int i = 0; i < h->num_islands; i++)
+        for(int j = 0; j < QUEUE_SIZE; j++)
+            program_attach(&h->queues[i].slots[j], h->queues[i].storage[j], MAX_INSTR);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (h->num_threads == 1) {
+        h->islands[0].h = h;
+        ret = island_thread(&h->islands[0]) ? -1 : 0;
+    } else {
+        int started;
+
+        for(started = 0; started < h->num_threads; started++) {
+            h->islands[started].id = started;
+            h->islands[started].h = h;
+            if (pthread_create(&threads[started], NULL, island_thread, &h->islands[started])) {
+                fprintf(stderr, "Error: failed to create thread %d\n", started);
+                __atomic_store_n(&h->stop_iteration, 0, __ATOMIC_RELEASE);
+                for(int i = started; i < h->num_threads; i++)
+                    barrier_leave(&h->barrier);
+                ret = -1;
+                break;
+            }
+        }
+        for(int i = 0; i < started; i++) {
+            void *status;
+            pthread_join(threads[i], &status);
+            if (status)
+                ret = -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wait_writer(h);
+
+    for(int i = 0; i < h->num_islands; i++) {
+        island_t *isl = &h->islands[i];
+        evaluations += isl->evaluations;
+        instructions[0] += isl->instructions[0];
+        instructions[1] += isl->instructions[1];
+        for(int j = 0; j < 3; j++)
+            cache_stats[j] += isl->cache_stats[j];
+        for(int j = 0; j < NUM_TIMERS; j++)
+            timers[j] += isl->timers[j];
+        if (isl->programs && isl->fitness == 0 &&
+            (!winner || isl->iterations < winner->iterations))
+            winner = isl;
+        if (isl->programs && (isl->fitness < best_fitness ||
+                              (isl->fitness == best_fitness && isl->fitness_iteration < best_iteration))) {
+            best_fitness = isl->fitness;
+            best_iteration = isl->fitness_iteration;
+        }
+    }
+    if (h->net.fd >= 0) {
+        if (h->islands[0].programs)
+            send_migrants(winner ? winner : &h->islands[0]);
+        net_close(&h->net);
+    }
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    h->evaluations = evaluations;
+    h->elapsed = elapsed;
+    h->solved = winner ? winner->iterations : -1;
+    h->best_fitness = best_fitness;
+    h->best_iteration = best_iteration;
+    if (winner && ((!h->quiet && h->num_islands > 1) || h->export_prefix)) {
+        uint8_t storage[PROGRAM_STORAGE(FINAL_INSTR)];
+        program_t final;
+
+        program_attach(&final, storage, FINAL_INSTR);
+        final_program(h, &winner->programs[winner->best], &final);
+        if (!h->quiet && h->num_islands > 1) {
+            printf("Solution found by island %d after %d iterations:\n", winner->id, winner->iterations);
+            print_program(&final);
+        }
+        if (h->export_prefix && export_programs(h->export_prefix, &h->target, &final, 1) < 0)
+            ret = -1;
+    }
+    if (!h->quiet) {
+        printf("%"PRId64" evaluations in %.2fs (%.0f/s)\n", evaluations, elapsed, elapsed > 0 ? evaluations / elapsed : 0.0);
+        if (instructions[1])
+            printf("checkpoints skipped %.1f%% of effective instructions\n",
+                   100.0 * instructions[1] / (instructions[0] + instructions[1]));
+        if (evaluations)
+            printf("neutral %.1f%%, fitness cache hits %.1f%%, misses %.1f%% of evaluations\n",
+                   100.0 * cache_stats[CACHE_NEUTRAL] / evaluations,
+                   100.0 * cache_stats[CACHE_HIT] / evaluations,
+                   100.0 * cache_stats[CACHE_MISS] / evaluations);
+#ifdef TIMERS
+        if (evaluations) {
+            printf("ticks per evaluation:");
+            for(int j = 0; j < NUM_TIMERS; j++)
+                printf(" %s %.0f", timer_names[j], (double)timers[j] / evaluations);
+            printf("\n");
+        }
+#endif
+    }
+
+end:
+    for(int i = 0; h->islands && i < h->num_islands; i++)
+        free_island(&h->islands[i]);
+    free(h->islands);
+    free(h->queues);
+    h->islands = NULL;
+    h->queues = NULL;
+    cache_free(&h->cache);
+    seed_free(&h->seeds);
+    if (h->stats && h->stats != stdout)
+        fclose(h->stats);
+    h->stats = NULL;
+    if (barrier)
+        barrier_destroy(&h->barrier);
+    if (h->snapshot)
+        munmap((void*)h->snapshot, h->snapshot_size);
+    free(h->snapshot_islands);
+    h->snapshot = NULL;
+    h->snapshot_islands = NULL;
+
+    return ret;
+}
+
+static double bench_time(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* Time the pieces of an iteration on the first island of the first seed.
+ * Results are in ns per call, or per instruction for the emulators. */
+static int bench_functions(genetic_asm_t *h)
+{
+    batch_register_t registers[NUM_REGS];
+    xmm_register_t regs[NUM_REGS];
+    island_t isl;
+    int64_t length = 0;
+    double t;
+    int ret = -1;
+
+    rng_seed(&h->rng, (uint32_t)h->random_seed);
+    init_references(h);
+    fitness_init(&h->fitness, h->fitness_type, h->ref, scored_references(h));
+    init_pshufb_masks(&h->ref[0]);
+    if (init_island(h, &isl, 0) < 0)
+        goto end;
+
+    t = bench_time();
+    for(int i = 0; i < BENCH_CALLS; i++) {
+        program_t *prog = &isl.winners[0];
+        program_copy(NULL, prog, &isl.programs[i % isl.num_programs]);
+        prog->dirty = 0;
+        effective_program(prog, fitness_live_out(&h->fitness));
+    }
+    printf("bench effective_program %.1f ns/call\n", (bench_time() - t) * 1e9 / BENCH_CALLS);
+
+    t = bench_time();
+    for(int i = 0; i < BENCH_CALLS; i++)
+        run_tournament(&isl, &isl.winners[i & 1], TOURNAMENT_SIZE);
+    printf("bench run_tournament %.1f ns/call\n", (bench_time() - t) * 1e9 / BENCH_CALLS);
+
+    /* Crossover keeps reworking the same pair, refreshed from the
+     * population outside the timed part. */
+    t = 0;
+    for(int i = 0; i < BENCH_CALLS; i += 256) {
+        double start;
+        for(int j = 0; j < 2; j++)
+            program_copy(NULL, &isl.winners[j], &isl.programs[(i / 256 * 2 + j) % isl.num_programs]);
+        start = bench_time();
+        for(int j = 0; j < 256; j++)
+            crossover(&isl, isl.winners, 5, 50);
+        t += bench_time() - start;
+    }
+    printf("bench crossover %.1f ns/call\n", t * 1e9 / BENCH_CALLS);
+
+    for(int i = 0; i < isl.num_programs; i++)
+        length += isl.programs[i].length[LEN_EFFECTIVE];
+    length *= BENCH_CALLS / isl.num_programs;
+
+    t = bench_time();
+    for(int i = 0; i < BENCH_CALLS / isl.num_programs * isl.num_programs; i++) {
+        program_t *prog = &isl.programs[i % isl.num_programs];
+        memcpy(registers, h->input, sizeof(registers));
+        execute_batch(prog->effective, prog->length[LEN_EFFECTIVE], registers);
+    }
+    printf("bench execute_batch %.2f ns/instr (%d references)\n", length ? (bench_time() - t) * 1e9 / length : 0.0, NUM_REF);
+
+    t = bench_time();
+    for(int i = 0; i < BENCH_CALLS / isl.num_programs * isl.num_programs; i++) {
+        program_t *prog = &isl.programs[i % isl.num_programs];
+        memcpy(registers, h->input, sizeof(registers));
+        execute_batch_provenance(prog->effective, prog->length[LEN_EFFECTIVE], registers);
+    }
+    printf("bench execute_batch_provenance %.2f ns/instr\n", length ? (bench_time() - t) * 1e9 / length : 0.0);
+
+    t = bench_time();
+    for(int i = 0; i < BENCH_CALLS / isl.num_programs * isl.num_programs; i++) {
+        program_t *prog = &isl.programs[i % isl.num_programs];
+        memcpy(regs, h->ref[0].input, sizeof(regs));
+        for(int j = 0; j < prog->length[LEN_EFFECTIVE]; j++)
+            execute_instruction(&prog->effective[j], regs);
+    }
+    printf("bench execute_instruction %.2f ns/instr\n", length ? (bench_time() - t) * 1e9 / length : 0.0);
+    ret = 0;
+
+end:
+    free_island(&isl);
+    return ret;
+}
+
+/* Evolve from a range of seeds with a fixed iteration budget and print the
+ * results as "bench <name> <value> <unit>" lines. */
+static int bench_loop(genetic_asm_t *h)
+{
+    int *solved = calloc(h->bench_seeds, sizeof(*solved));
+    int *unsolved = calloc(h->bench_seeds, sizeof(*unsolved));     /* best fitness */
+    int first_seed = h->random_seed, num_solved = 0, num_unsolved = 0;
+    int64_t evaluations = 0;
+    double elapsed = 0, sum = 0;
+    struct rusage usage;
+
+    if (!solved || !unsolved) {
+        free(solved);
+        free(unsolved);
+        return -1;
+    }
+    printf("Benchmark: %d seeds from %#x, %d islands of %d programs on %d threads, %d iterations\n",
+           h->bench_seeds, first_seed, h->num_islands, h->num_programs, h->num_threads, h->max_iterations);
+    h->quiet = 1;
+    for(int i = 0; i < h->bench_seeds; i++) {
+        h->random_seed = first_seed + i;
+        rng_seed(&h->rng, (uint32_t)h->random_seed);
+        if (main_loop(h) < 0) {
+            free(solved);
+            free(unsolved);
+            return -1;
+        }
+        printf("seed %#x: %"PRId64" evaluations in %.2fs, ", h->random_seed, h->evaluations, h->elapsed);
+        if (h->solved >= 0)
+            printf("solved after %d iterations\n", h->solved);
+        else
+            printf("not solved, best fitness %d after %d iterations\n", h->best_fitness, h->best_iteration);
+        fflush(stdout);
+        evaluations += h->evaluations;
+        elapsed += h->elapsed;
+        if (h->solved >= 0) {
+            solved[num_solved++] = h->solved;
+            sum += h->solved;
+        } else
+            unsolved[num_unsolved++] = h->best_fitness;
+    }
+
+    printf("bench evaluations %.0f evals/s\n", elapsed > 0 ? evaluations / elapsed : 0.0);
+    printf("bench solved %d of %d\n", num_solved, h->bench_seeds);
+    if (num_solved) {
+        qsort(solved, num_solved, sizeof(*solved), compare_int);
+        printf("bench iterations_min %d iterations\n", solved[0]);
+        printf("bench iterations_median %d iterations\n", solved[num_solved / 2]);
+        printf("bench iterations_mean %.0f iterations\n", sum / num_solved);
+        printf("bench iterations_max %d iterations\n", solved[num_solved - 1]);
+    }
+    if (num_unsolved) {
+        qsort(unsolved, num_unsolved, sizeof(*unsolved), compare_int);
+        printf("bench unsolved_fitness_min %d fitness\n", unsolved[0]);
+        printf("bench unsolved_fitness_median %d fitness\n", unsolved[num_unsolved / 2]);
+    }
+    free(solved);
+    free(unsolved);
+
+    h->random_seed = first_seed;
+    h->num_islands = h->num_threads = 1;
+    if (cache_init(&h->cache, h->cache_size) < 0)
+        return -1;
+    if (bench_functions(h) < 0)
+        return -1;
+    cache_free(&h->cache);
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("bench peak_rss %ld KB\n", usage.ru_maxrss);
+    return 0;
+}
+
+/* Connect to the coordinator, which hands out the random seed. A resumed
+ * worker keeps the seed of its snapshot, whose references it carries on
+ * with. */
+static int join_coordinator(genetic_asm_t *h)
+{
+    net_config_t config;
+    int fd = net_connect(h->coordinator), id, seed;
+
+    if (fd < 0)
+        return -1;
+    net_open(&h->net, fd);
+    get_net_config(h, &config);
+    if (net_hello(&h->net, &config, &id, &seed) < 0) {
+        net_close(&h->net);
+        return -1;
+    }
+    if (!h->snapshot)
+        h->random_seed = seed;
+    printf("Worker %d of coordinator %s\n", id, h->coordinator);
+    return 0;
+}
+
+typedef struct worker {
+    net_connection_t net;
+    int id;                 /* -1 until welcomed */
+    int64_t evaluations;    /* the worker has done so far */
+} worker_t;
+
+/* Score a program a worker sent on the references of the coordinator, as
+ * the fitness and cost it reports are only its word. */
+static void score_migrant(genetic_asm_t *h, program_t *prog)
+{
+    batch_register_t registers[NUM_REGS];
+
+    effective_program(prog, fitness_live_out(&h->fitness));
+    memcpy(registers, h->input, sizeof(registers));
+    run_references(h, prog->effective, prog->length[LEN_EFFECTIVE], registers);
+    prog->fitness = program_fitness(&h->fitness, registers, NULL, NULL);
+    result_cost(prog);
+}
+
+/* Keep the NET_POOL best distinct programs, best first. */
+static int pool_insert(genome_arena_t *arena, program_t *pool, uint64_t *hashes,
+                       int *size, const program_t *prog)
+{
+    uint64_t hash = hash_program(prog->instructions, prog->length[LEN_ABSOLUTE]);
+    int pos;
+
+    for(int i = 0; i < *size; i++)
+        if (hashes[i] == hash)
+            return 0;
+    if (*size == NET_POOL) {
+        if (!program_better(prog, &pool[NET_POOL-1]))
+            return 0;
+        program_release(arena, &pool[NET_POOL-1]);
+    } else
+        (*size)++;
+    for(pos = *size - 1; pos > 0 && program_better(prog, &pool[pos-1]); pos--) {
+        pool[pos] = pool[pos-1];
+        hashes[pos] = hashes[pos-1];
+    }
+    memset(&pool[pos], 0, sizeof(pool[pos]));
+    hashes[pos] = hash;
+    return program_copy(arena, &pool[pos], prog);
+}
+
+/* Answer a worker with the best program and others picked at random. */
+static int send_pool(genetic_asm_t *h, worker_t *w, const program_t *pool, int size, int64_t evaluations)
+{
+    const program_t *batch[NET_BATCH];
+    uint8_t payload[NET_PROGRAMS_SIZE(NET_BATCH)];
+    int num = 0;
+
+    if (size)
+        batch[num++] = &pool[0];
+    for(int i = 1; i < size && num < NET_BATCH; i++)
+        if (rng_bounded(&h->rng, size - i) < (uint32_t)(NET_BATCH - num))
+            batch[num++] = &pool[i];
+    return net_send(&w->net, NET_MIGRANTS, payload, net_pack_programs(payload, evaluations, batch, num));
+}
+
+/* Serve workers on --coordinator until one of them solves the target and
+ * all have left. Every batch of migrants a worker sends is scored again,
+ * goes into a pool of the best programs so far, and is answered from it. */
+static int coordinate_loop(genetic_asm_t *h)
+{
+    static worker_t workers[MAX_WORKERS];
+    struct pollfd fds[1 + MAX_WORKERS];
+    uint8_t storage[NET_BATCH][PROGRAM_STORAGE(MAX_INSTR)];
+    program_t migrants[NET_BATCH], pool[NET_POOL];
+    uint64_t hashes[NET_POOL];
+    genome_arena_t arena;
+    net_config_t config;
+    struct timespec start, end;
+    int64_t departed = 0, evaluations = 0;
+    int num_workers = 0, next_id = 0, size = 0, ret = 0;
+    int listener = net_listen(h->coordinator);
+    double elapsed;
+
+    if (listener < 0)
+        return -1;
+    init_references(h);
+    fitness_init(&h->fitness, h->fitness_type, h->ref, scored_references(h));
+    init_pshufb_masks(&h->ref[0]);
+    get_net_config(h, &config);
+    arena_init(&arena);
+    memset(pool, 0, sizeof(pool));
+    for(int i = 0; i < NET_BATCH; i++)
+        program_attach(&migrants[i], storage[i], MAX_INSTR);
+    printf("Coordinating on %s\n", h->coordinator);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!size || pool[0].fitness || num_workers) {
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for(int i = 0; i < num_workers; i++) {
+            fds[1+i].fd = workers[i].net.fd;
+            fds[1+i].events = POLLIN;
+        }
+        if (poll(fds, 1 + num_workers, -1) < 0)
+            continue;
+
+        for(int i = 0; i < num_workers; i++) {
+            worker_t *w = &workers[i];
+            const uint8_t *payload;
+            size_t length;
+            int type, got;
+
+            if (!fds[1+i].revents)
+                continue;
+            while ((got = net_receive(&w->net, 0, &type, &payload, &length)) > 0) {
+                int num, best = size ? pool[0].fitness : INT_MAX, cost = size ? pool[0].cost : INT_MAX;
+
+                if (w->id < 0 && type == NET_HELLO) {
+                    if (net_welcome(&w->net, payload, length, &config, next_id, h->random_seed + next_id) < 0) {
+                        got = -1;
+                        break;
+                    }
+                    w->id = next_id++;
+                    printf("Worker %d joined\n", w->id);
+                    continue;
+                }
+                num = w->id >= 0 && type == NET_MIGRANTS ?
+                      net_unpack_programs(payload, length, &w->evaluations, migrants, NET_BATCH) : -1;
+                if (num < 0) {
+                    got = -1;
+                    break;
+                }
+                for(int j = 0; j < num; j++) {
+                    if (!valid_opcodes(h, &migrants[j]))
+                        continue;
+                    score_migrant(h, &migrants[j]);
+                    if (pool_insert(&arena, pool, hashes, &size, &migrants[j]) < 0) {
+                        ret = -1;
+                        goto end;
+                    }
+                }
+                if (size && (pool[0].fitness < best || (pool[0].fitness == best && pool[0].cost < cost))) {
+                    uint8_t final_storage[PROGRAM_STORAGE(FINAL_INSTR)];
+                    program_t final;
+
+                    program_attach(&final, final_storage, FINAL_INSTR);
+                    printf("worker %d:\n", w->id);
+                    final_program(h, &pool[0], &final);
+                    print_program(&final);
+                    printf("\n");
+                }
+                evaluations = departed;
+                for(int j = 0; j < num_workers; j++)
+                    evaluations += workers[j].evaluations;
+                if (send_pool(h, w, pool, size, evaluations) < 0) {
+                    got = -1;
+                    break;
+                }
+            }
+            if (got < 0) {
+                if (w->id >= 0)
+                    printf("Worker %d left after %"PRId64" evaluations\n", w->id, w->evaluations);
+                departed += w->evaluations;
+                net_close(&w->net);
+            }
+        }
+        for(int i = 0; i < num_workers; )
+            if (workers[i].net.fd < 0)
+                workers[i] = workers[--num_workers];
+            else
+                i++;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = net_accept(listener);
+            if (fd >= 0 && num_workers == MAX_WORKERS)
+                close(fd);
+            else if (fd >= 0) {
+                net_open(&workers[num_workers].net, fd);
+                workers[num_workers].id = -1;
+                workers[num_workers++].evaluations = 0;
+            }
+        }
+        fflush(stdout);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("%"PRId64" evaluations by %d workers in %.2fs (%.0f/s)\n", departed, next_id, elapsed,
+           elapsed > 0 ? departed / elapsed : 0.0);
+    if (h->export_prefix) {
+        uint8_t final_storage[PROGRAM_STORAGE(FINAL_INSTR)];
+        program_t final;
+
+        program_attach(&final, final_storage, FINAL_INSTR);
+        final_program(h, &pool[0], &final);
+        ret = export_programs(h->export_prefix, &h->target, &final, 1);
+    }
+
+end:
+    for(int i = 0; i < num_workers; i++)
+        net_close(&workers[i].net);
+    for(int i = 0; i < size; i++)
+        program_release(&arena, &pool[i]);
+    arena_free(&arena);
+    close(listener);
+    return ret;
+}
+
+/* Export the programs of the seed file that solve the target, after the
+ * same clean-up as the results of a search. */
+static int export_loop(genetic_asm_t *h)
+{
+    uint8_t storage[PROGRAM_STORAGE(MAX_INSTR)];
+    uint8_t *final_storage;
+    program_t prog, *finals;
+    int num = 0, ret = -1;
+
+    if (load_seed_file(&h->seeds, h->seed_file) < 0)
+        return -1;
+    init_references(h);
+    fitness_init(&h->fitness, h->fitness_type, h->ref, scored_references(h));
+    init_pshufb_masks(&h->ref[0]);
+    program_attach(&prog, storage, MAX_INSTR);
+    finals = calloc(h->seeds.num_programs, sizeof(*finals));
+    final_storage = malloc((size_t)h->seeds.num_programs * PROGRAM_STORAGE(FINAL_INSTR));
+    if (!finals || !final_storage)
+        goto end;
+
+    for(int i = 0; i < h->seeds.num_programs; i++) {
+        batch_register_t registers[NUM_REGS];
+        int assignment[NUM_REGS];
+        int length = h->seeds.start[i+1] - h->seeds.start[i];
+
+        prog.length[LEN_ABSOLUTE] = prog.length[LEN_EFFECTIVE] = length;
+        memcpy(prog.effective, h->seeds.instructions + h->seeds.start[i], length * sizeof(instruction_t));
+        memcpy(registers, h->input, sizeof(registers));
+        run_references(h, prog.effective, length, registers);
+        prog.fitness = program_fitness(&h->fitness, registers, assignment, NULL);
+        if (prog.fitness) {
+            printf("Program %d does not solve the target, fitness = %d\n", i + 1, prog.fitness);
+            continue;
+        }
+        program_attach(&finals[num], final_storage + num * PROGRAM_STORAGE(FINAL_INSTR), FINAL_INSTR);
+        final_program(h, &prog, &finals[num]);
+        printf("Program %d:\n", i + 1);
+        print_program(&finals[num++]);
+    }
+    if (!num)
+        printf("ERROR: no program of %s solves the target\n", h->seed_file);
+    else
+        ret = export_programs(h->export_prefix, &h->target, finals, num);
+
+end:
+    free(finals);
+    free(final_storage);
+    seed_free(&h->seeds);
+    return ret;
+}
+
+static void usage(void)
+{
+    printf("usage: genetic_asm [options]\n"
+           "\n"
+           "  -h, --help            print this help message\n"
+           "  -p, --population      set population size of each island [%d]\n"
+           "      --seed            set random seed\n"
+           "      --target          scan to evolve: 4x4-frame, 4x4-field, 8x8-frame, 8x8-field,\n"
+           "                          or a file mapping output words to input words [%s]\n"
+           "      --fitness         distance scores how far each output word is from its\n"
+           "                          place, with the result in any registers, exact counts\n"
+           "                          wrong words of the expected registers [distance]\n"
+           "      --isa             instruction set level the programs use: sse2, ssse3 adding\n"
+           "                          palignr and pshufb, or sse4 adding pblendw [sse2]\n"
+           "      --references      symbolic scores programs once on the provenance of every\n"
+           "                          input byte, which is exact, random on %d references\n"
+           "                          of random words [symbolic]\n"
+           "      --crossover       linear exchanges segments of up to %d instructions at\n"
+           "                          nearby positions, homologous at the same position and\n"
+           "                          of the same length, effective starting at effective\n"
+           "                          instructions [linear]\n"
+           "      --islands         number of populations, evolved in a ring that migrants\n"
+           "                          travel along [threads]\n"
+           "  -t, --threads         threads the islands are spread over, a run only depends\n"
+           "                          on the seed and the islands, not on the threads [1]\n"
+           "      --migrate         iterations between migrations to the next island [%d]\n"
+           "      --checkpoint      effective instructions between saved register states,\n"
+           "                          0 always evaluates programs from the start [%d]\n"
+           "      --fitness-cache   entries of the table of evaluated programs shared by\n"
+           "                          all islands, 0 disables it [%d]\n"
+           "      --cpu-profile     cpu the cost of a program is estimated in cycles for:\n"
+           "                          length, core2, sandybridge, haswell, skylake, zen2 [%s]\n"
+           "                          length counts effective instructions\n"
+           "      --mode            evolve, or enumerate to search for the shortest program\n"
+           "                          by iterative deepening, or bench to time evolution\n"
+           "                          from --bench-seeds seeds and the functions it uses,\n"
+           "                          or coordinate to serve the workers of a distributed\n"
+           "                          run, or export to write the programs of --seed-file\n"
+           "                          that solve the target to --export [evolve]\n"
+           "      --coordinator     address of the coordinator, HOST:PORT or unix:PATH, to\n"
+           "                          evolve as one of its workers or to listen on\n"
+           "      --export          write the solution to PREFIX.asm as x264asm, PREFIX.c as\n"
+           "                          intrinsics and PREFIX_bench.c, which checks and times\n"
+           "                          them against the scalar scan\n"
+           "      --iterations      stop evolving after this many iterations, 0 never stops\n"
+           "                          before a solution is found [0]\n"
+           "      --bench-seeds     seeds evolved by the benchmark, counting up from --seed [%d]\n"
+           "      --max-depth       longest program to enumerate [%d]\n"
+           "      --enum-regs       registers used by enumerated programs [%d]\n"
+           "      --memory          MB for the table of reached states of enumerate [%d]\n"
+           "      --stats           iterations between population statistics written by every\n"
+           "                          island as a JSON line, 0 disables them [0]\n"
+           "      --stats-file      file the statistics go to [stdout]\n"
+           "      --snapshot        file the state of the run is saved to periodically\n"
+           "      --snapshot-interval iterations between snapshots [%d]\n"
+           "      --seed-file       start from the programs in an assembly file, in the syntax\n"
+           "                          programs are printed in, separated by blank lines\n"
+           "      --seed-variants   mutated copies of every seeded program, seeds and copies\n"
+           "                          fill at most half of each island [%d]\n"
+           "      --resume          continue the run saved in a snapshot, with the population,\n"
+           "                          seed, islands and cpu profile it was written with\n"
+           "      --emulator        instruction emulator: auto, c, sse2, avx2, avx512, threaded,\n"
+           "                          check, jit, jit-check [auto]\n"
+           "                          check runs c and the best simd version side by side\n"
+           "                          and aborts on mismatch, jit-check does the same for\n"
+           "                          c and the native code compiler\n", DEFAULT_PROGRAMS, DEFAULT_TARGET, NUM_REF, MAX_SEGMENT, DEFAULT_MIGRATE, DEFAULT_CHECKPOINT,
+           DEFAULT_CACHE, DEFAULT_CPU_PROFILE, DEFAULT_BENCH_SEEDS, DEFAULT_MAX_DEPTH, DEFAULT_ENUM_REGS, DEFAULT_MEMORY,
+           DEFAULT_SNAPSHOT_INTERVAL, DEFAULT_SEED_VARIANTS);
+
+}
+
+static int parse_cmdline(genetic_asm_t *h, int argc, char **argv)
 {
     for( optind = 0;; ) {
         int c = getopt_long(argc, argv, short_options, long_options, NULL);
@@ -812,6 +2523,132 @@ static int parse_cmdline(genetic_asm_t *h, int argc, char **argv)
             case OPT_SEED:
                 h->random_seed = strtol(optarg, NULL, 0);
                 break;
+            case 't':
+                h->num_threads = atoi(optarg);
+                break;
+            case OPT_ISLANDS:
+                h->num_islands = atoi(optarg);
+                break;
+            case OPT_MIGRATE:
+                h->migrate_interval = atoi(optarg);
+                break;
+            case OPT_CHECKPOINT:
+                h->checkpoint_interval = atoi(optarg);
+                break;
+            case OPT_FITNESS_CACHE:
+                h->cache_size = atoi(optarg);
+                break;
+            case OPT_CPU_PROFILE:
+                h->cpu_profile = optarg;
+                break;
+            case OPT_MODE:
+                if (!strcmp(optarg, "evolve"))
+                    h->mode = MODE_EVOLVE;
+                else if (!strcmp(optarg, "enumerate"))
+                    h->mode = MODE_ENUMERATE;
+                else if (!strcmp(optarg, "bench"))
+                    h->mode = MODE_BENCH;
+                else if (!strcmp(optarg, "coordinate"))
+                    h->mode = MODE_COORDINATE;
+                else if (!strcmp(optarg, "export"))
+                    h->mode = MODE_EXPORT;
+                else {
+                    printf("ERROR: unknown mode %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_MAX_DEPTH:
+                h->max_depth = atoi(optarg);
+                break;
+            case OPT_ENUM_REGS:
+                h->enum_regs = atoi(optarg);
+                break;
+            case OPT_MEMORY:
+                h->memory = atoi(optarg);
+                break;
+            case OPT_SNAPSHOT:
+                h->snapshot_file = optarg;
+                break;
+            case OPT_SNAPSHOT_INTERVAL:
+                h->snapshot_interval = atoi(optarg);
+                break;
+            case OPT_RESUME:
+                h->resume_file = optarg;
+                break;
+            case OPT_SEED_FILE:
+                h->seed_file = optarg;
+                break;
+            case OPT_SEED_VARIANTS:
+                h->seed_variants = atoi(optarg);
+                break;
+            case OPT_ITERATIONS:
+                h->max_iterations = atoi(optarg);
+                break;
+            case OPT_BENCH_SEEDS:
+                h->bench_seeds = atoi(optarg);
+                break;
+            case OPT_STATS:
+                h->stats_interval = atoi(optarg);
+                break;
+            case OPT_STATS_FILE:
+                h->stats_file = optarg;
+                break;
+            case OPT_TARGET:
+                h->target_name = optarg;
+                break;
+            case OPT_FITNESS:
+                if (!strcmp(optarg, "distance"))
+                    h->fitness_type = FITNESS_DISTANCE;
+                else if (!strcmp(optarg, "exact"))
+                    h->fitness_type = FITNESS_EXACT;
+                else {
+                    printf("ERROR: unknown fitness %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_ISA:
+                for (h->isa = 0; h->isa < NUM_ISAS; h->isa++)
+                    if (!strcmp(optarg, isa_names[h->isa]))
+                        break;
+                if (h->isa == NUM_ISAS) {
+                    printf("ERROR: unknown instruction set %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_COORDINATOR:
+                h->coordinator = optarg;
+                break;
+            case OPT_EXPORT:
+                h->export_prefix = optarg;
+                break;
+            case OPT_CROSSOVER:
+                for (h->crossover = 0; h->crossover < NUM_CROSSOVERS; h->crossover++)
+                    if (!strcmp(optarg, crossover_names[h->crossover]))
+                        break;
+                if (h->crossover == NUM_CROSSOVERS) {
+                    printf("ERROR: unknown crossover %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_REFERENCES:
+                if (!strcmp(optarg, "symbolic"))
+                    h->references = REFERENCES_SYMBOLIC;
+                else if (!strcmp(optarg, "random"))
+                    h->references = REFERENCES_RANDOM;
+                else {
+                    printf("ERROR: unknown references %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_EMULATOR:
+                for (h->emulator = EMU_AUTO; h->emulator < NUM_EMULATORS; h->emulator++)
+                    if (!strcmp(optarg, emulator_name(h->emulator)))
+                        break;
+                if (h->emulator == NUM_EMULATORS) {
+                    printf("ERROR: unknown emulator %s\n", optarg);
+                    return -1;
+                }
+                break;
             default:
                 return -1;
         }
@@ -822,6 +2659,90 @@ static int parse_cmdline(genetic_asm_t *h, int argc, char **argv)
         return -1;
     }
 
+    if (h->num_threads < 1 || h->num_threads > MAX_THREADS) {
+        printf("ERROR: invalid number of threads %d\n", h->num_threads);
+        return -1;
+    }
+
+    if (!h->num_islands)
+        h->num_islands = h->num_threads;
+    if (h->num_islands < 1 || h->num_islands > MAX_ISLANDS) {
+        printf("ERROR: invalid number of islands %d\n", h->num_islands);
+        return -1;
+    }
+
+    if (h->migrate_interval < 1) {
+        printf("ERROR: invalid migration interval %d\n", h->migrate_interval);
+        return -1;
+    }
+
+    if (h->checkpoint_interval < 0 || h->checkpoint_interval > MAX_INSTR) {
+        printf("ERROR: invalid checkpoint interval %d\n", h->checkpoint_interval);
+        return -1;
+    }
+
+    if (h->cache_size < 0 || h->cache_size > (1 << 30)) {
+        printf("ERROR: invalid fitness cache size %d\n", h->cache_size);
+        return -1;
+    }
+
+    if (h->max_depth < 1 || h->max_depth > MAX_INSTR) {
+        printf("ERROR: invalid enumeration depth %d\n", h->max_depth);
+        return -1;
+    }
+
+    if (h->enum_regs < 2 || h->enum_regs > ENUM_MAX_REGS) {
+        printf("ERROR: invalid number of enumeration registers %d\n", h->enum_regs);
+        return -1;
+    }
+
+    if (h->memory < 1) {
+        printf("ERROR: invalid memory size %d\n", h->memory);
+        return -1;
+    }
+
+    if (h->snapshot_interval < 1) {
+        printf("ERROR: invalid snapshot interval %d\n", h->snapshot_interval);
+        return -1;
+    }
+
+    if (h->seed_variants < 0) {
+        printf("ERROR: invalid number of seed variants %d\n", h->seed_variants);
+        return -1;
+    }
+
+    if (h->max_iterations < 0) {
+        printf("ERROR: invalid iteration budget %d\n", h->max_iterations);
+        return -1;
+    }
+
+    if (h->bench_seeds < 1) {
+        printf("ERROR: invalid number of benchmark seeds %d\n", h->bench_seeds);
+        return -1;
+    }
+
+    if (h->stats_interval < 0) {
+        printf("ERROR: invalid stats interval %d\n", h->stats_interval);
+        return -1;
+    }
+
+    if (h->mode == MODE_COORDINATE && !h->coordinator) {
+        printf("ERROR: the coordinator needs an address to listen on\n");
+        return -1;
+    }
+
+    if (h->mode == MODE_EXPORT && (!h->seed_file || !h->export_prefix)) {
+        printf("ERROR: export needs a --seed-file and an --export prefix\n");
+        return -1;
+    }
+
+    if (h->mode == MODE_BENCH && !h->max_iterations) {
+        printf("ERROR: the benchmark needs an iteration budget\n");
+        return -1;
+    }
+
+    h->num_opcodes = isa_opcodes[h->isa];
+
     if (!h->random_seed) {
         /* get the current calendar time */
         h->random_seed = time(NULL);
@@ -835,12 +2756,86 @@ int main(int argc, char **argv)
     genetic_asm_t h;
 
     h.num_programs = DEFAULT_PROGRAMS;
+    h.random_seed = 0;
+    h.emulator = EMU_AUTO;
+    h.num_islands = 0;
+    h.num_threads = 1;
+    h.migrate_interval = DEFAULT_MIGRATE;
+    h.checkpoint_interval = DEFAULT_CHECKPOINT;
+    h.cache_size = DEFAULT_CACHE;
+    h.cpu_profile = DEFAULT_CPU_PROFILE;
+    h.mode = MODE_EVOLVE;
+    h.max_depth = DEFAULT_MAX_DEPTH;
+    h.enum_regs = DEFAULT_ENUM_REGS;
+    h.memory = DEFAULT_MEMORY;
+    h.snapshot_file = NULL;
+    h.snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    h.resume_file = NULL;
+    h.snapshot = NULL;
+    h.snapshot_islands = NULL;
+    h.start_iteration = 0;
+    h.writer = 0;
+    h.seed_file = NULL;
+    h.seed_variants = DEFAULT_SEED_VARIANTS;
+    memset(&h.seeds, 0, sizeof(h.seeds));
+    h.max_iterations = 0;
+    h.bench_seeds = DEFAULT_BENCH_SEEDS;
+    h.quiet = 0;
+    h.stats_interval = 0;
+    h.stats_file = NULL;
+    h.stats = NULL;
+    h.target_name = DEFAULT_TARGET;
+    h.fitness_type = FITNESS_DISTANCE;
+    h.isa = ISA_SSE2;
+    h.references = REFERENCES_SYMBOLIC;
+    h.crossover = CROSSOVER_LINEAR;
+    h.coordinator = NULL;
+    h.export_prefix = NULL;
+    net_open(&h.net, -1);
 
     if (parse_cmdline(&h, argc, argv) < 0)
         return -1;
+    if (h.resume_file && h.mode == MODE_EVOLVE && load_snapshot(&h) < 0)
+        return -1;
 
-    printf("Random Seed: %#x\n", h.random_seed);
-    srandom(h.random_seed);
+    h.emulator = init_emulator(h.emulator);
+    if (h.emulator < 0) {
+        printf("ERROR: emulator not supported on this cpu\n");
+        return -1;
+    }
+    printf("Emulator: %s\n", emulator_name(h.emulator));
+
+    if (init_cost_model(h.cpu_profile) < 0) {
+        printf("ERROR: unknown cpu profile %s\n", h.cpu_profile);
+        return -1;
+    }
+    printf("Cost model: %s\n", h.cpu_profile);
 
+    if (!h.snapshot) {
+        if (init_target(&h.target, h.target_name) < 0)
+            return -1;
+        printf("Target: %s, %d input and %d output registers\n", h.target_name,
+               h.target.num_inputs, h.target.num_outputs);
+        if (h.references == REFERENCES_SYMBOLIC && h.target.num_inputs > SYMBOLIC_INPUTS) {
+            printf("ERROR: symbolic references take at most %d input registers\n", SYMBOLIC_INPUTS);
+            return -1;
+        }
+    } else
+        printf("Target: from the snapshot, %d input and %d output registers\n",
+               h.target.num_inputs, h.target.num_outputs);
+
+    if (h.coordinator && h.mode == MODE_EVOLVE && join_coordinator(&h) < 0)
+        return -1;
+    printf("Random Seed: %#x\n", h.random_seed);
+    rng_seed(&h.rng, (uint32_t)h.random_seed);
+
+    if (h.mode == MODE_ENUMERATE)
+        return enumerate_loop(&h);
+    if (h.mode == MODE_BENCH)
+        return bench_loop(&h);
+    if (h.mode == MODE_COORDINATE)
+        return coordinate_loop(&h);
+    if (h.mode == MODE_EXPORT)
+        return export_loop(&h);
     return main_loop(&h);
 }
@@ -0,0 +1,362 @@
+#ifndef GENETIC_ASM_H
+#define GENETIC_ASM_H
+
+#include <stdint.h>
+
+#define NUM_REGS 16
+#define MAX_INSTR 500
+#define MIN_INSTR 5
+#define INITIAL_INSTR 96
+#define DEFAULT_PROGRAMS 100
+#define LEN_ABSOLUTE  0
+#define LEN_EFFECTIVE 1
+#ifndef NUM_REF
+#define NUM_REF 3
+#endif
+/* Reference vectors are evaluated in groups of 4, one per 128-bit lane of
+ * the widest vector unit. */
+#define BATCH_REF ((NUM_REF + 3) & ~3)
+
+typedef union xmm_register {
+    uint64_t q[2];
+    uint32_t d[4];
+    uint16_t wd[8];
+    uint8_t  b[16];
+} xmm_register_t;
+
+/* One register across every reference vector of a batch. */
+typedef xmm_register_t batch_register_t[BATCH_REF];
+
+typedef struct instruction {
+    uint8_t opcode;
+    uint8_t operands[3];
+} instruction_t;
+
+/* The genome, the effective program and the live register mask after each
+ * genome instruction live in one block of a genome arena, each with room for
+ * capacity instructions. */
+typedef struct program {
+    int length[2];  /* 0 = absolute, 1 = effective */
+    int fitness;
+    int cost;
+    int capacity;
+    int dirty;      /* first instruction changed since live[] was computed */
+    unsigned credited;  /* registers the fitness credited, live at the end of
+                         * offspring; 0 before the first evaluation */
+    instruction_t *instructions;
+    instruction_t *effective;
+    uint16_t *live;
+} program_t;
+
+typedef struct reference {
+    xmm_register_t input[NUM_REGS];
+    xmm_register_t output[NUM_REGS];
+    int num_regs_used[2];
+} reference_t;
+
+enum instructions {
+    PUNPCKLWD   = 0,
+    PUNPCKHWD,
+    PUNPCKLDQ,
+    PUNPCKHDQ,
+    PUNPCKLQDQ,
+    PUNPCKHQDQ,
+    MOVDQA,
+    PSLLDQ,
+    PSRLDQ,
+    PSLLQ,
+    PSRLQ,
+    PSLLD,
+    PSRLD,
+    PSHUFLW,
+    PSHUFHW,
+    PSHUFD,
+    /* SSSE3 */
+    PALIGNR,
+    PSHUFB,     /* shuffle by one of pshufb_masks[] */
+    /* SSE4.1 */
+    PBLENDW,
+    NUM_INSTR
+};
+
+/* Instruction set levels, each adding the opcodes after the last one of the
+ * level below. */
+enum isa_level {
+    ISA_SSE2 = 0,
+    ISA_SSSE3,
+    ISA_SSE4,
+    NUM_ISAS,
+};
+
+/* arena.c */
+#define ARENA_GRAIN   8
+#define ARENA_CLASSES ((MAX_INSTR + ARENA_GRAIN - 1) / ARENA_GRAIN)
+#define PROGRAM_STORAGE(capacity) ((capacity) * (2 * sizeof(instruction_t) + sizeof(uint16_t)))
+
+typedef struct genome_arena {
+    instruction_t *free[ARENA_CLASSES]; /* free blocks of each size class */
+    uint8_t *chunk;                     /* chunk currently being carved up */
+    size_t chunk_used;
+    size_t chunk_size;
+    void **chunks;
+    int num_chunks;
+    size_t bytes_used;                  /* bytes in blocks handed out */
+} genome_arena_t;
+
+void arena_init( genome_arena_t *arena );
+void arena_free( genome_arena_t *arena );
+int  program_reserve( genome_arena_t *arena, program_t *prog, int length );
+void program_release( genome_arena_t *arena, program_t *prog );
+int  program_copy( genome_arena_t *arena, program_t *dst, const program_t *src );
+void program_attach( program_t *prog, void *storage, int capacity );
+
+/* Register usage of an instruction besides writing operands[0]. */
+static inline int reads_dst( const instruction_t *instr )
+{
+    return !((instr->opcode >= PSHUFLW && instr->opcode <= PSHUFD) || instr->opcode == MOVDQA);
+}
+
+static inline int reads_src( const instruction_t *instr )
+{
+    return instr->operands[1] < NUM_REGS && (instr->opcode < PSLLDQ || instr->opcode > PSRLD) &&
+           instr->opcode != PSHUFB;
+}
+
+/* Ordering used for selection and replacement: lower fitness wins, then
+ * lower cost. */
+static inline int program_better( const program_t *a, const program_t *b )
+{
+    return a->fitness < b->fitness || (a->fitness == b->fitness && a->cost < b->cost);
+}
+
+/* rng.c */
+typedef struct rng {
+    uint64_t s[4];
+} rng_t;
+
+void rng_seed( rng_t *rng, uint64_t seed );
+void rng_jump( rng_t *rng );
+void rng_fill_bounded( rng_t *rng, uint32_t bound, uint32_t *out, int n );
+
+static inline uint64_t rng_next( rng_t *rng )
+{
+    uint64_t *s = rng->s;
+    uint64_t x = s[1] * 5, r = (x << 7 | x >> 57) * 9, t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 45 | s[3] >> 19;
+    return r;
+}
+
+/* Uniform in [0, bound) without the bias of a modulo: the high half of a
+ * 32x32-bit product, redrawn in the rare case it falls in the short
+ * range. */
+static inline uint32_t rng_bounded( rng_t *rng, uint32_t bound )
+{
+    uint64_t m = (rng_next( rng ) >> 32) * bound;
+
+    if ((uint32_t)m < bound) {
+        uint32_t threshold = -bound % bound;
+        while ((uint32_t)m < threshold)
+            m = (rng_next( rng ) >> 32) * bound;
+    }
+    return m >> 32;
+}
+
+/* Uniform in [0, 1). */
+static inline float rng_float( rng_t *rng )
+{
+    return (rng_next( rng ) >> 40) * (1.0f / (1 << 24));
+}
+
+/* rank.c */
+typedef struct rank {
+    const program_t *programs;
+    int *heap;      /* program indices, worst program at the root */
+    int *pos;       /* position of each program in heap */
+    int size;
+} rank_t;
+
+int  rank_init( rank_t *rank, const program_t *programs, int num_programs );
+int  rank_load( rank_t *rank, const program_t *programs, const int *heap, int num_programs );
+void rank_free( rank_t *rank );
+void rank_update( rank_t *rank, int idx );
+
+static inline int rank_worst( const rank_t *rank )
+{
+    return rank->heap[0];
+}
+
+/* cache.c */
+typedef struct fitness_cache {
+    uint64_t (*entries)[3];
+    unsigned mask;
+} fitness_cache_t;
+
+uint64_t hash_program( const instruction_t *instr, int length );
+int  cache_init( fitness_cache_t *cache, int size );
+void cache_free( fitness_cache_t *cache );
+int  cache_lookup( fitness_cache_t *cache, uint64_t hash, int *fitness, int *cost, unsigned *credited );
+void cache_store( fitness_cache_t *cache, uint64_t hash, int fitness, int cost, unsigned credited );
+
+/* cost.c */
+#define COST_SCALE 60   /* cost units per estimated cycle */
+
+int  init_cost_model( const char *name );
+int  program_cost( const instruction_t *instr, int length );
+int  instruction_latency( int opcode );
+
+/* enumerate.c */
+#define ENUM_MAX_REGS 8
+
+int enumerate_programs( const reference_t *ref, const batch_register_t *input, int max_depth,
+                        int num_regs, int num_opcodes, size_t memory, instruction_t *result );
+
+/* target.c */
+#define MAX_TARGET_WORDS (NUM_REGS * 8)
+
+typedef struct target {
+    int num_inputs;     /* registers holding input words */
+    int num_outputs;    /* registers the result is expected in */
+    uint8_t map[MAX_TARGET_WORDS];  /* input word of each output word */
+} target_t;
+
+int  init_target( target_t *target, const char *name );
+int  target_valid( const target_t *target );
+void apply_target( const target_t *target, reference_t *ref );
+
+/* fitness.c */
+enum fitness_type {
+    FITNESS_DISTANCE = 0,
+    FITNESS_EXACT,
+};
+
+#define WORD_HASH_BITS 8
+#define WORD_HASH_SIZE (1 << WORD_HASH_BITS)   /* at least twice MAX_TARGET_WORDS */
+
+typedef struct fitness {
+    int type;
+    int num_outputs;
+    int num_ref;    /* references scored, the first num_ref */
+    const reference_t *ref;
+    /* A hash of the values expected in the first reference to 1 + the
+     * first output word holding them, and the next output word holding the
+     * same value. */
+    uint16_t hash_value[WORD_HASH_SIZE];
+    uint8_t hash_word[WORD_HASH_SIZE];
+    uint8_t next[MAX_TARGET_WORDS];
+} fitness_t;
+
+void fitness_init( fitness_t *f, int type, const reference_t *ref, int num_ref );
+unsigned fitness_live_out( const fitness_t *f );
+int  program_fitness( const fitness_t *f, const batch_register_t *registers, int *assignment, unsigned *credited );
+int  remap_outputs( instruction_t *instr, int length, int capacity, const int *assignment, int num_outputs );
+
+/* optimize.c */
+#define FINAL_INSTR (MAX_INSTR + 2 * NUM_REGS)  /* room for copies to the output registers */
+
+int  trim_program( const instruction_t *instr, int length, unsigned live, instruction_t *out );
+int  optimize_program( instruction_t *instr, int length, int num_outputs, const batch_register_t *input );
+
+/* export.c */
+int  export_programs( const char *prefix, const target_t *target, const program_t *progs, int num );
+
+/* seed.c */
+typedef struct seed_corpus {
+    instruction_t *instructions;    /* every program back to back */
+    int *start;                     /* of each program, num_programs + 1 entries */
+    int num_programs;
+} seed_corpus_t;
+
+extern const char * const instruction_names[NUM_INSTR];
+
+int  load_seed_file( seed_corpus_t *corpus, const char *path );
+void seed_free( seed_corpus_t *corpus );
+
+/* emulate.c */
+enum emulator_type {
+    EMU_AUTO = 0,
+    EMU_C,
+    EMU_SSE2,
+    EMU_AVX2,
+    EMU_AVX512,
+    EMU_CHECK,
+    EMU_JIT,
+    EMU_JIT_CHECK,
+    EMU_THREADED,
+    NUM_EMULATORS,
+};
+
+typedef void (*execute_instruction_t)( const instruction_t *instr, xmm_register_t *registers );
+typedef void (*execute_batch_t)( const instruction_t *instr, int length, batch_register_t *registers );
+
+extern execute_instruction_t execute_instruction;
+extern execute_batch_t execute_batch;
+
+/* The masks the pshufb immediate selects, each stored twice so 256-bit code
+ * can load it whole. */
+#define PSHUFB_MASKS 256
+extern xmm_register_t pshufb_masks[PSHUFB_MASKS][2];
+
+/* A byte of the first reference made of more than one input byte, for
+ * execute_batch_provenance(). */
+#define PROVENANCE_MIXED 0xff
+
+void execute_instruction_c( const instruction_t *instr, xmm_register_t *registers );
+void execute_batch_c( const instruction_t *instr, int length, batch_register_t *registers );
+int  init_emulator( int type );
+const char *emulator_name( int type );
+void init_pshufb_masks( const reference_t *ref );
+void execute_batch_provenance( const instruction_t *instr, int length, batch_register_t *registers );
+
+/* net.c */
+#define NET_VERSION 1
+#define NET_BATCH 4             /* programs in one migration */
+#define NET_MAX_MESSAGE (1 << 20)
+#define NET_PROGRAMS_SIZE(num) (12 + (num) * (12 + MAX_INSTR * sizeof(instruction_t)))
+#define NET_CONFIG_SIZE (36 + MAX_TARGET_WORDS)
+
+enum net_message {
+    NET_HELLO = 1,
+    NET_WELCOME,
+    NET_REJECT,
+    NET_MIGRANTS,
+};
+
+/* What every worker has to agree on with the coordinator. */
+typedef struct net_config {
+    int fitness_type;
+    int isa;
+    int references;
+    target_t target;
+} net_config_t;
+
+typedef struct net_connection {
+    int fd;
+    uint8_t *buffer;    /* received, from the message returned last on */
+    size_t used;
+    size_t capacity;
+    size_t consumed;    /* size of the message returned last */
+} net_connection_t;
+
+int  net_listen( const char *address );
+int  net_accept( int listener );
+int  net_connect( const char *address );
+void net_open( net_connection_t *c, int fd );
+void net_close( net_connection_t *c );
+int  net_send( net_connection_t *c, int type, const uint8_t *payload, size_t length );
+int  net_receive( net_connection_t *c, int wait, int *type, const uint8_t **payload, size_t *length );
+int  net_hello( net_connection_t *c, const net_config_t *config, int *id, int *seed );
+int  net_welcome( net_connection_t *c, const uint8_t *payload, size_t length, const net_config_t *config,
+                  int id, int seed );
+size_t net_pack_programs( uint8_t *out, int64_t evaluations, const program_t * const *progs, int num );
+int  net_unpack_programs( const uint8_t *payload, size_t length, int64_t *evaluations, program_t *progs, int max );
+
+/* jit.c */
+execute_batch_t init_jit( void );
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT 1
+#include <sys/mman.h>
+#include <pthread.h>
+#else
+#define HAVE_JIT 0
+#endif
+
+#include "genetic_asm.h"
+
+/* Translate a run of instructions to machine code and call it, instead of
+ * dispatching every instruction. Genome registers map directly to
+ * xmm0-xmm15, or to ymm0-ymm15 holding two reference vectors each when the
+ * cpu has AVX2 (every instruction used works within 128-bit lanes). SSE4.1 is
+ * required either way. The generated function loops over the reference
+ * vectors:
+ *
+ *     mov     ecx, BATCH_REF / lanes
+ *     mov     rsi, pshufb_masks
+ * 1:  movdqu  xmmR, [rdi + R*stride]      for each register read
+ *     ...                                 the instructions
+ *     movdqu  [rdi + R*stride], xmmR      for each register written
+ *     add     rdi, 16 * lanes
+ *     dec     ecx
+ *     jnz     1b
+ *     ret
+ *
+ * Only the System V ABI is handled, where all vector registers are scratch.
+ * Every thread compiles into its own buffer, which a thread-specific key
+ * unmaps when the thread exits.
+ *
+ * Running freshly written code is expensive, around a microsecond per
+ * function on recent cpus, so this only beats the batch emulators when a
+ * program is run over many reference vectors. */
+
+#if HAVE_JIT
+
+/* Longest code: a 10 byte instruction per genome instruction, a load and a
+ * store of 9 bytes for every register, and the loop. */
+#define JIT_MAX_CODE (MAX_INSTR * 10 + NUM_REGS * 18 + 48)
+/* Writing over code that is still in the instruction cache or pipeline
+ * costs a full machine clear, so functions are appended to a ring, each on
+ * its own page, rather than reusing one spot. */
+#define JIT_BUFFER_SIZE (1 << 20)
+#define JIT_ALIGN 4096
+#define REG_STRIDE ((int)sizeof(batch_register_t))
+
+/* SSE2 mandatory prefix, or VEX pp field. */
+enum { PFX_66 = 1, PFX_F3, PFX_F2 };
+
+typedef void (*jit_func_t)( batch_register_t *registers );
+
+static __thread uint8_t *jit_buffer;
+static __thread size_t jit_pos;
+static pthread_key_t jit_key;
+static pthread_once_t jit_once = PTHREAD_ONCE_INIT;
+static int jit_lanes = 1;     /* reference vectors per register */
+
+/* Prefixes and opcode byte of an instruction in opcode map 1 (0f), 2 (0f 38)
+ * or 3 (0f 3a), with modrm.reg = reg, VEX.vvvv = vvvv (0 if unused, which
+ * encodes the same) and rm_ext set when modrm.rm names r8-r15. In SSE code
+ * vvvv is implied by reg. */
+static uint8_t *emit_opcode( uint8_t *p, int pfx, int map, int opcode, int reg, int vvvv, int rm_ext )
+{
+    static const uint8_t legacy[] = { 0, 0x66, 0xf3, 0xf2 };
+
+    if( jit_lanes == 2 )
+    {
+        *p++ = 0xc4;
+        *p++ = (reg < 8) << 7 | 1 << 6 | !rm_ext << 5 | map;
+        *p++ = (~vvvv & 15) << 3 | 1 << 2 | pfx;
+    }
+    else
+    {
+        *p++ = legacy[pfx];
+        if( reg >= 8 || rm_ext )
+            *p++ = 0x40 | (reg >= 8) << 2 | rm_ext;
+        *p++ = 0x0f;
+        if( map == 2 )
+            *p++ = 0x38;
+        else if( map == 3 )
+            *p++ = 0x3a;
+    }
+    *p++ = opcode;
+    return p;
+}
+
+/* Register operand form, modrm.rm = rm. */
+static uint8_t *emit_op( uint8_t *p, int pfx, int map, int opcode, int reg, int vvvv, int rm )
+{
+    p = emit_opcode( p, pfx, map, opcode, reg, vvvv, rm >= 8 );
+    *p++ = 0xc0 | (reg & 7) << 3 | (rm & 7);
+    return p;
+}
+
+/* movdqu between a register and [rdi + disp]; store selects the direction. */
+static uint8_t *emit_mem( uint8_t *p, int store, int reg, int disp )
+{
+    if( jit_lanes == 2 )
+    {
+        *p++ = 0xc4;
+        *p++ = (reg < 8) << 7 | 3 << 5 | 1;
+        *p++ = 15 << 3 | 1 << 2 | PFX_F3;
+    }
+    else
+    {
+        *p++ = 0xf3;
+        if( reg >= 8 )
+            *p++ = 0x44;
+        *p++ = 0x0f;
+    }
+    *p++ = store ? 0x7f : 0x6f;
+    if( disp < 128 )
+    {
+        *p++ = 0x47 | (reg & 7) << 3;
+        *p++ = disp;
+    }
+    else
+    {
+        *p++ = 0x87 | (reg & 7) << 3;
+        memcpy( p, &disp, 4 );
+        p += 4;
+    }
+    return p;
+}
+
+static uint8_t *emit_instruction( uint8_t *p, const instruction_t *instr )
+{
+    static const uint8_t unpack[] = { 0x61, 0x69, 0x62, 0x6a, 0x6c, 0x6d, 0x6f };
+    /* group opcode and /digit of the immediate shifts */
+    static const uint8_t shift[][2] = { { 0x73, 7 }, { 0x73, 3 }, { 0x73, 6 }, { 0x73, 2 },
+                                        { 0x72, 6 }, { 0x72, 2 } };
+    static const uint8_t shuffle_pfx[] = { PFX_F2, PFX_F3, PFX_66 };
+    int op = instr->opcode, dst = instr->operands[0], src = instr->operands[1] & 15;
+    int mask = instr->operands[2] * sizeof(pshufb_masks[0]);
+
+    if( op < MOVDQA )
+        p = emit_op( p, PFX_66, 1, unpack[op], dst, dst, src );
+    else if( op == MOVDQA )
+        p = emit_op( p, PFX_66, 1, unpack[op], dst, 0, src );
+    else if( op <= PSRLD )
+    {
+        p = emit_op( p, PFX_66, 1, shift[op-PSLLDQ][0], shift[op-PSLLDQ][1], dst, dst );
+        *p++ = instr->operands[2];
+    }
+    else if( op <= PSHUFD )
+    {
+        p = emit_op( p, shuffle_pfx[op-PSHUFLW], 1, 0x70, dst, 0, src );
+        *p++ = instr->operands[2];
+    }
+    else if( op == PSHUFB )
+    {
+        /* pshufb dst, [rsi + mask] */
+        p = emit_opcode( p, PFX_66, 2, 0x00, dst, dst, 0 );
+        *p++ = 0x86 | (dst & 7) << 3;
+        memcpy( p, &mask, 4 );
+        p += 4;
+    }
+    else
+    {
+        p = emit_op( p, PFX_66, 3, op == PALIGNR ? 0x0f : 0x0e, dst, dst, src );
+        *p++ = instr->operands[2];
+    }
+    return p;
+}
+
+static void jit_free( void *buf )
+{
+    munmap( buf, JIT_BUFFER_SIZE );
+}
+
+static void jit_key_create( void )
+{
+    pthread_key_create( &jit_key, jit_free );
+}
+
+static int jit_alloc( void )
+{
+    void *buf;
+
+    pthread_once( &jit_once, jit_key_create );
+    buf = mmap( NULL, JIT_BUFFER_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+    if( buf == MAP_FAILED )
+        return -1;
+    jit_buffer = buf;
+    pthread_setspecific( jit_key, buf );
+    return 0;
+}
+
+static void execute_batch_jit( const instruction_t *instr, int length, batch_register_t *registers )
+{
+    unsigned reads = 0, writes = 0;
+    uint8_t *p, *loop, *func;
+    const void *masks = pshufb_masks;
+    int count = BATCH_REF / jit_lanes, rel;
+
+    if( !jit_buffer && jit_alloc() < 0 )
+    {
+        fprintf( stderr, "Error: failed to map jit buffer\n" );
+        abort();
+    }
+
+    /* Registers read before being written need loading, every register
+     * written needs storing. */
+    for( int i = 0; i < length; i++ )
+    {
+        unsigned dst = 1 << instr[i].operands[0];
+        if( reads_src( &instr[i] ) && !(writes & (1 << instr[i].operands[1])) )
+            reads |= 1 << instr[i].operands[1];
+        if( reads_dst( &instr[i] ) && !(writes & dst) )
+            reads |= dst;
+        writes |= dst;
+    }
+
+    if( jit_pos > JIT_BUFFER_SIZE - JIT_MAX_CODE )
+        jit_pos = 0;
+    func = p = jit_buffer + jit_pos;
+    *p++ = 0xb9;                                /* mov ecx, imm32 */
+    memcpy( p, &count, 4 );
+    p += 4;
+    *p++ = 0x48; *p++ = 0xbe;                   /* mov rsi, imm64 */
+    memcpy( p, &masks, 8 );
+    p += 8;
+    loop = p;
+    for( int r = 0; r < NUM_REGS; r++ )
+        if( reads & (1 << r) )
+            p = emit_mem( p, 0, r, r * REG_STRIDE );
+    for( int i = 0; i < length; i++ )
+        p = emit_instruction( p, &instr[i] );
+    for( int r = 0; r < NUM_REGS; r++ )
+        if( writes & (1 << r) )
+            p = emit_mem( p, 1, r, r * REG_STRIDE );
+    *p++ = 0x48; *p++ = 0x83; *p++ = 0xc7;      /* add rdi, imm8 */
+    *p++ = jit_lanes * sizeof(xmm_register_t);
+    *p++ = 0xff; *p++ = 0xc9;                   /* dec ecx */
+    rel = loop - (p + 2);
+    if( rel >= -128 )
+    {
+        *p++ = 0x75;                            /* jnz rel8 */
+        *p++ = rel;
+    }
+    else
+    {
+        rel -= 4;
+        *p++ = 0x0f; *p++ = 0x85;               /* jnz rel32 */
+        memcpy( p, &rel, 4 );
+        p += 4;
+    }
+    if( jit_lanes == 2 )
+    {
+        *p++ = 0xc5; *p++ = 0xf8; *p++ = 0x77;  /* vzeroupper */
+    }
+    *p++ = 0xc3;                                /* ret */
+    jit_pos = (p - jit_buffer + JIT_ALIGN - 1) & ~(size_t)(JIT_ALIGN - 1);
+
+    ((jit_func_t)func)( registers );
+}
+
+#endif
+
+/* Returns the jit backend, or NULL if it cannot run here. */
+execute_batch_t init_jit( void )
+{
+#if HAVE_JIT
+#if defined(__GNUC__) && (__GNUC__ >= 5)
+    __builtin_cpu_init();
+    if( !__builtin_cpu_supports("sse4.1") )
+        return NULL;
+    jit_lanes = __builtin_cpu_supports("avx2") ? 2 : 1;
+#endif
+    if( jit_buffer || !jit_alloc() )
+        return execute_batch_jit;
+#endif
+    return NULL;
+}
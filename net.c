@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "genetic_asm.h"
+
+/* Transport between the coordinator and the workers of a distributed run.
+ * An address is "unix:PATH" for a UNIX socket or "HOST:PORT" for TCP, where
+ * an empty host listens on every interface.
+ *
+ * A message is a 32-bit type and a 32-bit payload length, then the payload,
+ * with every field little-endian:
+ *
+ *     NET_HELLO     worker: NET_VERSION and the configuration, which must
+ *                   match the coordinator's byte for byte
+ *     NET_WELCOME   coordinator: worker id, random seed
+ *     NET_REJECT    coordinator: the configurations differ
+ *     NET_MIGRANTS  either way: evaluations of the sender so far (64 bits),
+ *                   the number of programs, then each program packed as in
+ *                   a snapshot: fitness, cost, length and the instructions */
+
+#define NET_HEADER 8
+
+static uint8_t *put32( uint8_t *p, uint32_t v )
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+    return p + 4;
+}
+
+static uint32_t get32( const uint8_t *p )
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Split an address into a UNIX socket path or a TCP host and port. */
+static int resolve( const char *address, int passive, struct addrinfo **res, struct sockaddr_un *un )
+{
+    struct addrinfo hints;
+    char host[256];
+    const char *port = strrchr( address, ':' );
+
+    if (!strncmp( address, "unix:", 5 )) {
+        if (strlen( address + 5 ) >= sizeof(un->sun_path))
+            return -1;
+        memset( un, 0, sizeof(*un) );
+        un->sun_family = AF_UNIX;
+        strcpy( un->sun_path, address + 5 );
+        *res = NULL;
+        return 0;
+    }
+    if (!port || port - address >= (int)sizeof(host))
+        return -1;
+    memcpy( host, address, port - address );
+    host[port - address] = 0;
+
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    return getaddrinfo( *host ? host : NULL, port + 1, &hints, res ) ? -1 : 0;
+}
+
+/* Returns the listening socket, or -1. */
+int net_listen( const char *address )
+{
+    struct addrinfo *res, *ai;
+    struct sockaddr_un un;
+    int fd = -1, one = 1;
+
+    if (resolve( address, 1, &res, &un ) < 0) {
+        printf( "ERROR: invalid address %s\n", address );
+        return -1;
+    }
+    if (!res) {
+        unlink( un.sun_path );
+        fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if (fd >= 0 && (bind( fd, (struct sockaddr*)&un, sizeof(un) ) || listen( fd, 64 ))) {
+            close( fd );
+            fd = -1;
+        }
+    }
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+        if (fd < 0)
+            continue;
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+        if (bind( fd, ai->ai_addr, ai->ai_addrlen ) || listen( fd, 64 )) {
+            close( fd );
+            fd = -1;
+        }
+    }
+    if (res)
+        freeaddrinfo( res );
+    if (fd < 0)
+        printf( "ERROR: cannot listen on %s\n", address );
+    return fd;
+}
+
+int net_accept( int listener )
+{
+    int fd = accept( listener, NULL, NULL ), one = 1;
+
+    if (fd >= 0)
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    return fd;
+}
+
+/* Returns the connected socket, or -1. */
+int net_connect( const char *address )
+{
+    struct addrinfo *res, *ai;
+    struct sockaddr_un un;
+    int fd = -1, one = 1;
+
+    if (resolve( address, 0, &res, &un ) < 0) {
+        printf( "ERROR: invalid address %s\n", address );
+        return -1;
+    }
+    if (!res) {
+        fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if (fd >= 0 && connect( fd, (struct sockaddr*)&un, sizeof(un) )) {
+            close( fd );
+            fd = -1;
+        }
+    }
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+        if (fd < 0)
+            continue;
+        if (connect( fd, ai->ai_addr, ai->ai_addrlen )) {
+            close( fd );
+            fd = -1;
+            continue;
+        }
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    }
+    if (res)
+        freeaddrinfo( res );
+    if (fd < 0)
+        printf( "ERROR: cannot connect to %s\n", address );
+    return fd;
+}
+
+void net_open( net_connection_t *c, int fd )
+{
+    memset( c, 0, sizeof(*c) );
+    c->fd = fd;
+}
+
+void net_close( net_connection_t *c )
+{
+    if (c->fd >= 0)
+        close( c->fd );
+    free( c->buffer );
+    memset( c, 0, sizeof(*c) );
+    c->fd = -1;
+}
+
+int net_send( net_connection_t *c, int type, const uint8_t *payload, size_t length )
+{
+    uint8_t header[NET_HEADER];
+    struct iovec iov[2] = { { header, NET_HEADER }, { (void*)payload, length } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    put32( put32( header, type ), length );
+    while (iov[0].iov_len + iov[1].iov_len) {
+        ssize_t n = sendmsg( c->fd, &msg, MSG_NOSIGNAL );
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        for (int i = 0; i < 2; i++) {
+            size_t done = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (uint8_t*)iov[i].iov_base + done;
+            iov[i].iov_len -= done;
+            n -= done;
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 with the next message, 0 if none is complete and wait is 0, or
+ * -1 once the connection is closed or broken. The payload stays valid until
+ * the next call. */
+int net_receive( net_connection_t *c, int wait, int *type, const uint8_t **payload, size_t *length )
+{
+    memmove( c->buffer, c->buffer + c->consumed, c->used - c->consumed );
+    c->used -= c->consumed;
+    c->consumed = 0;
+
+    for (;;) {
+        size_t need = NET_HEADER;
+        ssize_t n;
+
+        if (c->used >= NET_HEADER) {
+            need += get32( c->buffer + 4 );
+            if (need > NET_MAX_MESSAGE)
+                return -1;
+            if (c->used >= need) {
+                *type = get32( c->buffer );
+                *payload = c->buffer + NET_HEADER;
+                *length = need - NET_HEADER;
+                c->consumed = need;
+                return 1;
+            }
+        }
+        if (c->capacity < need || c->capacity - c->used < 4096) {
+            size_t capacity = c->capacity ? 2 * c->capacity : 65536;
+            uint8_t *buffer = realloc( c->buffer, capacity );
+            if (!buffer)
+                return -1;
+            c->buffer = buffer;
+            c->capacity = capacity;
+        }
+        n = recv( c->fd, c->buffer + c->used, c->capacity - c->used, wait ? 0 : MSG_DONTWAIT );
+        if (n > 0)
+            c->used += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else
+            return -1;
+    }
+}
+
+static size_t pack_config( uint8_t *out, const net_config_t *config )
+{
+    const target_t *t = &config->target;
+    uint8_t *p = out;
+
+    p = put32( p, NET_VERSION );
+    p = put32( p, NUM_REF );
+    p = put32( p, NUM_INSTR );
+    p = put32( p, MAX_INSTR );
+    p = put32( p, config->fitness_type );
+    p = put32( p, config->isa );
+    p = put32( p, config->references );
+    p = put32( p, t->num_inputs );
+    p = put32( p, t->num_outputs );
+    memcpy( p, t->map, t->num_outputs * 8 );
+    return p + t->num_outputs * 8 - out;
+}
+
+/* Worker side of joining: returns 0 with the id and random seed the
+ * coordinator gave us, or -1. */
+int net_hello( net_connection_t *c, const net_config_t *config, int *id, int *seed )
+{
+    uint8_t hello[NET_CONFIG_SIZE];
+    const uint8_t *payload;
+    size_t length;
+    int type;
+
+    if (net_send( c, NET_HELLO, hello, pack_config( hello, config ) ) < 0 ||
+        net_receive( c, 1, &type, &payload, &length ) <= 0 ||
+        (type == NET_WELCOME && length != 8) || (type != NET_WELCOME && type != NET_REJECT)) {
+        printf( "ERROR: no answer from the coordinator\n" );
+        return -1;
+    }
+    if (type == NET_REJECT) {
+        printf( "ERROR: the coordinator runs another target or configuration\n" );
+        return -1;
+    }
+    *id = get32( payload );
+    *seed = get32( payload + 4 );
+    return 0;
+}
+
+/* Coordinator side: welcome a worker whose hello matches our configuration.
+ * Returns 0 if it was welcomed. */
+int net_welcome( net_connection_t *c, const uint8_t *payload, size_t length, const net_config_t *config,
+                 int id, int seed )
+{
+    uint8_t expected[NET_CONFIG_SIZE], welcome[8];
+    size_t size = pack_config( expected, config );
+
+    if (length != size || memcmp( payload, expected, size )) {
+        net_send( c, NET_REJECT, NULL, 0 );
+        return -1;
+    }
+    put32( put32( welcome, id ), seed );
+    return net_send( c, NET_WELCOME, welcome, sizeof(welcome) );
+}
+
+size_t net_pack_programs( uint8_t *out, int64_t evaluations, const program_t * const *progs, int num )
+{
+    uint8_t *p = out;
+
+    p = put32( put32( p, evaluations ), (uint64_t)evaluations >> 32 );
+    p = put32( p, num );
+    for (int i = 0; i < num; i++) {
+        int length = progs[i]->length[LEN_ABSOLUTE];
+        p = put32( p, progs[i]->fitness );
+        p = put32( p, progs[i]->cost );
+        p = put32( p, length );
+        memcpy( p, progs[i]->instructions, length * sizeof(instruction_t) );
+        p += length * sizeof(instruction_t);
+    }
+    return p - out;
+}
+
+/* Unpack at most max programs into progs, which need room for MAX_INSTR
+ * instructions. Returns the number of programs, or -1 if the message is
+ * malformed. */
+int net_unpack_programs( const uint8_t *payload, size_t length, int64_t *evaluations, program_t *progs, int max )
+{
+    const uint8_t *p = payload, *end = payload + length;
+    int num;
+
+    if (length < 12)
+        return -1;
+    *evaluations = get32( p ) | (int64_t)get32( p + 4 ) << 32;
+    num = get32( p + 8 );
+    p += 12;
+    if (num < 0 || num > max)
+        return -1;
+    for (int i = 0; i < num; i++) {
+        program_t *prog = &progs[i];
+        int len;
+
+        if (end - p < 12)
+            return -1;
+        prog->fitness = get32( p );
+        prog->cost = get32( p + 4 );
+        len = get32( p + 8 );
+        p += 12;
+        if (len < 0 || len > MAX_INSTR || end - p < (ptrdiff_t)(len * sizeof(instruction_t)))
+            return -1;
+        memcpy( prog->instructions, p, len * sizeof(instruction_t) );
+        p += len * sizeof(instruction_t);
+        for (int j = 0; j < len; j++)
+            if (prog->instructions[j].opcode >= NUM_INSTR || prog->instructions[j].operands[0] >= NUM_REGS ||
+                prog->instructions[j].operands[1] >= NUM_REGS)
+                return -1;
+        prog->length[LEN_ABSOLUTE] = len;
+        prog->length[LEN_EFFECTIVE] = 0;
+        prog->dirty = 0;
+        prog->credited = 0;
+    }
+    return p == end ? num : -1;
+}
@@ -0,0 +1,224 @@
+#include <string.h>
+
+#include "genetic_asm.h"
+
+/* Clean-up of a finished program, with the result in registers 0 to
+ * num_outputs-1. Each rewrite is kept only if the program still leaves the
+ * same values there for every reference vector and the cost model does not
+ * rate it worse:
+ *
+ *  - an instruction is dropped, or a shuffle replaced by the movdqa it
+ *    amounts to
+ *  - two shifts of the same kind, one right after the other on a register,
+ *    become one
+ *  - reads of a register copied with movdqa read the original instead
+ *  - a movdqa goes away by renaming its destination to its source from
+ *    there on, or its source to its destination since it was written
+ *
+ * Instructions the result no longer depends on go after each. Last, the
+ * instructions are listed critical path first. */
+
+typedef struct optimizer {
+    const batch_register_t *input;
+    batch_register_t expected[NUM_REGS];
+    int num_outputs;
+    instruction_t best[FINAL_INSTR];
+    int length;
+    int cost;
+} optimizer_t;
+
+/* Copy the instructions of a straight-line program that contribute to the
+ * live registers to out, returning how many there are. */
+int trim_program( const instruction_t *instr, int length, unsigned live, instruction_t *out )
+{
+    uint8_t keep[FINAL_INSTR];
+    int n = 0;
+
+    for (int i = length - 1; i >= 0; i--) {
+        keep[i] = (live >> instr[i].operands[0]) & 1;
+        if (!keep[i])
+            continue;
+        if (!reads_dst( &instr[i] ))
+            live &= ~(1 << instr[i].operands[0]);
+        if (reads_src( &instr[i] ))
+            live |= 1 << instr[i].operands[1];
+    }
+    for (int i = 0; i < length; i++)
+        if (keep[i])
+            out[n++] = instr[i];
+    return n;
+}
+
+static int reads( const instruction_t *instr, int reg )
+{
+    return (reads_dst( instr ) && instr->operands[0] == reg) ||
+           (reads_src( instr ) && instr->operands[1] == reg);
+}
+
+/* Keep the candidate if it is correct and better, or with worse = 0 just
+ * no worse. */
+static int try_program( optimizer_t *opt, const instruction_t *instr, int length, int worse )
+{
+    instruction_t trimmed[FINAL_INSTR];
+    batch_register_t registers[NUM_REGS];
+    int cost;
+
+    length = trim_program( instr, length, (1u << opt->num_outputs) - 1, trimmed );
+    cost = program_cost( trimmed, length );
+    if (cost > opt->cost || (cost == opt->cost && length > opt->length) ||
+        (worse && cost == opt->cost && length == opt->length))
+        return 0;
+
+    memcpy( registers, opt->input, sizeof(registers) );
+    execute_batch( trimmed, length, registers );
+    for (int o = 0; o < opt->num_outputs; o++)
+        if (memcmp( registers[o], opt->expected[o], sizeof(registers[o]) ))
+            return 0;
+
+    memcpy( opt->best, trimmed, length * sizeof(*trimmed) );
+    opt->length = length;
+    opt->cost = cost;
+    return 1;
+}
+
+static void rename_register( instruction_t *instr, int start, int end, int from, int to )
+{
+    for (int k = start; k < end; k++)
+        for (int o = 0; o < 2; o++)
+            if (instr[k].operands[o] == from && (o == 0 || reads_src( &instr[k] )))
+                instr[k].operands[o] = to;
+}
+
+static int shift_width( int opcode )
+{
+    return opcode <= PSRLDQ ? 16 : opcode <= PSRLQ ? 64 : 32;
+}
+
+/* Try the rewrites of instruction i, stopping at the first one kept. */
+static int rewrite( optimizer_t *opt, int i )
+{
+    instruction_t cand[FINAL_INSTR];
+    const instruction_t *in = &opt->best[i];
+    int n = opt->length, dst = in->operands[0], src = in->operands[1];
+
+#define CANDIDATE memcpy( cand, opt->best, n * sizeof(*cand) )
+#define DELETE(k) memmove( &cand[k], &cand[(k)+1], (n - (k) - 1) * sizeof(*cand) )
+
+    CANDIDATE;
+    DELETE(i);
+    if (try_program( opt, cand, n - 1, 1 ))
+        return 1;
+
+    if (in->opcode != MOVDQA && reads_src( in )) {
+        CANDIDATE;
+        cand[i].opcode = MOVDQA;
+        cand[i].operands[2] = 0;
+        if (try_program( opt, cand, n, 1 ))
+            return 1;
+    }
+
+    if (in->opcode >= PSLLDQ && in->opcode <= PSRLD) {
+        int j = i + 1;
+        while (j < n && !reads( &opt->best[j], dst ) && opt->best[j].operands[0] != dst)
+            j++;
+        if (j < n && opt->best[j].opcode == in->opcode && opt->best[j].operands[0] == dst) {
+            int count = in->operands[2] + opt->best[j].operands[2];
+            CANDIDATE;
+            cand[i].operands[2] = count < shift_width( in->opcode ) ? count : shift_width( in->opcode );
+            DELETE(j);
+            if (try_program( opt, cand, n - 1, 1 ))
+                return 1;
+        }
+    }
+
+    if (in->opcode == MOVDQA && dst != src) {
+        int k, d = i - 1;
+
+        CANDIDATE;
+        for (k = i + 1; k < n; k++) {
+            if (reads_src( &cand[k] ) && cand[k].operands[1] == dst)
+                cand[k].operands[1] = src;
+            if (cand[k].operands[0] == dst || cand[k].operands[0] == src)
+                break;
+        }
+        if (try_program( opt, cand, n, 1 ))
+            return 1;
+
+        CANDIDATE;
+        rename_register( cand, i + 1, n, dst, src );
+        DELETE(i);
+        if (try_program( opt, cand, n - 1, 1 ))
+            return 1;
+
+        while (d >= 0 && opt->best[d].operands[0] != src)
+            d--;
+        if (d >= 0) {
+            CANDIDATE;
+            rename_register( cand, d, i, src, dst );
+            DELETE(i);
+            if (try_program( opt, cand, n - 1, 1 ))
+                return 1;
+        }
+    }
+#undef CANDIDATE
+#undef DELETE
+    return 0;
+}
+
+/* Whether instruction j may not move ahead of an earlier instruction i. */
+static int depends( const instruction_t *i, const instruction_t *j )
+{
+    return reads( j, i->operands[0] ) || reads( i, j->operands[0] ) || i->operands[0] == j->operands[0];
+}
+
+/* List scheduling: of the instructions with nothing left to wait for, take
+ * the one heading the longest chain of latencies to the end. */
+static void schedule( const instruction_t *instr, int n, instruction_t *out )
+{
+    int height[FINAL_INSTR], waiting[FINAL_INSTR] = { 0 };
+    uint8_t done[FINAL_INSTR] = { 0 };
+
+    for (int i = n - 1; i >= 0; i--) {
+        int latency = instruction_latency( instr[i].opcode );
+        height[i] = latency;
+        for (int j = i + 1; j < n; j++) {
+            if (reads( &instr[j], instr[i].operands[0] ) && height[i] < latency + height[j])
+                height[i] = latency + height[j];
+            waiting[j] += depends( &instr[i], &instr[j] );
+        }
+    }
+
+    for (int m = 0; m < n; m++) {
+        int pick = -1;
+        for (int j = 0; j < n; j++)
+            if (!done[j] && !waiting[j] && (pick < 0 || height[j] > height[pick]))
+                pick = j;
+        done[pick] = 1;
+        out[m] = instr[pick];
+        for (int j = pick + 1; j < n; j++)
+            waiting[j] -= depends( &instr[pick], &instr[j] );
+    }
+}
+
+/* Rewrite the program in place, returning its new length. input holds the
+ * interleaved reference inputs. */
+int optimize_program( instruction_t *instr, int length, int num_outputs, const batch_register_t *input )
+{
+    optimizer_t opt;
+    instruction_t scheduled[FINAL_INSTR];
+
+    opt.input = input;
+    opt.num_outputs = num_outputs;
+    memcpy( opt.expected, input, sizeof(opt.expected) );
+    execute_batch( instr, length, opt.expected );
+    opt.length = trim_program( instr, length, (1u << num_outputs) - 1, opt.best );
+    opt.cost = program_cost( opt.best, opt.length );
+
+    for (int i = 0; i < opt.length; )
+        i = rewrite( &opt, i ) ? 0 : i + 1;
+
+    schedule( opt.best, opt.length, scheduled );
+    try_program( &opt, scheduled, opt.length, 0 );
+    memcpy( instr, opt.best, opt.length * sizeof(*instr) );
+    return opt.length;
+}
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+
+#include "genetic_asm.h"
+
+/* Binary max-heap over the population ordered by program_better(), so the
+ * program to be replaced next is always at the root and a changed program
+ * is moved back into place in O(log N). */
+
+static inline int heap_worse( const rank_t *rank, int a, int b )
+{
+    return program_better( &rank->programs[rank->heap[b]], &rank->programs[rank->heap[a]] );
+}
+
+static inline void heap_swap( rank_t *rank, int a, int b )
+{
+    int t = rank->heap[a];
+    rank->heap[a] = rank->heap[b];
+    rank->heap[b] = t;
+    rank->pos[rank->heap[a]] = a;
+    rank->pos[rank->heap[b]] = b;
+}
+
+static int sift_up( rank_t *rank, int i )
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heap_worse( rank, i, parent ))
+            break;
+        heap_swap( rank, i, parent );
+        i = parent;
+    }
+    return i;
+}
+
+static void sift_down( rank_t *rank, int i )
+{
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= rank->size)
+            break;
+        if (child + 1 < rank->size && heap_worse( rank, child + 1, child ))
+            child++;
+        if (!heap_worse( rank, child, i ))
+            break;
+        heap_swap( rank, i, child );
+        i = child;
+    }
+}
+
+int rank_init( rank_t *rank, const program_t *programs, int num_programs )
+{
+    rank->programs = programs;
+    rank->size = num_programs;
+    rank->heap = malloc( num_programs * sizeof(*rank->heap) );
+    rank->pos = malloc( num_programs * sizeof(*rank->pos) );
+    if (!rank->heap || !rank->pos)
+        return -1;
+    for (int i = 0; i < num_programs; i++)
+        rank->heap[i] = rank->pos[i] = i;
+    for (int i = num_programs / 2 - 1; i >= 0; i--)
+        sift_down( rank, i );
+    return 0;
+}
+
+/* Rebuild a heap saved earlier, so ties between equal programs are broken
+ * the same way as before. heap must be a permutation of the programs. */
+int rank_load( rank_t *rank, const program_t *programs, const int *heap, int num_programs )
+{
+    rank->programs = programs;
+    rank->size = num_programs;
+    rank->heap = malloc( num_programs * sizeof(*rank->heap) );
+    rank->pos = malloc( num_programs * sizeof(*rank->pos) );
+    if (!rank->heap || !rank->pos)
+        return -1;
+    for (int i = 0; i < num_programs; i++)
+        rank->pos[i] = -1;
+    for (int i = 0; i < num_programs; i++) {
+        if (heap[i] < 0 || heap[i] >= num_programs || rank->pos[heap[i]] >= 0)
+            return -1;
+        rank->heap[i] = heap[i];
+        rank->pos[heap[i]] = i;
+    }
+    return 0;
+}
+
+void rank_free( rank_t *rank )
+{
+    free( rank->heap );
+    free( rank->pos );
+    rank->heap = rank->pos = NULL;
+}
+
+/* Restore the heap after the fitness or cost of program idx changed. */
+void rank_update( rank_t *rank, int idx )
+{
+    int i = rank->pos[idx];
+
+    if (sift_up( rank, i ) == i)
+        sift_down( rank, i );
+}
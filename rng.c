@@ -0,0 +1,57 @@
+#include <stddef.h>
+
+#include "genetic_asm.h"
+
+/* xoshiro256** streams. A stream is seeded through splitmix64, so any seed,
+ * even 0, gives a well mixed state, and rng_jump() moves it ahead by 2^128
+ * draws: stream i of a seed is the seeded state jumped i times, and no two
+ * streams of a run ever overlap. */
+
+static uint64_t splitmix64( uint64_t *x )
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed( rng_t *rng, uint64_t seed )
+{
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = splitmix64( &seed );
+}
+
+void rng_jump( rng_t *rng )
+{
+    static const uint64_t jump[4] =
+        { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t s[4] = { 0 };
+
+    for (int i = 0; i < 4; i++)
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] >> b & 1)
+                for (int j = 0; j < 4; j++)
+                    s[j] ^= rng->s[j];
+            rng_next( rng );
+        }
+    for (int j = 0; j < 4; j++)
+        rng->s[j] = s[j];
+}
+
+/* n draws below the same bound. The threshold of rng_bounded() is only
+ * worked out once, if any draw lands in the biased range at all. */
+void rng_fill_bounded( rng_t *rng, uint32_t bound, uint32_t *out, int n )
+{
+    uint32_t threshold = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t m = (rng_next( rng ) >> 32) * bound;
+        if ((uint32_t)m < bound) {
+            if (!threshold)
+                threshold = -bound % bound;
+            while ((uint32_t)m < threshold)
+                m = (rng_next( rng ) >> 32) * bound;
+        }
+        out[i] = m >> 32;
+    }
+}
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "genetic_asm.h"
+
+/* Reader for programs in the syntax print_instruction() writes:
+ *
+ *     punpcklwd m0, m1
+ *     psrldq m2, 8
+ *     pshuflw m0, m1, 0x1b
+ *     pshufb m3, 5
+ *
+ * Programs are separated by blank lines, so printed programs can be pasted
+ * as they are: the length, fitness and cost lines print_program() puts
+ * before each one also start a new program. ';' and '#' begin comments.
+ * The whole file is read at once and scanned in place. */
+
+const char * const instruction_names[NUM_INSTR] =
+{
+    [PUNPCKLWD]  = "punpcklwd",  [PUNPCKHWD]  = "punpckhwd",
+    [PUNPCKLDQ]  = "punpckldq",  [PUNPCKHDQ]  = "punpckhdq",
+    [PUNPCKLQDQ] = "punpcklqdq", [PUNPCKHQDQ] = "punpckhqdq",
+    [MOVDQA]     = "movdqa",
+    [PSLLDQ]     = "pslldq",     [PSRLDQ]     = "psrldq",
+    [PSLLQ]      = "psllq",      [PSRLQ]      = "psrlq",
+    [PSLLD]      = "pslld",      [PSRLD]      = "psrld",
+    [PSHUFLW]    = "pshuflw",    [PSHUFHW]    = "pshufhw",
+    [PSHUFD]     = "pshufd",     [PALIGNR]    = "palignr",
+    [PSHUFB]     = "pshufb",     [PBLENDW]    = "pblendw",
+};
+
+static const char *skip_space( const char *p )
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+/* Parse "mN" or "xmmN" followed by an optional comma. */
+static const char *parse_register( const char *p, uint8_t *reg )
+{
+    int n = 0;
+
+    p = skip_space( p );
+    if (!strncmp( p, "xmm", 3 ))
+        p += 3;
+    else if (*p == 'm')
+        p++;
+    else
+        return NULL;
+    if (*p < '0' || *p > '9')
+        return NULL;
+    for ( ; *p >= '0' && *p <= '9'; p++)
+        if ((n = n * 10 + *p - '0') >= NUM_REGS)
+            return NULL;
+    *reg = n;
+    p = skip_space( p );
+    return *p == ',' ? p + 1 : p;
+}
+
+static const char *parse_immediate( const char *p, uint8_t *imm )
+{
+    char *end;
+    long n = strtol( p, &end, 0 );
+
+    if (end == p || n < 0 || n > UINT8_MAX)
+        return NULL;
+    *imm = n;
+    return end;
+}
+
+/* Returns the end of the instruction, or NULL if the line is not one. */
+static const char *parse_instruction( const char *p, instruction_t *instr )
+{
+    int len = 0, op;
+
+    while ((p[len] >= 'a' && p[len] <= 'z') || (p[len] >= '0' && p[len] <= '9'))
+        len++;
+    for (op = 0; op < NUM_INSTR; op++)
+        if (!strncmp( p, instruction_names[op], len ) && !instruction_names[op][len])
+            break;
+    if (op == NUM_INSTR)
+        return NULL;
+    p += len;
+
+    memset( instr, 0, sizeof(*instr) );
+    instr->opcode = op;
+    if (!(p = parse_register( p, &instr->operands[0] )))
+        return NULL;
+    if (op < PSLLDQ)
+        return parse_register( p, &instr->operands[1] );
+    if (op < PSHUFLW || op == PSHUFB)
+        return parse_immediate( p, &instr->operands[2] );
+    if (!(p = parse_register( p, &instr->operands[1] )))
+        return NULL;
+    return parse_immediate( p, &instr->operands[2] );
+}
+
+static int end_program( seed_corpus_t *corpus, int length )
+{
+    int *start;
+
+    if (!length)
+        return 0;
+    start = realloc( corpus->start, (corpus->num_programs + 2) * sizeof(*start) );
+    if (!start)
+        return -1;
+    corpus->start = start;
+    corpus->start[corpus->num_programs + 1] = corpus->start[corpus->num_programs] + length;
+    corpus->num_programs++;
+    return 0;
+}
+
+int load_seed_file( seed_corpus_t *corpus, const char *path )
+{
+    FILE *f = fopen( path, "rb" );
+    char *text = NULL, *line, *next;
+    long size;
+    int capacity = 0, num_instr = 0, length = 0, lineno = 0;
+
+    memset( corpus, 0, sizeof(*corpus) );
+    if (!f || fseek( f, 0, SEEK_END ) || (size = ftell( f )) < 0 || fseek( f, 0, SEEK_SET ) ||
+        !(text = malloc( size + 1 )) || fread( text, 1, size, f ) != (size_t)size) {
+        printf( "ERROR: cannot read seed file %s\n", path );
+        goto fail;
+    }
+    fclose( f );
+    f = NULL;
+    text[size] = 0;
+    corpus->start = calloc( 1, sizeof(*corpus->start) );
+    if (!corpus->start)
+        goto fail;
+
+    for (line = text; line; line = next) {
+        const char *p, *end;
+        char *c;
+
+        lineno++;
+        next = strchr( line, '\n' );
+        if (next)
+            *next++ = 0;
+        if ((c = strpbrk( line, ";#\r" )))
+            *c = 0;
+        p = skip_space( line );
+
+        if (!*p || !strncmp( p, "length", 6 ) || !strncmp( p, "fitness", 7 ) || !strncmp( p, "cost", 4 )) {
+            if (end_program( corpus, length ) < 0)
+                goto fail;
+            length = 0;
+            continue;
+        }
+        if (length == MAX_INSTR) {
+            printf( "ERROR: %s:%d: program longer than %d instructions\n", path, lineno, MAX_INSTR );
+            goto fail;
+        }
+
+        if (num_instr == capacity) {
+            instruction_t *instr;
+            capacity = capacity ? capacity * 2 : 1024;
+            instr = realloc( corpus->instructions, capacity * sizeof(*instr) );
+            if (!instr)
+                goto fail;
+            corpus->instructions = instr;
+        }
+        end = parse_instruction( p, &corpus->instructions[num_instr] );
+        if (!end || *skip_space( end )) {
+            printf( "ERROR: %s:%d: cannot parse '%s'\n", path, lineno, p );
+            goto fail;
+        }
+        num_instr++;
+        length++;
+    }
+    if (end_program( corpus, length ) < 0)
+        goto fail;
+
+    free( text );
+    return 0;
+
+fail:
+    if (f)
+        fclose( f );
+    free( text );
+    seed_free( corpus );
+    return -1;
+}
+
+void seed_free( seed_corpus_t *corpus )
+{
+    free( corpus->instructions );
+    free( corpus->start );
+    memset( corpus, 0, sizeof(*corpus) );
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "genetic_asm.h"
+
+/* The function to evolve, as a map from output words to input words. The
+ * input words fill registers 0 to num_inputs-1 eight to a register, and the
+ * result is expected in registers 0 to num_outputs-1.
+ *
+ * Besides the built-in scans, a target can be read from a file holding the
+ * number of input registers and then the input word of every output word,
+ * eight per output register:
+ *
+ *     inputs 2
+ *     0 4 1 2 5 8 12 9
+ *     6 3 7 10 13 14 11 15
+ *
+ * '#' starts a comment. */
+
+/* Scan tables as in x264: level[i] = dct[x*N+y]. */
+#define ZIG4(i,y,x) [i] = x*4+y,
+#define ZIG8(i,y,x) [i] = x*8+y,
+
+static const uint8_t zigzag_4x4_frame[16] =
+{
+    ZIG4( 0,0,0) ZIG4( 1,0,1) ZIG4( 2,1,0) ZIG4( 3,2,0)
+    ZIG4( 4,1,1) ZIG4( 5,0,2) ZIG4( 6,0,3) ZIG4( 7,1,2)
+    ZIG4( 8,2,1) ZIG4( 9,3,0) ZIG4(10,3,1) ZIG4(11,2,2)
+    ZIG4(12,1,3) ZIG4(13,2,3) ZIG4(14,3,2) ZIG4(15,3,3)
+};
+
+static const uint8_t zigzag_4x4_field[16] =
+{
+    ZIG4( 0,0,0) ZIG4( 1,1,0) ZIG4( 2,0,1) ZIG4( 3,2,0)
+    ZIG4( 4,3,0) ZIG4( 5,1,1) ZIG4( 6,2,1) ZIG4( 7,3,1)
+    ZIG4( 8,0,2) ZIG4( 9,1,2) ZIG4(10,2,2) ZIG4(11,3,2)
+    ZIG4(12,0,3) ZIG4(13,1,3) ZIG4(14,2,3) ZIG4(15,3,3)
+};
+
+static const uint8_t zigzag_8x8_frame[64] =
+{
+    ZIG8( 0,0,0) ZIG8( 1,0,1) ZIG8( 2,1,0) ZIG8( 3,2,0)
+    ZIG8( 4,1,1) ZIG8( 5,0,2) ZIG8( 6,0,3) ZIG8( 7,1,2)
+    ZIG8( 8,2,1) ZIG8( 9,3,0) ZIG8(10,4,0) ZIG8(11,3,1)
+    ZIG8(12,2,2) ZIG8(13,1,3) ZIG8(14,0,4) ZIG8(15,0,5)
+    ZIG8(16,1,4) ZIG8(17,2,3) ZIG8(18,3,2) ZIG8(19,4,1)
+    ZIG8(20,5,0) ZIG8(21,6,0) ZIG8(22,5,1) ZIG8(23,4,2)
+    ZIG8(24,3,3) ZIG8(25,2,4) ZIG8(26,1,5) ZIG8(27,0,6)
+    ZIG8(28,0,7) ZIG8(29,1,6) ZIG8(30,2,5) ZIG8(31,3,4)
+    ZIG8(32,4,3) ZIG8(33,5,2) ZIG8(34,6,1) ZIG8(35,7,0)
+    ZIG8(36,7,1) ZIG8(37,6,2) ZIG8(38,5,3) ZIG8(39,4,4)
+    ZIG8(40,3,5) ZIG8(41,2,6) ZIG8(42,1,7) ZIG8(43,2,7)
+    ZIG8(44,3,6) ZIG8(45,4,5) ZIG8(46,5,4) ZIG8(47,6,3)
+    ZIG8(48,7,2) ZIG8(49,7,3) ZIG8(50,6,4) ZIG8(51,5,5)
+    ZIG8(52,4,6) ZIG8(53,3,7) ZIG8(54,4,7) ZIG8(55,5,6)
+    ZIG8(56,6,5) ZIG8(57,7,4) ZIG8(58,7,5) ZIG8(59,6,6)
+    ZIG8(60,5,7) ZIG8(61,6,7) ZIG8(62,7,6) ZIG8(63,7,7)
+};
+
+static const uint8_t zigzag_8x8_field[64] =
+{
+    ZIG8( 0,0,0) ZIG8( 1,1,0) ZIG8( 2,2,0) ZIG8( 3,0,1)
+    ZIG8( 4,1,1) ZIG8( 5,3,0) ZIG8( 6,4,0) ZIG8( 7,2,1)
+    ZIG8( 8,0,2) ZIG8( 9,3,1) ZIG8(10,5,0) ZIG8(11,6,0)
+    ZIG8(12,7,0) ZIG8(13,4,1) ZIG8(14,1,2) ZIG8(15,0,3)
+    ZIG8(16,2,2) ZIG8(17,5,1) ZIG8(18,6,1) ZIG8(19,7,1)
+    ZIG8(20,3,2) ZIG8(21,1,3) ZIG8(22,0,4) ZIG8(23,2,3)
+    ZIG8(24,4,2) ZIG8(25,5,2) ZIG8(26,6,2) ZIG8(27,7,2)
+    ZIG8(28,3,3) ZIG8(29,1,4) ZIG8(30,0,5) ZIG8(31,2,4)
+    ZIG8(32,4,3) ZIG8(33,5,3) ZIG8(34,6,3) ZIG8(35,7,3)
+    ZIG8(36,3,4) ZIG8(37,1,5) ZIG8(38,0,6) ZIG8(39,2,5)
+    ZIG8(40,4,4) ZIG8(41,5,4) ZIG8(42,6,4) ZIG8(43,7,4)
+    ZIG8(44,3,5) ZIG8(45,1,6) ZIG8(46,2,6) ZIG8(47,4,5)
+    ZIG8(48,5,5) ZIG8(49,6,5) ZIG8(50,7,5) ZIG8(51,3,6)
+    ZIG8(52,0,7) ZIG8(53,1,7) ZIG8(54,4,6) ZIG8(55,5,6)
+    ZIG8(56,6,6) ZIG8(57,7,6) ZIG8(58,2,7) ZIG8(59,3,7)
+    ZIG8(60,4,7) ZIG8(61,5,7) ZIG8(62,6,7) ZIG8(63,7,7)
+};
+
+static const struct {
+    const char *name;
+    const uint8_t *map;
+    int num_words;
+} builtin_targets[] =
+{
+    { "4x4-frame", zigzag_4x4_frame, 16 },
+    { "4x4-field", zigzag_4x4_field, 16 },
+    { "8x8-frame", zigzag_8x8_frame, 64 },
+    { "8x8-field", zigzag_8x8_field, 64 },
+};
+
+#define NUM_BUILTIN_TARGETS ((int)(sizeof(builtin_targets) / sizeof(builtin_targets[0])))
+
+static int load_target( target_t *target, const char *path )
+{
+    FILE *f = fopen( path, "r" );
+    char line[1024];
+    int lineno = 0, words = 0;
+
+    if (!f) {
+        printf( "ERROR: unknown target %s\n", path );
+        return -1;
+    }
+    target->num_inputs = 0;
+    while (fgets( line, sizeof(line), f )) {
+        char *p = line, *end, *c;
+
+        lineno++;
+        if ((c = strchr( line, '#' )))
+            *c = 0;
+        if (!target->num_inputs) {
+            p += strspn( p, " \t\r\n" );
+            if (*p && (sscanf( p, "inputs %d", &target->num_inputs ) != 1 ||
+                       target->num_inputs < 1 || target->num_inputs > NUM_REGS))
+                goto invalid;
+            continue;
+        }
+        for (;;) {
+            long word = strtol( p, &end, 0 );
+            if (end == p)
+                break;
+            if (word < 0 || word >= target->num_inputs * 8 || words == MAX_TARGET_WORDS)
+                goto invalid;
+            target->map[words++] = word;
+            p = end;
+        }
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p)
+            goto invalid;
+    }
+    fclose( f );
+
+    if (!target->num_inputs || !words || words % 8) {
+        printf( "ERROR: target %s needs an inputs line and eight words per output register\n", path );
+        return -1;
+    }
+    target->num_outputs = words / 8;
+    return 0;
+
+invalid:
+    printf( "ERROR: %s:%d: invalid target\n", path, lineno );
+    fclose( f );
+    return -1;
+}
+
+/* name is one of the built-in scans or a target file. */
+int init_target( target_t *target, const char *name )
+{
+    for (int i = 0; i < NUM_BUILTIN_TARGETS; i++)
+        if (!strcmp( name, builtin_targets[i].name )) {
+            target->num_inputs = target->num_outputs = builtin_targets[i].num_words / 8;
+            memcpy( target->map, builtin_targets[i].map, builtin_targets[i].num_words );
+            return 0;
+        }
+    return load_target( target, name );
+}
+
+/* Whether a target read back from elsewhere is one init_target() could have
+ * built. */
+int target_valid( const target_t *target )
+{
+    if (target->num_inputs < 1 || target->num_inputs > NUM_REGS ||
+        target->num_outputs < 1 || target->num_outputs > NUM_REGS)
+        return 0;
+    for (int i = 0; i < target->num_outputs * 8; i++)
+        if (target->map[i] >= target->num_inputs * 8)
+            return 0;
+    return 1;
+}
+
+/* Clear the registers past the inputs and compute the expected output. */
+void apply_target( const target_t *target, reference_t *ref )
+{
+    int r;
+
+    ref->num_regs_used[0] = target->num_inputs;
+    ref->num_regs_used[1] = target->num_outputs;
+    for (r = target->num_inputs; r < NUM_REGS; r++)
+        memset( &ref->input[r], 0, sizeof(ref->input[0]) );
+    for (r = 0; r < target->num_outputs * 8; r++)
+        ref->output[r/8].wd[r%8] = ref->input[target->map[r] / 8].wd[target->map[r] % 8];
+    for (r = target->num_outputs; r < NUM_REGS; r++)
+        memset( &ref->output[r], 0, sizeof(ref->output[0]) );
+}